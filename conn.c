@@ -31,6 +31,22 @@ on_ignore(Ms *a, Tube *t, size_t i)
     tube_dref(t);
 }
 
+static void
+on_from(Ms *a, Tube *t, size_t i)
+{
+    UNUSED_PARAMETER(a);
+    UNUSED_PARAMETER(i);
+    tube_iref(t);
+}
+
+static void
+on_unfrom(Ms *a, Tube *t, size_t i)
+{
+    UNUSED_PARAMETER(a);
+    UNUSED_PARAMETER(i);
+    tube_dref(t);
+}
+
 Conn *
 make_conn(int fd, char start_state, Tube *use, Tube *watch)
 {
@@ -41,6 +57,8 @@ make_conn(int fd, char start_state, Tube *use, Tube *watch)
     }
 
     ms_init(&c->watch, (ms_event_fn) on_watch, (ms_event_fn) on_ignore);
+    ms_init(&c->from, (ms_event_fn) on_from, (ms_event_fn) on_unfrom);
+    ms_init(&c->fanout, (ms_event_fn) on_from, (ms_event_fn) on_unfrom);
     if (!ms_append(&c->watch, watch)) {
         free(c);
         twarn("OOM");
@@ -56,8 +74,9 @@ make_conn(int fd, char start_state, Tube *use, Tube *watch)
     c->tickpos = 0; // Does not mean anything if in_conns is set to 0.
     c->in_conns = 0;
 
-    // The list is empty.
+    // The lists are empty.
     job_list_reset(&c->reserved_jobs);
+    job_list_reset(&c->batch);
 
     /* stats */
     cur_conn_ct++;
@@ -120,7 +139,9 @@ conntickat(Conn *c)
     int margin = 0, should_timeout = 0;
     int64 t = INT64_MAX;
 
-    if (conn_waiting(c)) {
+    // A subscribed conn waits between commands and gets no
+    // DEADLINE_SOON, so its jobs just time out.
+    if (conn_waiting(c) && !c->credits) {
         margin = SAFETY_MARGIN;
     }
 
@@ -129,7 +150,7 @@ conntickat(Conn *c)
         should_timeout = 1;
     }
     if (c->pending_timeout >= 0) {
-        t = min(t, ((int64)c->pending_timeout) * 1000000000);
+        t = min(t, c->pending_timeout);
         should_timeout = 1;
     }
 
@@ -188,7 +209,11 @@ conn_reserve_job(Conn *c, Job *j) {
 
     j->r.deadline_at = nanoseconds() + j->r.ttr;
     j->r.state = Reserved;
+    if (j->group) {
+        group_reserve(j->group);
+    }
     job_list_insert(&c->reserved_jobs, j);
+    c->reserved_ct++;
     j->reserver = c;
     c->pending_timeout = -1;
     conn_set_soonestjob(c, j);
@@ -209,14 +234,23 @@ int
 conn_ready(Conn *c)
 {
     size_t i;
+    Ms *l = connresvtubes(c);
 
-    for (i = 0; i < c->watch.len; i++) {
-        if (((Tube *) c->watch.items[i])->ready.len)
+    for (i = 0; i < l->len; i++) {
+        if (((Tube *) l->items[i])->ready.len)
             return 1;
     }
     return 0;
 }
 
+// connresvtubes returns the tubes c reserves jobs from: those named
+// by a pending reserve-from, otherwise the ones it watches.
+Ms *
+connresvtubes(Conn *c)
+{
+    return c->from.len ? &c->from : &c->watch;
+}
+
 
 int
 conn_less(void *ca, void *cb)
@@ -234,22 +268,43 @@ conn_setpos(void *c, size_t i)
 }
 
 
+// connfreeout lets go of what c was sending after its reply line.
+void
+connfreeout(Conn *c)
+{
+    if (c->out_job) {
+        job_unref(c->out_job);
+        c->out_job = NULL;
+    }
+    free(c->out_data);
+    c->out_data = NULL;
+    c->out_len = 0;
+}
+
+
 void
 connclose(Conn *c)
 {
+    int i;
+
     sockwant(&c->sock, 0);
+    if (c->walwait) {
+        for (i = 0; i < c->srv->nwal; i++) {
+            walqunwait(c->srv->wals[i], c);
+        }
+    }
     close(c->sock.fd);
     if (verbose) {
         printf("close %d\n", c->sock.fd);
     }
 
     job_free(c->in_job);
+    while (!job_list_is_empty(&c->batch)) {
+        job_free(job_list_remove(c->batch.next));
+    }
 
-    /* was this a peek or stats command? */
-    if (c->out_job && c->out_job->r.state == Copy)
-        job_free(c->out_job);
-
-    c->in_job = c->out_job = NULL;
+    connfreeout(c);
+    c->in_job = NULL;
     c->in_job_read = 0;
 
     if (c->type & CONN_TYPE_PRODUCER) cur_producer_ct--; /* stats */
@@ -262,6 +317,8 @@ connclose(Conn *c)
         enqueue_reserved_jobs(c);
 
     ms_clear(&c->watch);
+    ms_clear(&c->from);
+    ms_clear(&c->fanout);
     c->use->using_ct--;
     TUBE_ASSIGN(c->use, NULL);
 
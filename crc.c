@@ -0,0 +1,168 @@
+#include "dat.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRCSSE42 1
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRCARM 1
+#endif
+
+// CRC-32C (Castagnoli) in reflected form, as computed by
+// the SSE 4.2 crc32 instruction.
+enum
+{
+    Crcpoly = 0x82f63b78
+};
+
+static uint32 crctab[8][256];
+static pthread_once_t tabonce = PTHREAD_ONCE_INIT;
+static pthread_once_t pickonce = PTHREAD_ONCE_INIT;
+
+static uint32 crcinit(uint32, void*, size_t);
+
+Crc32c *crc32c = &crcinit;
+
+
+static void
+mktab(void)
+{
+    uint32 c;
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ Crcpoly : c >> 1;
+        }
+        crctab[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        c = crctab[0][i];
+        for (k = 1; k < 8; k++) {
+            c = crctab[0][c & 0xff] ^ (c >> 8);
+            crctab[k][i] = c;
+        }
+    }
+}
+
+
+// Crc32csw is the portable implementation of crc32c.
+// It processes eight bytes at a time ("slicing-by-8").
+uint32
+crc32csw(uint32 crc, void *buf, size_t n)
+{
+    byte *p = buf;
+    uint32 c = ~crc, lo, hi;
+
+    pthread_once(&tabonce, mktab);
+
+    for (; n && ((uintptr_t)p & 3); n--) {
+        c = crctab[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        lo = c ^ ((uint32)p[0] | (uint32)p[1]<<8 |
+                  (uint32)p[2]<<16 | (uint32)p[3]<<24);
+        hi = (uint32)p[4] | (uint32)p[5]<<8 |
+             (uint32)p[6]<<16 | (uint32)p[7]<<24;
+        c = crctab[7][lo & 0xff] ^ crctab[6][(lo >> 8) & 0xff] ^
+            crctab[5][(lo >> 16) & 0xff] ^ crctab[4][lo >> 24] ^
+            crctab[3][hi & 0xff] ^ crctab[2][(hi >> 8) & 0xff] ^
+            crctab[1][(hi >> 16) & 0xff] ^ crctab[0][hi >> 24];
+    }
+    while (n--) {
+        c = crctab[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+
+#ifdef CRCSSE42
+__attribute__((target("sse4.2")))
+static uint32
+crcsse42(uint32 crc, void *buf, size_t n)
+{
+    byte *p = buf;
+    uint64 c = ~crc, v;
+
+    for (; n && ((uintptr_t)p & 7); n--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    while (n--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return ~(uint32)c;
+}
+#endif
+
+
+#ifdef CRCARM
+static uint32
+crcarm(uint32 crc, void *buf, size_t n)
+{
+    byte *p = buf;
+    uint32 c = ~crc;
+    uint64 v;
+
+    for (; n && ((uintptr_t)p & 7); n--) {
+        c = __crc32cb(c, *p++);
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+    }
+    while (n--) {
+        c = __crc32cb(c, *p++);
+    }
+    return ~c;
+}
+#endif
+
+
+// pick picks the fastest implementation this CPU supports
+// and installs it as crc32c.
+static void
+pick(void)
+{
+    Crc32c *f = &crc32csw;
+
+    pthread_once(&tabonce, mktab);
+#ifdef CRCSSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        f = &crcsse42;
+    }
+#endif
+#ifdef CRCARM
+    f = &crcarm;
+#endif
+    crc32c = f;
+}
+
+
+// crcinit is crc32c until the first call, which sets it up.
+static uint32
+crcinit(uint32 crc, void *buf, size_t n)
+{
+    crcsetup();
+    return crc32c(crc, buf, n);
+}
+
+
+// Crcsetup sets up crc32c. Threads may call crc32c only after
+// this has been done, since setting it up changes crc32c itself.
+void
+crcsetup(void)
+{
+    pthread_once(&pickonce, pick);
+}
@@ -42,6 +42,7 @@ sockwant(Socket *s, int rw)
         ev->flags = EV_DELETE;
         ev++;
         n++;
+        s->added = 0;
     }
 
     if (rw) {
@@ -99,3 +100,12 @@ socknext(Socket **s, int64 timeout)
     }
     return 0;
 }
+
+
+// sysfalloc allocates disk space of len bytes.
+// There is no posix_fallocate here, so this is just rawfalloc.
+int
+sysfalloc(int fd, int len)
+{
+    return rawfalloc(fd, len);
+}
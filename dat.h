@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 typedef unsigned char uchar;
 typedef uchar         byte;
@@ -19,9 +20,17 @@ typedef struct File   File;
 typedef struct Socket Socket;
 typedef struct Server Server;
 typedef struct Wal    Wal;
+typedef struct Ring   Ring;
+typedef struct Walwait Walwait;
+typedef struct Spare  Spare;
+typedef struct Hkop   Hkop;
+typedef struct Tubedur Tubedur;
+typedef struct Tubettl Tubettl;
+typedef struct Group  Group;
 
 typedef void(*Handle)(void*, int rw);
 typedef int(FAlloc)(int, int);
+typedef uint32(Crc32c)(uint32, void*, size_t);
 
 
 // NUM_PRIMES is used in the jobs hashing.
@@ -62,6 +71,10 @@ typedef int(FAlloc)(int, int);
 // The width is restricted by Jobrec.body_size that is int32.
 #define JOB_DATA_SIZE_LIMIT_MAX 1073741824
 
+// By default, the dedup keys of puts are remembered for an hour (-d),
+// and at most Dedupmaxdef of them at a time (-D). See dedup.c.
+#define Dedupwindowdef (3600 * (int64)1000000000)
+
 // Use this macro to designate unused parameters in functions.
 #define UNUSED_PARAMETER(x) (void)(x)
 
@@ -76,6 +89,15 @@ extern struct Server srv;
 // Replaced by tests to simulate failures.
 extern FAlloc *falloc;
 
+// Crc32c updates crc with the CRC-32C of n bytes at buf.
+// Start with crc 0. It uses SSE 4.2 or ARMv8 crc instructions
+// when the CPU has them, and crc32csw otherwise. The first call
+// sets it up, unless crcsetup did so already; a program must call
+// crcsetup before more than one thread uses crc32c.
+extern Crc32c *crc32c;
+uint32 crc32csw(uint32 crc, void *buf, size_t n);
+void   crcsetup(void);
+
 // stats structure holds counters for operations, both globally and per tube.
 struct stats {
     uint64 urgent_ct;
@@ -85,6 +107,7 @@ struct stats {
     uint64 pause_ct;
     uint64 total_delete_ct;
     uint64 total_jobs_ct;
+    uint64 expired_ct;
 };
 
 
@@ -104,6 +127,8 @@ struct Heap {
     setpos_fn setpos;
 };
 int   heapinsert(Heap *h, void *x);
+int   heapappend(Heap *h, void *x);
+void  heapify(Heap *h);
 void* heapremove(Heap *h, size_t k);
 
 
@@ -167,16 +192,25 @@ enum // Jobrec.state
     Ready,
     Reserved,
     Buried,
-    Delayed,
-    Copy
+    Delayed
 };
 
 enum
 {
-    Walver = 7
+    Walver = 14,
+
+    // Walupdmax is the largest possible size of a record
+    // that updates a job (see file.c). Space for it is
+    // reserved for every update and for every delete.
+    Walupdmax = 65,
+
+    // Walstreams is the max number of binlog dirs (-b),
+    // each of them an independent Wal.
+    Walstreams = 16
 };
 
-// If you modify Jobrec struct, you must increment Walver above.
+// If you modify Jobrec struct or the record format in file.c,
+// you must increment Walver above.
 //
 // This workflow is expected:
 // 1. If any change needs to be made to the format, first increment Walver.
@@ -184,11 +218,11 @@ enum
 //    a. Copy-paste relevant file-reading functions in file.c and
 //       add the old version number to their names. For example,
 //       if you are incrementing Walver from 7 to 8, copy readrec to readrec7.
-//       (Currently, there is only one such function, readrec. But if
-//       a future readrec calls other version-specific functions,
-//       those will have to be copied too.)
+//       (Currently, the version-specific functions are decrec and
+//       applyrec, and the functions they call.)
 // 3. Add a switch case to fileread for the old version.
-// 4. Modify the current reading function (readrec) to reflect your change.
+// 4. Modify the current reading functions (decrec and applyrec)
+//    to reflect your change.
 //
 // Incrementing Walver for every change, even if not every version
 // will be released, is helpful even if it "wastes" version numbers.
@@ -234,6 +268,18 @@ struct Job {
     void *reserver;
     int walresv;
     int walused;
+    int nowal;                  // put in a tube with durability Durnone
+    int dur;                    // durability of its tube when it was put
+    int refs;                   // conns sending this job and jobs
+                                // sharing its body, see job_ref
+    int freed;                  // job_free was called while refs > 0
+    Job *bodyof;                // the job whose body this one shares
+    uint64 dedup;               // dedup key of the put, see dedup_key
+    Group *group;               // the job's message group, if any
+    int held;                   // ready, but held back by the group
+    int64 expires_at;           // when the job expires, or 0
+    size_t expire_index;        // where it is in tube->expiring
+    int expiring;               // it is in tube->expiring
 
     char *body;                 // written separately to the wal
 };
@@ -243,9 +289,11 @@ struct Tube {
     char name[MAX_TUBE_NAME_LEN];
     Heap ready;
     Heap delay;
+    Heap expiring;              // ready and delayed jobs that expire
     Ms waiting_conns;           // conns waiting for the job at this moment
     struct stats stat;
     uint using_ct;
+    uint held_ct;               // ready jobs held back by their groups
     uint watching_ct;
 
     // pause is set to the duration of the current pause, otherwise 0, in nsec.
@@ -254,7 +302,18 @@ struct Tube {
     // unpause_at is a timestamp when to unpause the tube, in nsec.
     int64 unpause_at;
 
+    // expire is the time to live of new jobs, in nsec, or 0.
+    int64 expire;
+
     Job buried;                 // linked list header
+
+    int durability;             // Durgroup, Durasync or Durnone
+
+    // The index of this tube in the tube dictionary of
+    // binlog file walseq[i] of stream i, if that is the stream's
+    // current file. See Server.wals.
+    int walseq[Walstreams];
+    int walidx[Walstreams];
 };
 
 
@@ -281,12 +340,15 @@ void warnx(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 char* fmtalloc(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void* zalloc(int n);
 #define new(T) zalloc(sizeof(T))
+int  scanu64(uint64 *n, const char *s);
+int  fmtu64(char *buf, uint64 n);
 void optparse(Server*, char**);
 
 extern const char *progname;
 
 int64 nanoseconds(void);
 int   rawfalloc(int fd, int len);
+int   sysfalloc(int fd, int len);
 
 // Take ID for a jobs from next_id and allocate and store the job.
 #define make_job(pri,delay,ttr,body_size,tube) \
@@ -295,6 +357,11 @@ int   rawfalloc(int fd, int len);
 Job *allocate_job(int body_size);
 Job *make_job_with_id(uint pri, int64 delay, int64 ttr,
                       int body_size, Tube *tube, uint64 id);
+Job *job_new(uint pri, int64 delay, int64 ttr, int body_size, Tube *tube);
+Job *job_new_shared(Job *src, Tube *tube);
+void job_store(Job *j);
+void job_store_id(Job *j, uint64 id);
+uint64 job_peek_id(void);
 void job_free(Job *j);
 
 /* Lookup a job by job ID */
@@ -304,8 +371,11 @@ Job *job_find(uint64 job_id);
 void job_setpos(void *j, size_t pos);
 int job_pri_less(void *ja, void *jb);
 int job_delay_less(void *ja, void *jb);
+void job_expire_setpos(void *j, size_t pos);
+int job_expire_less(void *ja, void *jb);
 
-Job *job_copy(Job *j);
+void job_ref(Job *j);
+void job_unref(Job *j);
 
 const char * job_state(Job *j);
 
@@ -325,8 +395,73 @@ void  tube_dref(Tube *t);
 void  tube_iref(Tube *t);
 Tube *tube_find(const char *name);
 Tube *tube_find_or_make(const char *name);
+
+enum
+{
+    Dedupmaxdef = (1 << 20),
+    Dedupkeymax = 200 // bytes in a dedup key
+};
+
+extern int64  dedup_window;
+extern size_t dedup_max;
+extern uint64 dedup_seed[2]; // key of the dedup key hash, see dedup.c
+
+uint64 dedup_key(Tube *t, const char *key, size_t len);
+int    dedup_find(uint64 key, uint64 *id, int64 now);
+int    dedup_add(uint64 key, uint64 id, int64 at, int64 now);
+
+// Durability classes of tubes; see durability-tube in doc/protocol.txt.
+enum
+{
+    Durgroup, // replies wait until the job's records are written
+    Durasync, // replies don't wait for the records
+    Durnone   // jobs are not written to the binlog at all
+};
+
+// Tubedur is the durability class set for a tube name, if it is
+// not Durgroup. It outlives the tube, which comes and goes with use.
+struct Tubedur {
+    char name[MAX_TUBE_NAME_LEN];
+    int  dur;
+};
+
+// Tubettl is the time to live of new jobs set for a tube name,
+// if it is not 0. Like Tubedur, it outlives the tube.
+struct Tubettl {
+    char  name[MAX_TUBE_NAME_LEN];
+    int64 expire;
+};
+
+extern struct Ms tubedurs;
+extern struct Ms tubettls;
+extern const char *durnames[];
+int   durparse(const char *name);
+int   tube_durability(const char *name);
+int   tube_set_durability(const char *name, int dur);
+int64 tube_expire(const char *name);
+int   tube_set_expire(const char *name, int64 expire);
 #define TUBE_ASSIGN(a,b) (tube_dref(a), (a) = (b), tube_iref(a))
 
+// Group is a message group: jobs in a tube that are reserved one at
+// a time, in order. See group.c.
+struct Group {
+    Tube  *tube;
+    Group *hnext;               // next in the group index
+    uint  refs;                 // jobs in the group
+    int   active;               // how many of them are reserved
+    Job   *ready;               // the one in tube->ready, if any
+    Job   *first, *last;        // the other ready ones, by id
+    char  name[MAX_TUBE_NAME_LEN];
+};
+
+Group *group_find_or_make(Tube *t, const char *name);
+void   group_iref(Group *g);
+void   group_dref(Group *g);
+int    group_ready(Job *j);
+void   group_unready(Job *j);
+void   group_reserve(Group *g);
+int    group_settle(Group *g);
+
 
 Conn *make_conn(int fd, char start_state, Tube *use, Tube *watch);
 
@@ -342,6 +477,7 @@ extern size_t primes[];
 extern size_t job_data_size_limit;
 
 void prot_init(void);
+int  prot_which(const char *line);
 int64 prottick(Server *s);
 
 void remove_waiting_conn(Conn *c);
@@ -350,6 +486,7 @@ void enqueue_reserved_jobs(Conn *c);
 
 void enter_drain_mode(int sig);
 void h_accept(const int fd, const short which, Server *s);
+void h_walack(Wal *w, int ev);
 int  prot_replay(Server *s, Job *list);
 
 
@@ -376,8 +513,9 @@ struct Conn {
     Job    *soonest_job;// memoization of the soonest job
     int    rw;          // currently want: 'r', 'w', or 'h'
 
-    // How long client should "wait" for the next job; -1 means forever.
-    int    pending_timeout;
+    // How long client should "wait" for the next job, in nanoseconds;
+    // -1 means forever.
+    int64  pending_timeout;
 
     // Used to inform state machine that client no longer waits for the data.
     char   halfclosed;
@@ -398,21 +536,57 @@ struct Conn {
     int64 in_job_read;
     Job   *in_job;              // a job to be read from the client
 
-    Job *out_job;               // a job to be sent to the client
-    int out_job_sent;           // how many bytes of *out_job were sent already
+    Job *out_job;               // a job to be sent to the client, see job_ref
+    char *out_data;             // or other data, owned by the conn
+    int out_len;                // the size of out_data
+    int out_job_sent;           // how many bytes of either were sent already
 
     Ms  watch;                  // the set of watched tubes by the connection
+    Ms  from;                   // tubes named by a pending reserve-from, if any
+    Ms  fanout;                 // tubes named by a put-multi being read
     Job reserved_jobs;          // linked list header
+    int reserved_ct;            // the number of jobs in reserved_jobs
+
+    // Number of wal acknowledgements the pending reply waits for.
+    // While it is nonzero, the conn is not registered for any events.
+    int walwait;
+
+    // A put-batch command being read: the number of jobs still to
+    // come (counting in_job), the jobs read so far, and the reply
+    // for the first job that failed, if any.
+    int  batchleft;
+    Job  batch;
+    char *batcherr;
+
+    // The most jobs the pending reserve command takes at once:
+    // 0 for reserve and reserve-with-timeout, up to BATCH_MAX for
+    // reserve-batch.
+    int resvmax;
+
+    // The delete-many, release-many or bury-many command whose id
+    // list is being read into in_job, or 0.
+    int manyop;
+
+    // The number of jobs the conn may hold reserved while the server
+    // pushes ready jobs to it, or 0 if it has not subscribed.
+    int credits;
+
+    // The protocol the client speaks: 't' for text, 'b' for binary,
+    // or 0 until its first byte has been read.
+    char   proto;
+    uint32 reqid;               // request id of the binary command
 };
 int  conn_less(void *ca, void *cb);
 void conn_setpos(void *c, size_t i);
 void connsched(Conn *c);
 void connclose(Conn *c);
+void connfreeout(Conn *c);
 void connsetproducer(Conn *c);
 void connsetworker(Conn *c);
 Job *connsoonestjob(Conn *c);
 int  conndeadlinesoon(Conn *c);
 int conn_ready(Conn *c);
+Ms  *connresvtubes(Conn *c);
 void conn_reserve_job(Conn *c, Job *j);
 #define conn_waiting(c) ((c)->type & CONN_TYPE_WAITING)
 
@@ -421,10 +595,45 @@ void conn_reserve_job(Conn *c, Job *j);
 
 enum
 {
-    Filesizedef = (10 << 20)
+    Filesizedef = (10 << 20),
+    Walringsize = (4 << 20), // must be a power of two
+    Walspares = 2,           // binlog files allocated ahead of time
+    Walloaders = 16,         // max threads loading binlog files at startup
+
+    // Compaction runs at most once every Compactperiod nanoseconds
+    // and moves at most Compactbytesdef bytes (-k) or spends at most
+    // Compacttimedef nanoseconds (-K) each time, by default.
+    Compactperiod   = 10000000,
+    Compactbytesdef = (1 << 20),
+    Compacttimedef  = 1000000
+};
+
+// Ring is a single-producer, single-consumer byte ring
+// between the event loop and the wal writer thread. See walio.c.
+struct Ring {
+    byte   *buf;
+    size_t cap;
+    uint64 stage; // end of staged data; loop only
+    uint64 last;  // start of the last staged frame; loop only
+    uint64 wr;    // end of published data; written by the loop
+    uint64 rd;    // end of consumed data; written by the writer
+};
+
+// Walwait is a conn whose reply waits for the wal writer
+// to acknowledge everything before pos.
+struct Walwait {
+    Conn   *c;
+    uint64 pos;
+};
+
+// Spare is an allocated binlog file waiting to be used. See walhk.c.
+struct Spare {
+    int  fd;
+    char *path;
 };
 
 struct Wal {
+    int    id;    // index in Server.wals
     int    filesize;
     int    use;
     char   *dir;
@@ -436,18 +645,74 @@ struct Wal {
     int64  resv;  // bytes reserved
     int64  alive; // bytes in use
     int64  nmig;  // migrations
+    int64  nmigbytes; // bytes migrated
+    int64  cbytes;    // compaction budget per tick, in bytes
+    int64  ctime;     // compaction budget per tick, in nanoseconds
+    int64  cnext;     // time of the next compaction tick
+    int64  cbehind;   // since when compaction has work to do, or 0
     int64  nrec;  // records written ever
+
+    // Snapshots, see walsnap.c.
+    int64  snapperiod; // nanoseconds between snapshots, or 0 for none (-S)
+    int64  snapnext;   // time of the next snapshot
+    int64  snaprec;    // nrec when the last snapshot started
+    int    snappid;    // child writing a snapshot, or 0
+    int    snapseq;    // binlog file the latest snapshot leads into, or 0
+    int64  snapoff;    // and the offset in it
+    char   *snappath;  // path of the latest snapshot
+    int    snapnewseq; // same as above, for the snapshot being written
+    int64  snapnewoff;
+    char   *snapnewpath;
+    int64  nsnap;      // snapshots completed
+    uint64 syncpos;    // walqpos after the last Durgroup record
     int    wantsync;
     int64  syncrate;
-    int64  lastsync;
+    int64  lastsync; // owned by the writer thread
+
+    // The writer thread and its queue, see walio.c.
+    Ring   ring;
+    Socket sock;      // read end of the ack pipe
+    int    iopipe;    // write end of the ack pipe
+    pthread_t       iothread;
+    pthread_mutex_t iolock;
+    pthread_cond_t  iowork;
+    pthread_cond_t  iospace;
+    int    iosleep;   // writer is waiting for work
+    int    ioerr;     // writer failed to write
+    int    iowantack; // loop has conns waiting for acks
+    uint64 ioack;     // ring position acked by the writer
+
+    Walwait *waits;   // conns waiting for acks, ordered by pos
+    size_t nwait;
+    size_t capwait;
+    size_t waithead;
+
+    // The housekeeping thread, see walhk.c.
+    pthread_t       hkthread;
+    pthread_mutex_t hklock;
+    pthread_cond_t  hkwork;
+    pthread_cond_t  hkdone;
+    Hkop   *hkops;    // closes and unlinks to do, in order
+    Hkop   *hkopstail;
+    int    hkunlinks; // unlinks queued but not yet done
+    int    hkwantack; // housekeeping waits for ioack, see walhkacked
+    Spare  spares[Walspares];
+    int    nspare;
+    int    hkerr;     // errno of the last failed allocation, if any
+    int    hkseq;     // number for the next spare file
 };
 int  waldirlock(Wal*);
 void walinit(Wal*, Job *list);
 int  walwrite(Wal*, Job*);
-void walmaint(Wal*);
+int64 walmaint(Wal*, int64 now);
+int  walputmax(Job*);
 int  walresvput(Wal*, Job*);
+int  walresvputs(Wal*, int);
+void walunresv(Wal*, int);
 int  walresvupdate(Wal*);
+int  walresvupdates(Wal*, int64);
 void walgc(Wal*);
+int  walsavetubes(Wal*);
 
 
 struct File {
@@ -461,6 +726,22 @@ struct File {
     char *path;
     Wal  *w;
 
+    // Writer state for delta encoding and the tube dictionary.
+    int    ntube;
+    uint64 lastid;
+    int64  lastat;
+
+    int    snap;  // is a snapshot, see walsnap.c
+    int    gone;  // has been unlinked already
+    int64  skip;  // records before this offset are in the snapshot
+
+    // Set by fileload for fileread.
+    int    ver;
+    byte   *map;  // the whole file
+    size_t maplen;
+    byte   *good; // end of the records that passed the checks
+    int    loaderr;
+
     Job jlist;    // jobs written in this file
 };
 int  fileinit(File*, Wal*, int);
@@ -469,11 +750,36 @@ void fileincref(File*);
 void filedecref(File*);
 void fileaddjob(File*, Job*);
 void filermjob(File*, Job*);
+void fileload(File*);
 int  fileread(File*, Job *list);
 void filewopen(File*);
 void filewclose(File*);
 int  filewrjobshort(File*, Job*);
 int  filewrjobfull(File*, Job*);
+int  filefullmax(Job*);
+int  filesnap(Wal*, int fd);
+
+int    walioinit(Wal*);
+int    walqwrite(Wal*, int fd, void *buf, int len);
+void   walqclose(Wal*, int fd, int64 len);
+void   walqflush(Wal*);
+uint64 walqpos(Wal*);
+int    walqerr(Wal*);
+int    walqwait(Wal*, Conn*);
+void   walqdrain(Wal*);
+Conn*  walqacked(Wal*);
+void   walqunwait(Wal*, Conn*);
+
+int    walhkinit(Wal*);
+int    walspare(Wal*, Spare*);
+void   walhkclose(Wal*, int fd, int64 len);
+void   walhkunlink(Wal*, char *path);
+void   walhkacked(Wal*);
+int    walhkunlinks(Wal*);
+
+int    walsnapscan(Wal*);
+int64  walsnapmaint(Wal*, int64 now);
+void   walsnapdrop(Wal*);
 
 
 #define Portdef "11300"
@@ -483,12 +789,19 @@ struct Server {
     char *addr;
     char *user;
 
+    // The binlog is striped over nwal independent streams, one per
+    // -b dir. Wal holds the settings for all of them and is wals[0].
+    // See srvwal.
     Wal    wal;
+    Wal    *wals[Walstreams];
+    char   *waldirs[Walstreams];
+    int    nwal;
     Socket sock;
 
     // Connections that must produce deadline or timeout, ordered by the time.
     Heap   conns;
 };
 void srv_acquire_wal(Server *s);
+Wal* srvwal(Server *s, Job *j);
 void srvserve(Server *s);
 void srvaccept(Server *s, int ev);
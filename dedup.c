@@ -0,0 +1,195 @@
+#include "dat.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+// The dedup index maps the dedup keys of recent puts to the ids of
+// the jobs they made. A key is stored as a 64-bit hash of the tube
+// name and the key itself, never as a string. The hash is SipHash-2-4
+// with the secret dedup_seed, so clients cannot make keys collide on
+// purpose. Prot_init picks the seed at random; with a binlog, it is
+// kept in the binlog directory (see walg.c), since full job records
+// hold the hashes.
+//
+// Keys are kept in two generations, each an open-addressing hash
+// table. New keys go into the current one; lookups check both. When
+// the current generation is dedup_window old, or holds half of
+// dedup_max keys, the older one is dropped and a new current one is
+// started. Every key is thus remembered for at least dedup_window,
+// unless more than dedup_max/2 keys arrive within that time, and the
+// index never holds more than dedup_max keys.
+
+int64  dedup_window = Dedupwindowdef;
+size_t dedup_max = Dedupmaxdef;
+uint64 dedup_seed[2];
+
+typedef struct Dedupent Dedupent;
+typedef struct Dedupgen Dedupgen;
+
+struct Dedupent {
+    uint64 key;     // 0 if the slot is empty
+    uint64 id;
+    int64  at;      // when the job was made
+};
+
+struct Dedupgen {
+    Dedupent *ents;
+    size_t   cap;   // number of slots, a power of two
+    size_t   len;
+    int64    start;
+};
+
+static Dedupgen gen[2]; // gen[0] is the current generation
+
+
+#define rotl(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define sipround() do { \
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32); \
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); \
+} while (0)
+
+
+// siphash returns the SipHash-2-4 of the n bytes at p,
+// keyed with dedup_seed.
+static uint64
+siphash(const byte *p, size_t n)
+{
+    uint64 v0 = dedup_seed[0] ^ 0x736f6d6570736575ull;
+    uint64 v1 = dedup_seed[1] ^ 0x646f72616e646f6dull;
+    uint64 v2 = dedup_seed[0] ^ 0x6c7967656e657261ull;
+    uint64 v3 = dedup_seed[1] ^ 0x7465646279746573ull;
+    uint64 m, b = (uint64)n << 56;
+    size_t i;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        for (m = 0, i = 0; i < 8; i++) {
+            m |= (uint64)p[i] << (8 * i);
+        }
+        v3 ^= m;
+        sipround();
+        sipround();
+        v0 ^= m;
+    }
+    for (i = 0; i < n; i++) {
+        b |= (uint64)p[i] << (8 * i);
+    }
+    v3 ^= b;
+    sipround();
+    sipround();
+    v0 ^= b;
+    v2 ^= 0xff;
+    sipround();
+    sipround();
+    sipround();
+    sipround();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+// dedup_key returns the hash of key, len bytes, put into tube t.
+// Len is at most Dedupkeymax. The result is never 0.
+uint64
+dedup_key(Tube *t, const char *key, size_t len)
+{
+    byte buf[MAX_TUBE_NAME_LEN + Dedupkeymax];
+    size_t n = strlen(t->name) + 1; // with the NUL after the name
+    uint64 h;
+
+    memcpy(buf, t->name, n);
+    memcpy(buf + n, key, len);
+    h = siphash(buf, n + len);
+    return h ? h : 1;
+}
+
+
+static Dedupent *
+slot(Dedupgen *g, uint64 key)
+{
+    size_t i = key & (g->cap - 1);
+
+    while (g->ents[i].key && g->ents[i].key != key) {
+        i = (i + 1) & (g->cap - 1);
+    }
+    return &g->ents[i];
+}
+
+
+// rotate drops the older generation and starts a new current one
+// at time now, reusing the memory of the one dropped.
+static void
+rotate(int64 now)
+{
+    Dedupgen g = gen[1];
+
+    gen[1] = gen[0];
+    if (g.ents) {
+        memset(g.ents, 0, g.cap * sizeof(Dedupent));
+    }
+    g.len = 0;
+    g.start = now;
+    gen[0] = g;
+}
+
+
+// dedup_find looks key up in the index at time now. If a job was
+// made with key less than dedup_window ago, it sets *id to the job's
+// id and returns 1. Otherwise it returns 0.
+int
+dedup_find(uint64 key, uint64 *id, int64 now)
+{
+    Dedupent *e;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (!gen[i].len) continue;
+        e = slot(&gen[i], key);
+        if (e->key && now - e->at < dedup_window) {
+            *id = e->id;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// dedup_add records that job id was made with key at time at.
+// It does nothing if that is dedup_window or more before now.
+// Returns 1 on success, or 0 if out of memory.
+int
+dedup_add(uint64 key, uint64 id, int64 at, int64 now)
+{
+    Dedupgen *g = &gen[0];
+    Dedupent *e;
+    size_t n = dedup_max / 2;
+
+    if (!n || now - at >= dedup_window) {
+        return 1;
+    }
+    if (!g->ents) {
+        size_t cap = 16;
+        while (cap < n * 2) cap <<= 1;
+        g->ents = calloc(cap, sizeof(Dedupent));
+        if (!g->ents) {
+            twarnx("OOM");
+            return 0;
+        }
+        g->cap = cap;
+        g->start = now;
+    }
+    if (g->len >= n || now - g->start >= dedup_window) {
+        rotate(now);
+        return dedup_add(key, id, at, now);
+    }
+
+    e = slot(g, key);
+    if (!e->key) {
+        g->len++;
+    }
+    e->key = key;
+    e->id = id;
+    e->at = at;
+    return 1;
+}
@@ -8,23 +8,138 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 
-static int  readrec(File*, Job *, int*);
+typedef struct Rd Rd;
+typedef struct Rec Rec;
+
+static int  decrec(File*, Rd*, Rec*, int*);
+static int  applyrec(File*, Rd*, Rec*, Job*, int*);
+static int  readrec7(File*, Job *, int*);
 static int  readrec5(File*, Job *, int*);
 static int  readfull(File*, void*, int, int*, char*);
 static void warnpos(File*, int, char*, ...)
 __attribute__((format(printf, 3, 4)));
+static void warnrd(File*, byte*, char*, ...)
+__attribute__((format(printf, 3, 4)));
 
-FAlloc *falloc = &rawfalloc;
+FAlloc *falloc = &sysfalloc;
 
 enum
 {
+    Walver13 = 13,
+    Walver12 = 12,
+    Walver11 = 11,
+    Walver10 = 10,
+    Walver9 = 9,
+    Walver8 = 8,
+    Walver7 = 7,
     Walver5 = 5
 };
 
+// Since version 8, a binlog file is a sequence of records, each
+// starting with one of the types below. Integers are varints:
+// 7 bits per byte, least significant group first, with the high
+// bit set on every byte but the last. Signed integers are zigzag
+// encoded first. Job ids and creation times are stored as deltas
+// from the previous record in the same file, and deadlines as
+// deltas from the job's creation time.
+//
+// Since version 9, every record ends with the CRC-32C of the
+// record, type byte included, as four little-endian bytes. For a
+// full job record this covers the body too. Reading a file stops
+// at the first record whose checksum does not match, so a torn
+// write at the end of the log loads nothing.
+//
+// A full job record refers to its tube by an index into the file's
+// tube dictionary; a Rectube record before it adds the name.
+// Job updates only store the fields that can change.
+// A zero type byte marks the end of the records.
+//
+// A snapshot (see walsnap.c) is a binlog file holding a full record
+// for every live job, followed by a Recpause record for every paused
+// tube. Recpause records first appeared in version 10.
+//
+// The jobs of a put-multi command share one body. Only the first of
+// them gets a Recjob record; the others get Recjobref records, which
+// have the id of that job in place of the body. A Recjobref record is
+// only written to the file that holds the latest full record of the
+// job with the body, so reading the file always finds that job first.
+// Recjobref records first appeared in version 11.
+//
+// Since version 12, full job records have a dedup key hash (see
+// dedup.c), or 0, after the counters. Reading them rebuilds the
+// dedup index.
+//
+// Since version 13, full job records have the name of the job's
+// message group (see group.c) after the dedup key hash, as a length
+// and the bytes of the name. A job in no group has length 0.
+//
+// Since version 14, full job records have the time the job expires
+// (see expire-tube), as a delta from its creation time, or 0, after
+// the dedup key hash.
+enum
+{
+    Rectube = 1, // namelen, name
+    Recjob,      // id, tube, pri, delay, ttr, body_size, created_at,
+                 // deadline_at, counters, dedup, expires_at,
+                 // group namelen, group name, state byte, body
+    Recdelete,   // id
+    Recrelease,  // id, pri, delay, deadline_at, counters
+    Recbury,     // id, pri, counters
+    Reckick,     // id, pri, counters
+    Recpause,    // tube, pause, unpause_at; only in snapshots
+    Recjobref,   // as Recjob, with the body replaced by
+                 // the id of the job that has it
+
+
+    // Fullhdrmax is the largest possible size of a full
+    // record without the body and the checksum, including
+    // a tube dictionary entry. A Recjobref record can take
+    // 10 bytes more, for the id of the job with its body.
+    Fullhdrmax = 1 + 5 + MAX_TUBE_NAME_LEN + 4 +
+                 112 + 2 + MAX_TUBE_NAME_LEN + 10
+};
+
+// Rd is a binlog file in memory.
+struct Rd {
+    byte   *p;
+    byte   *end;
+    uint64 lastid;
+    int64  lastat;
+    int    ntube;
+    char   (*tubes)[MAX_TUBE_NAME_LEN]; // filled in by applyrec
+    int    captube;
+    int    sum;   // records have checksums
+    int    dedup; // full job records have a dedup key
+    int    group; // and a group name
+    int    expire; // and an expiry time
+    int    check; // verify them
+};
+
+// Rec is a decoded record. Data points into the file,
+// at the tube name or the job body; group at the job's group name.
+struct Rec {
+    int    type;
+    byte   *start;
+    int    size;
+    uint64 v[15];      // fields as stored in the file
+    uint64 id;
+    int64  created_at;
+    byte   state;
+    byte   *data;
+    uint64 len;
+    uint64 src;        // the job with the body, for Recjobref
+    byte   *group;
+    uint64 grouplen;   // 0 if the job is in no group
+};
+
+#define zigzag(v)   (((uint64)(v) << 1) ^ (uint64)((int64)(v) >> 63))
+#define unzigzag(u) ((int64)((u) >> 1) ^ -(int64)((u) & 1))
+
 typedef struct Jobrec5 Jobrec5;
 
 struct Jobrec5 {
@@ -122,20 +237,99 @@ filermjob(File *f, Job *j)
 }
 
 
+// fileload maps f into memory and checks its records, so that
+// fileread only has to apply them. It touches nothing but f, so
+// it can run for several files at once; see walread.
+// Files in versions before 8 are left for fileread to read.
+void
+fileload(File *f)
+{
+    struct stat st;
+    byte *map;
+    Rd rd = {0};
+    Rec r;
+    int v;
+
+    if (pread(f->fd, &v, sizeof(v), 0) != sizeof(v)) {
+        return; // fileread will complain
+    }
+    f->ver = v;
+    if (v != Walver && v != Walver13 && v != Walver12 && v != Walver11 &&
+        v != Walver10 && v != Walver9 && v != Walver8) {
+        return;
+    }
+
+    if (fstat(f->fd, &st) == -1) {
+        twarn("fstat %s", f->path);
+        f->loaderr = 1;
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+    if (map == MAP_FAILED) {
+        twarn("mmap %s", f->path);
+        f->loaderr = 1;
+        return;
+    }
+    posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+    f->map = map;
+    f->maplen = st.st_size;
+
+    rd.p = map + sizeof(int);
+    rd.end = map + st.st_size;
+    rd.sum = v != Walver8;
+    rd.dedup = v >= Walver12;
+    rd.group = v >= Walver13;
+    rd.expire = v >= Walver;
+    rd.check = 1;
+    do {
+        f->good = rd.p;
+    } while (decrec(f, &rd, &r, &f->loaderr));
+}
+
+
 // Fileread reads jobs from f->path into list.
+// For files in version 8 or later, fileload must have been called.
 // It returns 0 on success, or 1 if any errors occurred.
 int
 fileread(File *f, Job *list)
 {
     int err = 0, v;
+    Rd rd = {0};
+    Rec r;
+
+    if (f->map) {
+        rd.p = f->map + sizeof(int);
+        rd.end = f->good;
+        rd.sum = f->ver != Walver8;
+        rd.dedup = f->ver >= Walver12;
+        rd.group = f->ver >= Walver13;
+        rd.expire = f->ver >= Walver;
+        fileincref(f);
+        while (decrec(f, &rd, &r, &err)) {
+            if (r.start - f->map < f->skip && r.type != Rectube) {
+                continue; // already in the snapshot
+            }
+            if (!applyrec(f, &rd, &r, list, &err)) break;
+        }
+        filedecref(f);
+        free(rd.tubes);
+        if (munmap(f->map, f->maplen) == -1) {
+            twarn("munmap %s", f->path);
+        }
+        f->map = NULL;
+        return err | f->loaderr;
+    }
+    if (f->loaderr) {
+        return 1;
+    }
 
     if (!readfull(f, &v, sizeof(v), &err, "version")) {
         return err;
     }
     switch (v) {
-    case Walver:
+    case Walver7:
         fileincref(f);
-        while (readrec(f, list, &err));
+        while (readrec7(f, list, &err));
         filedecref(f);
         return err;
     case Walver5:
@@ -150,11 +344,440 @@ fileread(File *f, Job *list)
 }
 
 
-// Readrec reads a record from f->fd into linked list l.
+// getuv reads a varint from rd into *v.
+// Returns 1 on success, or 0 if the input ends too soon
+// or the value does not fit in 64 bits.
+static int
+getuv(Rd *rd, uint64 *v)
+{
+    uint64 x = 0;
+    int shift;
+
+    for (shift = 0; shift < 64 && rd->p < rd->end; shift += 7) {
+        byte b = *rd->p++;
+        x |= (uint64)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// getuvs reads n varints from rd into v.
+// Returns 1 on success, otherwise 0.
+static int
+getuvs(Rd *rd, uint64 *v, int n)
+{
+    while (n--) {
+        if (!getuv(rd, v++)) return 0;
+    }
+    return 1;
+}
+
+
+// sumok checks the checksum that follows the record from start
+// to end, if rd->check is set, and moves rd->p past it. Records
+// in a version 8 file have no checksum; then it just moves rd->p
+// to end. If the checksum is missing or wrong, it sets *err to 1.
+// Returns 1 if the record is good, otherwise 0.
+static int
+sumok(File *f, Rd *rd, byte *start, byte *end, int *err)
+{
+    uint32 sum;
+
+    if (!rd->sum) {
+        rd->p = end;
+        return 1;
+    }
+    if (rd->end - end < 4) {
+        warnrd(f, rd->end, "unexpected EOF reading checksum");
+        *err = 1;
+        return 0;
+    }
+    sum = (uint32)end[0] | (uint32)end[1]<<8 |
+          (uint32)end[2]<<16 | (uint32)end[3]<<24;
+    if (rd->check && crc32c(0, start, end - start) != sum) {
+        warnrd(f, start, "bad checksum; ignoring the rest of the file");
+        *err = 1;
+        return 0;
+    }
+    rd->p = end + 4;
+    return 1;
+}
+
+
+// Decrec decodes the next record in rd into r and checks it as far
+// as it can without looking at any state outside of rd.
+// If an error occurs, it sets *err to 1.
+// Returns 1 on success, or 0 at the end of the records or on error.
+static int
+decrec(File *f, Rd *rd, Rec *r, int *err)
+{
+    uint64 *v = r->v;
+    uint64 id;
+    int n;
+
+    if (rd->p >= rd->end) {
+        return 0;
+    }
+
+    r->start = rd->p;
+    r->type = *rd->p++;
+    switch (r->type) {
+    case 0:
+        // trailing zeroes
+        return 0;
+    case Rectube:    n = 1; break;  // namelen
+    case Recjob:
+    case Recjobref:                 // id, tube, pri, delay, ttr, body_size,
+        n = 13 + rd->dedup +        // created_at, deadline, counters, dedup,
+            rd->expire;             // expires_at
+        v[13] = v[14] = 0;
+        break;
+    case Recdelete:  n = 1; break;  // id
+    case Recrelease: n = 9; break;  // id, pri, delay, deadline, counters
+    case Recbury:
+    case Reckick:    n = 7; break;  // id, pri, counters
+    case Recpause:   n = 3; break;  // tube, pause, unpause_at
+    default:
+        warnrd(f, r->start, "unknown record type %d", r->type);
+        *err = 1;
+        return 0;
+    }
+    if (!getuvs(rd, v, n)) {
+        warnrd(f, rd->p, "unexpected EOF reading record");
+        *err = 1;
+        return 0;
+    }
+    id = rd->lastid + unzigzag(v[0]);
+
+    r->len = 0;
+    switch (r->type) {
+    case Rectube:
+        if (v[0] >= MAX_TUBE_NAME_LEN) {
+            warnrd(f, r->start, "namelen %"PRIu64" exceeds maximum of %d",
+                   v[0], MAX_TUBE_NAME_LEN - 1);
+            *err = 1;
+            return 0;
+        }
+        r->len = v[0];
+        break;
+    case Recjob:
+    case Recjobref:
+        r->grouplen = 0;
+        if (rd->group && !getuv(rd, &r->grouplen)) {
+            warnrd(f, rd->p, "unexpected EOF reading job record");
+            *err = 1;
+            return 0;
+        }
+        if (r->grouplen >= MAX_TUBE_NAME_LEN) {
+            warnrd(f, r->start, "group namelen %"PRIu64" exceeds maximum of %d",
+                   r->grouplen, MAX_TUBE_NAME_LEN - 1);
+            *err = 1;
+            return 0;
+        }
+        r->group = rd->p;
+        if ((uint64)(rd->end - rd->p) < r->grouplen + 1) {
+            warnrd(f, rd->p, "unexpected EOF reading job record");
+            *err = 1;
+            return 0;
+        }
+        rd->p += r->grouplen;
+        r->state = *rd->p++;
+        if (v[1] >= (uint64)rd->ntube) {
+            warnrd(f, r->start, "job %"PRIu64" has unknown tube %"PRIu64,
+                   id, v[1]);
+            *err = 1;
+            return 0;
+        }
+        if (v[5] > job_data_size_limit) {
+            warnrd(f, r->start, "job %"PRIu64" is too big (%"PRIu64" > %zu)",
+                   id, v[5], job_data_size_limit);
+            *err = 1;
+            return 0;
+        }
+        if (r->state != Ready && r->state != Reserved &&
+            r->state != Buried && r->state != Delayed) {
+            warnrd(f, r->start, "job %"PRIu64" has bad state %d",
+                   id, r->state);
+            *err = 1;
+            return 0;
+        }
+        if (r->type == Recjob) {
+            r->len = v[5];
+            break;
+        }
+        if (!getuv(rd, &r->src)) {
+            warnrd(f, rd->p, "unexpected EOF reading job record");
+            *err = 1;
+            return 0;
+        }
+        r->src = id + unzigzag(r->src);
+        break;
+    case Recpause:
+        if (v[0] >= (uint64)rd->ntube) {
+            warnrd(f, r->start, "pause for unknown tube %"PRIu64, v[0]);
+            *err = 1;
+            return 0;
+        }
+        break;
+    }
+    r->data = rd->p;
+    if (r->len > (uint64)(rd->end - rd->p)) {
+        warnrd(f, rd->end, "unexpected EOF reading %s",
+               r->type == Rectube ? "tube name" : "job body");
+        *err = 1;
+        return 0;
+    }
+    if (!sumok(f, rd, r->start, r->data + r->len, err)) {
+        return 0;
+    }
+    r->size = rd->p - r->start;
+
+    if (r->type == Rectube) {
+        rd->ntube++;
+        return 1;
+    }
+    if (r->type == Recpause) {
+        return 1;
+    }
+    r->id = rd->lastid = id;
+    if (r->type == Recjob || r->type == Recjobref) {
+        rd->lastat += unzigzag(v[6]);
+        r->created_at = rd->lastat;
+    }
+    return 1;
+}
+
+
+static void
+setcounters(Job *j, uint64 *v)
+{
+    j->r.reserve_ct = v[0];
+    j->r.timeout_ct = v[1];
+    j->r.release_ct = v[2];
+    j->r.bury_ct = v[3];
+    j->r.kick_ct = v[4];
+}
+
+
+// addtube adds the name in Rectube record r to the tube dictionary.
 // If an error occurs, it sets *err to 1.
-// Readrec returns the number of records read, either 1 or 0.
+// Returns 1 on success, otherwise 0.
 static int
-readrec(File *f, Job *l, int *err)
+addtube(Rd *rd, Rec *r, int *err)
+{
+    char (*p)[MAX_TUBE_NAME_LEN];
+    int i = rd->ntube - 1;
+
+    if (i == rd->captube) {
+        int cap = rd->captube ? rd->captube * 2 : 8;
+        p = realloc(rd->tubes, cap * sizeof(*p));
+        if (!p) {
+            twarnx("OOM");
+            *err = 1;
+            return 0;
+        }
+        rd->tubes = p;
+        rd->captube = cap;
+    }
+    memcpy(rd->tubes[i], r->data, r->len);
+    rd->tubes[i][r->len] = '\0';
+    return 1;
+}
+
+
+// applyjob applies Recjob or Recjobref record r to linked list l.
+// If an error occurs, it sets *err to 1.
+// Returns 1 on success, otherwise 0.
+static int
+applyjob(File *f, Rd *rd, Rec *r, Job *l, int *err)
+{
+    uint64 *v = r->v;
+    Jobrec jr = {0};
+    Job *j, *src = NULL;
+    Tube *t;
+    Group *g = NULL;
+    char name[MAX_TUBE_NAME_LEN];
+
+    jr.id = r->id;
+    jr.pri = v[2];
+    jr.delay = unzigzag(v[3]);
+    jr.ttr = unzigzag(v[4]);
+    jr.body_size = v[5];
+    jr.created_at = r->created_at;
+    jr.state = r->state;
+    if (jr.state == Delayed) {
+        jr.deadline_at = jr.created_at + unzigzag(v[7]);
+    }
+    if (jr.state == Reserved) {
+        jr.state = Ready;
+    }
+
+    j = job_find(jr.id);
+    if (!j && r->type == Recjobref) {
+        src = job_find(r->src);
+        if (!src || src->r.body_size != jr.body_size) {
+            warnrd(f, r->start, "job %"PRIu64" refers to missing job %"PRIu64,
+                   jr.id, r->src);
+            *err = 1;
+            return 0;
+        }
+    }
+    if (!j) {
+        t = tube_find_or_make(rd->tubes[v[1]]);
+        if (t && r->grouplen) {
+            memcpy(name, r->group, r->grouplen);
+            name[r->grouplen] = '\0';
+            g = group_find_or_make(t, name);
+            if (!g) {
+                *err = 1;
+                return 0;
+            }
+        }
+        if (src) {
+            j = job_new_shared(src, t);
+            if (j) job_store_id(j, jr.id);
+        } else {
+            j = make_job_with_id(jr.pri, jr.delay, jr.ttr, jr.body_size,
+                                 t, jr.id);
+        }
+        if (!j) {
+            twarnx("OOM");
+            *err = 1;
+            return 0;
+        }
+        job_list_reset(j);
+        if (g) {
+            j->group = g;
+            group_iref(g);
+        }
+    }
+    if (jr.body_size != j->r.body_size) {
+        warnrd(f, r->start, "job %"PRIu64" size changed", j->r.id);
+        warnrd(f, r->start, "was %d, now %d", j->r.body_size, jr.body_size);
+        *err = 1;
+        job_list_remove(j);
+        filermjob(j->file, j);
+        job_free(j);
+        return 0;
+    }
+    j->r = jr;
+    setcounters(j, v+8);
+    j->dedup = v[13];
+    j->expires_at = v[14] ? j->r.created_at + (int64)v[14] : 0;
+    if (j->dedup) {
+        // Without memory for it, the key is just forgotten.
+        dedup_add(j->dedup, j->r.id, j->r.created_at, nanoseconds());
+    }
+    job_list_insert(l, j);
+    // A job that shares a body already has it.
+    if (r->type == Recjob) {
+        memcpy(j->body, r->data, jr.body_size);
+    }
+
+    // since this is a full record, we can move
+    // the file pointer and decref the old
+    // file, if any
+    filermjob(j->file, j);
+    fileaddjob(f, j);
+    j->walused += r->size;
+    f->w->alive += r->size;
+    return 1;
+}
+
+
+// applyupd applies job update record r to linked list l.
+// Returns 1.
+static int
+applyupd(File *f, Rec *r, Job *l)
+{
+    uint64 *v = r->v;
+    Job *j;
+
+    j = job_find(r->id);
+    if (!j) {
+        // We read an update without having seen a
+        // full record for this job, so the full record
+        // was in an earlier file that has been deleted.
+        // Therefore the job itself has either been
+        // deleted or migrated; either way, this record
+        // should be ignored.
+        return 1;
+    }
+
+    switch (r->type) {
+    case Recdelete:
+        job_list_remove(j);
+        filermjob(j->file, j);
+        job_free(j);
+        return 1;
+    case Recrelease:
+        j->r.pri = v[1];
+        j->r.delay = unzigzag(v[2]);
+        j->r.deadline_at = j->r.created_at + unzigzag(v[3]);
+        setcounters(j, v+4);
+        j->r.state = Delayed;
+        break;
+    case Recbury:
+        j->r.pri = v[1];
+        setcounters(j, v+2);
+        j->r.state = Buried;
+        break;
+    case Reckick:
+        j->r.pri = v[1];
+        setcounters(j, v+2);
+        j->r.state = Ready;
+        break;
+    }
+    job_list_insert(l, j);
+    j->walused += r->size;
+    f->w->alive += r->size;
+    return 1;
+}
+
+
+// applypause applies Recpause record r to its tube,
+// if the tube has any jobs. Returns 1.
+static int
+applypause(Rd *rd, Rec *r)
+{
+    Tube *t = tube_find(rd->tubes[r->v[0]]);
+
+    if (t) {
+        t->pause = r->v[1];
+        t->unpause_at = unzigzag(r->v[2]);
+    }
+    return 1;
+}
+
+
+// Applyrec applies record r, as decoded by decrec,
+// to linked list l.
+// If an error occurs, it sets *err to 1.
+// Returns 1 on success, otherwise 0.
+static int
+applyrec(File *f, Rd *rd, Rec *r, Job *l, int *err)
+{
+    switch (r->type) {
+    case Rectube:
+        return addtube(rd, r, err);
+    case Recjob:
+    case Recjobref:
+        return applyjob(f, rd, r, l, err);
+    case Recpause:
+        return applypause(rd, r);
+    }
+    return applyupd(f, r, l);
+}
+
+
+// Readrec7 reads a record in "version 7" of the log format,
+// directly from f->fd, into linked list l.
+static int
+readrec7(File *f, Job *l, int *err)
 {
     int r, sz = 0;
     int namelen;
@@ -282,7 +905,7 @@ Error:
 }
 
 
-// Readrec5 is like readrec, but it reads a record in "version 5"
+// Readrec5 is like readrec7, but it reads a record in "version 5"
 // of the log format.
 static int
 readrec5(File *f, Job *l, int *err)
@@ -438,6 +1061,21 @@ readfull(File *f, void *c, int n, int *err, char *desc)
     return r;
 }
 
+// warnrd is like warnpos, for a file in memory.
+// P points into f->map.
+static void
+warnrd(File *f, byte *p, char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s:%td: ", f->path, p - f->map);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+
 static void
 warnpos(File *f, int adj, char *fmt, ...)
 {
@@ -453,79 +1091,163 @@ warnpos(File *f, int adj, char *fmt, ...)
 }
 
 
-// Opens f for writing, writes a header, and initializes
-// f->free and f->resv.
+// Opens f for writing by taking a spare file, which already has
+// a header (see walhk.c), and initializes f->free and f->resv.
 // Sets f->iswopen if successful.
 void
 filewopen(File *f)
 {
-    int fd, r;
-    int n;
-    int ver = Walver;
+    Spare s;
 
-    fd = open(f->path, O_WRONLY|O_CREAT, 0400);
-    if (fd < 0) {
-        twarn("open %s", f->path);
-        return;
-    }
-
-    r = falloc(fd, f->w->filesize);
-    if (r) {
-        if (close(fd) == -1)
-            twarn("close");
-        errno = r;
-        twarn("falloc %s", f->path);
-        r = unlink(f->path);
-        if (r) {
-            twarn("unlink %s", f->path);
-        }
+    if (!walspare(f->w, &s)) {
+        twarn("walspare %s", f->path);
         return;
     }
 
-    n = write(fd, &ver, sizeof(int));
-    if (n < 0 || (size_t)n < sizeof(int)) {
-        twarn("write %s", f->path);
-        if (close(fd) == -1)
+    if (rename(s.path, f->path) == -1) {
+        twarn("rename %s", s.path);
+        if (close(s.fd) == -1)
             twarn("close");
+        if (unlink(s.path) == -1)
+            twarn("unlink %s", s.path);
+        free(s.path);
         return;
     }
+    free(s.path);
 
-    f->fd = fd;
+    f->fd = s.fd;
     f->iswopen = 1;
     fileincref(f);
-    f->free = f->w->filesize - n;
+    f->free = f->w->filesize - sizeof(int);
     f->resv = 0;
 }
 
 
+// filewrite writes len bytes from buf to f on behalf of j,
+// using charge bytes of the space reserved for j. Whatever
+// part of the charge the record does not use goes back to f->free.
+// Bytes in a tube dictionary entry are not counted as part of j.
 static int
-filewrite(File *f, Job *j, void *buf, int len)
+filewrite(File *f, Job *j, void *buf, int len, int charge, int dict)
 {
-    int r;
-
-    r = write(f->fd, buf, len);
-    if (r != len) {
-        twarn("write");
+    if (!walqwrite(f->w, f->fd, buf, len)) {
+        twarnx("wal writer failed");
         return 0;
     }
 
-    f->w->resv -= r;
-    f->resv -= r;
-    j->walresv -= r;
-    j->walused += r;
-    f->w->alive += r;
+    f->w->resv -= charge;
+    f->resv -= charge;
+    f->free += charge - len;
+    j->walresv -= charge;
+    j->walused += len - dict;
+    f->w->alive += len - dict;
     return 1;
 }
 
 
+// putuv writes v as a varint at p and returns the number of bytes used.
+static int
+putuv(byte *p, uint64 v)
+{
+    int n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+
+// putid writes the delta-encoded id of j for f at p
+// and returns the number of bytes used.
+static int
+putid(File *f, byte *p, Job *j)
+{
+    int n = putuv(p, zigzag(j->r.id - f->lastid));
+    f->lastid = j->r.id;
+    return n;
+}
+
+
+// putsum writes checksum c at p and returns the number of bytes used.
+static int
+putsum(byte *p, uint32 c)
+{
+    p[0] = c;
+    p[1] = c >> 8;
+    p[2] = c >> 16;
+    p[3] = c >> 24;
+    return 4;
+}
+
+
+static int
+putcounters(byte *p, Job *j)
+{
+    int n = 0;
+
+    n += putuv(p+n, j->r.reserve_ct);
+    n += putuv(p+n, j->r.timeout_ct);
+    n += putuv(p+n, j->r.release_ct);
+    n += putuv(p+n, j->r.bury_ct);
+    n += putuv(p+n, j->r.kick_ct);
+    return n;
+}
+
+
+// Filefullmax returns the largest possible size of a full record
+// for j, including a tube dictionary entry. This is how much space
+// is reserved for it. A job that shares a body may get a Recjobref
+// record instead, which takes at most 10 bytes more than the record
+// without the body.
+int
+filefullmax(Job *j)
+{
+    return 1 + 5 + strlen(j->tube->name) + 4 + // dictionary entry
+           1 + 10 + 5 + 5 + 10 + 10 + 5 + 10 + 10 + 5*5 + 1 + // record
+           (j->dedup ? 10 : 1) + (j->expires_at ? 10 : 1) +
+           (j->group ? 2 + strlen(j->group->name) : 1) +
+           (j->bodyof ? 10 : 0) + j->r.body_size + 4;
+}
+
+
 int
 filewrjobshort(File *f, Job *j)
 {
-    int r, nl;
+    byte buf[Walupdmax];
+    int n = 1, r;
+
+    switch (j->r.state) {
+    case Invalid:
+        buf[0] = Recdelete;
+        n += putid(f, buf+n, j);
+        break;
+    case Delayed:
+        buf[0] = Recrelease;
+        n += putid(f, buf+n, j);
+        n += putuv(buf+n, j->r.pri);
+        n += putuv(buf+n, zigzag(j->r.delay));
+        n += putuv(buf+n, zigzag(j->r.deadline_at - j->r.created_at));
+        n += putcounters(buf+n, j);
+        break;
+    case Buried:
+        buf[0] = Recbury;
+        n += putid(f, buf+n, j);
+        n += putuv(buf+n, j->r.pri);
+        n += putcounters(buf+n, j);
+        break;
+    default:
+        // Ready; a reserved job is read back as ready anyway.
+        buf[0] = Reckick;
+        n += putid(f, buf+n, j);
+        n += putuv(buf+n, j->r.pri);
+        n += putcounters(buf+n, j);
+    }
+    n += putsum(buf+n, crc32c(0, buf, n));
 
-    nl = 0; // name len 0 indicates short record
-    r = filewrite(f, j, &nl, sizeof nl) &&
-        filewrite(f, j, &j->r, sizeof j->r);
+    r = filewrite(f, j, buf, n, Walupdmax, 0);
     if (!r) return 0;
 
     if (j->r.state == Invalid) {
@@ -536,18 +1258,193 @@ filewrjobshort(File *f, Job *j)
 }
 
 
+// puttube writes a tube dictionary entry for t at p,
+// unless f already has one, and returns the number of bytes used.
+static int
+puttube(File *f, byte *p, Tube *t)
+{
+    int n = 0, nl;
+
+    if (t->walseq[f->w->id] == f->seq) {
+        return 0;
+    }
+    nl = strlen(t->name);
+    p[n++] = Rectube;
+    n += putuv(p+n, nl);
+    memcpy(p+n, t->name, nl);
+    n += nl;
+    n += putsum(p+n, crc32c(0, p, n));
+    t->walseq[f->w->id] = f->seq;
+    t->walidx[f->w->id] = f->ntube++;
+    return n;
+}
+
+
+// putjob writes a full record for j at p, without the body, preceded
+// by a tube dictionary entry if needed, and sets *d to the size of
+// that entry. It puts the checksum of the record, which covers the
+// body, in sum. Returns the number of bytes used at p.
+// If src is not NULL, it writes a Recjobref record that refers
+// to src for the body instead.
+static int
+putjob(File *f, byte *p, Job *j, Job *src, byte *sum, int *d)
+{
+    int n, nl;
+    int64 d64;
+    uint32 c;
+
+    n = *d = puttube(f, p, j->tube);
+    p[n++] = src ? Recjobref : Recjob;
+    n += putid(f, p+n, j);
+    n += putuv(p+n, j->tube->walidx[f->w->id]);
+    n += putuv(p+n, j->r.pri);
+    n += putuv(p+n, zigzag(j->r.delay));
+    n += putuv(p+n, zigzag(j->r.ttr));
+    n += putuv(p+n, j->r.body_size);
+    n += putuv(p+n, zigzag(j->r.created_at - f->lastat));
+    // Only a delayed job needs its deadline.
+    d64 = j->r.state == Delayed ? j->r.deadline_at - j->r.created_at : 0;
+    n += putuv(p+n, zigzag(d64));
+    n += putcounters(p+n, j);
+    n += putuv(p+n, j->dedup);
+    n += putuv(p+n, j->expires_at ? j->expires_at - j->r.created_at : 0);
+    if (j->group) {
+        nl = strlen(j->group->name);
+        n += putuv(p+n, nl);
+        memcpy(p+n, j->group->name, nl);
+        n += nl;
+    } else {
+        p[n++] = 0;
+    }
+    p[n++] = j->r.state;
+    if (src) {
+        n += putuv(p+n, zigzag(src->r.id - j->r.id));
+    }
+    f->lastat = j->r.created_at;
+    c = crc32c(0, p + *d, n - *d);
+    if (!src) {
+        c = crc32c(c, j->body, j->r.body_size);
+    }
+    putsum(sum, c);
+    return n;
+}
+
+
+// filewrjobfull writes a full record for j to f. A job that shares
+// the body of a job whose latest full record is in f gets a Recjobref
+// record, without the body.
 int
 filewrjobfull(File *f, Job *j)
 {
-    int nl;
+    byte buf[Fullhdrmax], sum[4];
+    int n, d;
 
     fileaddjob(f, j);
-    nl = strlen(j->tube->name);
+    if (j->bodyof && j->bodyof->file == f) {
+        n = putjob(f, buf, j, j->bodyof, sum, &d);
+        return
+            filewrite(f, j, buf, n, filefullmax(j) - 4, d) &&
+            filewrite(f, j, sum, 4, 4, 0);
+    }
+    n = putjob(f, buf, j, NULL, sum, &d);
     return
-        filewrite(f, j, &nl, sizeof nl) &&
-        filewrite(f, j, j->tube->name, nl) &&
-        filewrite(f, j, &j->r, sizeof j->r) &&
-        filewrite(f, j, j->body, j->r.body_size);
+        filewrite(f, j, buf, n, filefullmax(j) - j->r.body_size - 4, d) &&
+        filewrite(f, j, j->body, j->r.body_size, j->r.body_size, 0) &&
+        filewrite(f, j, sum, 4, 4, 0);
+}
+
+
+// Snapw buffers the writes of a snapshot.
+typedef struct Snapw Snapw;
+struct Snapw {
+    int  fd;
+    int  n;
+    byte buf[64 * 1024];
+};
+
+
+static int
+writeall(int fd, byte *p, int n)
+{
+    int r;
+
+    while (n > 0) {
+        r = write(fd, p, n);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            twarn("write");
+            return 0;
+        }
+        p += r;
+        n -= r;
+    }
+    return 1;
+}
+
+
+// snapput buffers n bytes from p for sw->fd.
+// Returns 1 on success, otherwise 0.
+static int
+snapput(Snapw *sw, void *p, int n)
+{
+    if (sw->n + n > (int)sizeof(sw->buf)) {
+        if (!writeall(sw->fd, sw->buf, sw->n)) return 0;
+        sw->n = 0;
+        if (n > (int)sizeof(sw->buf)) {
+            return writeall(sw->fd, p, n);
+        }
+    }
+    memcpy(sw->buf + sw->n, p, n);
+    sw->n += n;
+    return 1;
+}
+
+
+// Filesnap writes a snapshot of all jobs in w, and the pause state
+// of their tubes, to fd. A snapshot is a binlog file with a full
+// record for each job. It runs in the child process forked by
+// walsnap, so it may change the tube dictionary state in Tube.
+// Returns 1 on success, otherwise 0.
+int
+filesnap(Wal *w, int fd)
+{
+    static Snapw sw;
+    File sf = {.seq = -1, .w = w}, *f;
+    byte buf[Fullhdrmax], sum[4];
+    int n, d, ver = Walver;
+    size_t i;
+    Job *j;
+    Tube *t;
+
+    sw.fd = fd;
+    sw.n = 0;
+    if (!snapput(&sw, &ver, sizeof(int))) return 0;
+
+    for (f = w->head; f; f = f->next) {
+        for (j = f->jlist.fnext; j && j != &f->jlist; j = j->fnext) {
+            n = putjob(&sf, buf, j, NULL, sum, &d);
+            if (!snapput(&sw, buf, n) ||
+                !snapput(&sw, j->body, j->r.body_size) ||
+                !snapput(&sw, sum, 4)) {
+                return 0;
+            }
+        }
+    }
+
+    for (i = 0; i < tubes.len; i++) {
+        t = tubes.items[i];
+        if (!t->pause) continue;
+        n = puttube(&sf, buf, t);
+        d = n;
+        buf[n++] = Recpause;
+        n += putuv(buf+n, t->walidx[w->id]);
+        n += putuv(buf+n, t->pause);
+        n += putuv(buf+n, zigzag(t->unpause_at));
+        n += putsum(buf+n, crc32c(0, buf+d, n-d));
+        if (!snapput(&sw, buf, n)) return 0;
+    }
+
+    return writeall(fd, sw.buf, sw.n);
 }
 
 
@@ -556,14 +1453,9 @@ filewclose(File *f)
 {
     if (!f) return;
     if (!f->iswopen) return;
-    if (f->free) {
-        errno = 0;
-        if (ftruncate(f->fd, f->w->filesize - f->free) != 0) {
-            twarn("ftruncate");
-        }
-    }
-    if (close(f->fd) == -1)
-        twarn("close");
+    // The writer thread truncates and closes the file
+    // after it has written everything queued for it.
+    walqclose(f->w, f->fd, f->free ? f->w->filesize - f->free : 0);
     f->iswopen = 0;
     filedecref(f);
 }
@@ -0,0 +1,252 @@
+#include "dat.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+// A message group is the set of jobs in a tube that were put with
+// the same group name. The jobs of a group are reserved one at a
+// time, oldest (smallest id) first: at most one of them is in the
+// tube's ready heap, and none while another one is reserved. The
+// group holds its other ready jobs in a list ordered by id.
+//
+// Groups are found by tube and name in a hash table, and live as
+// long as they have jobs.
+
+static Group  **groups;
+static size_t ngroups, capgroups;
+
+
+static size_t
+grouphash(Tube *t, const char *name)
+{
+    uint64 h = 14695981039346656037ull; // FNV-1a
+
+    for (; *name; name++) {
+        h = (h ^ (byte)*name) * 1099511628211ull;
+    }
+    h ^= (uintptr_t)t;
+    h *= 1099511628211ull;
+    return h ^ (h >> 32);
+}
+
+
+// grow doubles the size of the hash table.
+// Returns 1 on success, or 0 if out of memory.
+static int
+grow()
+{
+    size_t cap = capgroups ? capgroups * 2 : 64, i;
+    Group **a, *g, *next;
+
+    a = calloc(cap, sizeof(Group *));
+    if (!a) {
+        return 0;
+    }
+    for (i = 0; i < capgroups; i++) {
+        for (g = groups[i]; g; g = next) {
+            next = g->hnext;
+            size_t k = grouphash(g->tube, g->name) & (cap - 1);
+            g->hnext = a[k];
+            a[k] = g;
+        }
+    }
+    free(groups);
+    groups = a;
+    capgroups = cap;
+    return 1;
+}
+
+
+// group_find_or_make returns the group called name in tube t,
+// making it if it does not exist, or NULL if out of memory.
+// A new group has no references; see group_iref.
+Group *
+group_find_or_make(Tube *t, const char *name)
+{
+    Group *g;
+    size_t k;
+
+    if (capgroups) {
+        k = grouphash(t, name) & (capgroups - 1);
+        for (g = groups[k]; g; g = g->hnext) {
+            if (g->tube == t && strcmp(g->name, name) == 0) {
+                return g;
+            }
+        }
+    }
+
+    if (ngroups >= capgroups && !grow()) {
+        twarnx("OOM");
+        return NULL;
+    }
+    g = new(Group);
+    if (!g) {
+        twarnx("OOM");
+        return NULL;
+    }
+    strncpy(g->name, name, MAX_TUBE_NAME_LEN - 1);
+    TUBE_ASSIGN(g->tube, t);
+    k = grouphash(t, g->name) & (capgroups - 1);
+    g->hnext = groups[k];
+    groups[k] = g;
+    ngroups++;
+    return g;
+}
+
+
+void
+group_iref(Group *g)
+{
+    g->refs++;
+}
+
+
+// group_dref drops a reference to g, and frees it
+// along with its index entry if that was the last one.
+void
+group_dref(Group *g)
+{
+    Group **p;
+
+    if (--g->refs > 0) {
+        return;
+    }
+    p = &groups[grouphash(g->tube, g->name) & (capgroups - 1)];
+    while (*p != g) {
+        p = &(*p)->hnext;
+    }
+    *p = g->hnext;
+    ngroups--;
+    TUBE_ASSIGN(g->tube, NULL);
+    free(g);
+}
+
+
+// hold adds ready job j to the jobs held by g, in order of id.
+static void
+hold(Group *g, Job *j)
+{
+    Job *p = g->last;
+
+    // A job usually comes back as the oldest, or is the newest.
+    if (g->first && j->r.id < g->first->r.id) {
+        p = NULL;
+    }
+    while (p && p->r.id > j->r.id) {
+        p = p->prev;
+    }
+    j->prev = p;
+    j->next = p ? p->next : g->first;
+    if (j->next) {
+        j->next->prev = j;
+    } else {
+        g->last = j;
+    }
+    if (p) {
+        p->next = j;
+    } else {
+        g->first = j;
+    }
+    j->held = 1;
+    j->tube->held_ct++;
+}
+
+
+static void
+unhold(Group *g, Job *j)
+{
+    if (j->prev) {
+        j->prev->next = j->next;
+    } else {
+        g->first = j->next;
+    }
+    if (j->next) {
+        j->next->prev = j->prev;
+    } else {
+        g->last = j->prev;
+    }
+    job_list_reset(j);
+    j->held = 0;
+    j->tube->held_ct--;
+}
+
+
+// group_ready puts ready job j of a group in its tube's ready heap,
+// if it may be reserved next; otherwise the group holds it.
+// Returns 1 on success, or 0 if the heap could not grow.
+int
+group_ready(Job *j)
+{
+    Group *g = j->group;
+    Job *h = g->ready;
+
+    if (g->active || (h && h->r.id < j->r.id)) {
+        hold(g, j);
+        return 1;
+    }
+    if (!heapinsert(&j->tube->ready, j)) {
+        return 0;
+    }
+    if (h) {
+        heapremove(&h->tube->ready, h->heap_index);
+        hold(g, h);
+    }
+    g->ready = j;
+    return 1;
+}
+
+
+// group_unready takes ready job j of a group out of its tube's
+// ready heap, or out of the jobs its group holds.
+void
+group_unready(Job *j)
+{
+    Group *g = j->group;
+
+    if (j->held) {
+        unhold(g, j);
+        return;
+    }
+    heapremove(&j->tube->ready, j->heap_index);
+    if (g->ready == j) {
+        g->ready = NULL;
+    }
+}
+
+
+// group_reserve records that a job of g is now reserved.
+// The group's job in the ready heap, if any, is held back.
+void
+group_reserve(Group *g)
+{
+    Job *h = g->ready;
+
+    g->active++;
+    if (h) {
+        heapremove(&h->tube->ready, h->heap_index);
+        hold(g, h);
+        g->ready = NULL;
+    }
+}
+
+
+// group_settle puts the oldest job g holds in the ready heap, if no
+// job of g is reserved or in the heap. Call it once a job of g that
+// was reserved or ready has gone elsewhere.
+// Returns 1 if it put a job in the heap, otherwise 0.
+int
+group_settle(Group *g)
+{
+    Job *j = g->first;
+
+    if (g->active || g->ready || !j) {
+        return 0;
+    }
+    if (!heapinsert(&j->tube->ready, j)) {
+        // It will be tried again when the next job of g moves.
+        return 0;
+    }
+    unhold(g, j);
+    g->ready = j;
+    return 1;
+}
@@ -68,10 +68,10 @@ siftup(Heap *h, size_t k)
 }
 
 
-// Heapinsert inserts x into heap h according to h->less.
+// grow makes room for one more element in h.
 // It returns 1 on success, otherwise 0.
-int
-heapinsert(Heap *h, void *x)
+static int
+grow(Heap *h)
 {
     if (h->len == h->cap) {
         void **ndata;
@@ -87,6 +87,18 @@ heapinsert(Heap *h, void *x)
         h->data = ndata;
         h->cap = ncap;
     }
+    return 1;
+}
+
+
+// Heapinsert inserts x into heap h according to h->less.
+// It returns 1 on success, otherwise 0.
+int
+heapinsert(Heap *h, void *x)
+{
+    if (!grow(h)) {
+        return 0;
+    }
 
     size_t k = h->len;
     h->len++;
@@ -96,6 +108,33 @@ heapinsert(Heap *h, void *x)
 }
 
 
+// Heapappend adds x to the end of heap h without restoring
+// the heap property. Call heapify before using h again.
+// It returns 1 on success, otherwise 0.
+int
+heapappend(Heap *h, void *x)
+{
+    if (!grow(h)) {
+        return 0;
+    }
+
+    set(h, h->len++, x);
+    return 1;
+}
+
+
+// Heapify restores the heap property of h in O(h->len) time.
+void
+heapify(Heap *h)
+{
+    size_t k;
+
+    for (k = h->len / 2; k > 0; k--) {
+        siftup(h, k-1);
+    }
+}
+
+
 void *
 heapremove(Heap *h, size_t k)
 {
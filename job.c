@@ -115,27 +115,93 @@ make_job_with_id(uint32 pri, int64 delay, int64 ttr,
 {
     Job *j;
 
+    j = job_new(pri, delay, ttr, body_size, tube);
+    if (!j) {
+        return (Job *) 0;
+    }
+
+    job_store_id(j, id);
+    return j;
+}
+
+// job_new makes a job like make_job, but without an id.
+// Use job_store to give it one.
+Job *
+job_new(uint32 pri, int64 delay, int64 ttr, int body_size, Tube *tube)
+{
+    Job *j;
+
     j = allocate_job(body_size);
     if (!j) {
         twarnx("OOM");
         return (Job *) 0;
     }
 
+    j->r.pri = pri;
+    j->r.delay = delay;
+    j->r.ttr = ttr;
+
+    TUBE_ASSIGN(j->tube, tube);
+
+    // A job expires once its tube's time to live is up, if it has one.
+    if (tube && tube->expire) {
+        j->expires_at = j->r.created_at + tube->expire;
+    }
+
+    return j;
+}
+
+// job_new_shared makes a job like src, but in tube and without an id,
+// that has no body of its own: it shares src's body, holding a
+// reference to src until it is freed. Use job_store to give it an id.
+Job *
+job_new_shared(Job *src, Tube *tube)
+{
+    Job *j;
+
+    if (src->bodyof) {
+        src = src->bodyof;
+    }
+    j = job_new(src->r.pri, src->r.delay, src->r.ttr, 0, tube);
+    if (!j) {
+        return (Job *) 0;
+    }
+
+    j->r.body_size = src->r.body_size;
+    j->body = src->body;
+    j->bodyof = src;
+    job_ref(src);
+    return j;
+}
+
+// job_store gives j, made by job_new, the next job id
+// and makes it visible to job_find.
+void
+job_store(Job *j)
+{
+    job_store_id(j, 0);
+}
+
+// job_peek_id returns the id that job_store will give the next job.
+uint64
+job_peek_id(void)
+{
+    return next_id;
+}
+
+// job_store_id is job_store with a given id, such as one read
+// from the binlog. An id of 0 means the next one.
+void
+job_store_id(Job *j, uint64 id)
+{
     if (id) {
         j->r.id = id;
         if (id >= next_id) next_id = id + 1;
     } else {
         j->r.id = next_id++;
     }
-    j->r.pri = pri;
-    j->r.delay = delay;
-    j->r.ttr = ttr;
 
     store_job(j);
-
-    TUBE_ASSIGN(j->tube, tube);
-
-    return j;
 }
 
 static void
@@ -154,15 +220,37 @@ job_hash_free(Job *j)
     if (all_jobs_used < (all_jobs_cap >> 4)) rehash(0);
 }
 
+// job_release frees j's memory, dropping its reference
+// to the job whose body it shares, if any.
+static void
+job_release(Job *j)
+{
+    Job *b = j->bodyof;
+
+    free(j);
+    if (b) {
+        job_unref(b);
+    }
+}
+
 void
 job_free(Job *j)
 {
-    if (j) {
-        TUBE_ASSIGN(j->tube, NULL);
-        if (j->r.state != Copy) job_hash_free(j);
+    if (!j) {
+        return;
     }
 
-    free(j);
+    TUBE_ASSIGN(j->tube, NULL);
+    if (j->group) {
+        group_dref(j->group);
+        j->group = NULL;
+    }
+    job_hash_free(j);
+    if (j->refs) {
+        j->freed = 1;
+        return;
+    }
+    job_release(j);
 }
 
 void
@@ -191,30 +279,39 @@ job_delay_less(void *ja, void *jb)
     return a->r.id < b->r.id;
 }
 
-Job *
-job_copy(Job *j)
+void
+job_expire_setpos(void *j, size_t pos)
 {
-    if (!j)
-        return NULL;
-
-    Job *n = malloc(sizeof(Job) + j->r.body_size);
-    if (!n) {
-        twarnx("OOM");
-        return (Job *) 0;
-    }
-
-    memcpy(n, j, sizeof(Job) + j->r.body_size);
-    job_list_reset(n);
-
-    n->file = NULL; /* copies do not have refcnt on the wal */
+    ((Job *)j)->expire_index = pos;
+}
 
-    n->tube = 0; /* Don't use memcpy for the tube, which we must refcount. */
-    TUBE_ASSIGN(n->tube, j->tube);
+int
+job_expire_less(void *ja, void *jb)
+{
+    Job *a = ja;
+    Job *b = jb;
+    if (a->expires_at < b->expires_at) return 1;
+    if (a->expires_at > b->expires_at) return 0;
+    return a->r.id < b->r.id;
+}
 
-    /* Mark this job as a copy so it can be appropriately freed later on */
-    n->r.state = Copy;
+// job_ref takes a reference to j for a conn that is sending it,
+// or for a job that shares its body (see job_new_shared).
+// Job bodies never change, so the conn can send j's body without
+// copying it; if j is deleted meanwhile, job_free leaves its memory
+// alone until the last job_unref.
+void
+job_ref(Job *j)
+{
+    j->refs++;
+}
 
-    return n;
+void
+job_unref(Job *j)
+{
+    if (--j->refs == 0 && j->freed) {
+        job_release(j);
+    }
 }
 
 const char *
@@ -39,6 +39,7 @@ sockwant(Socket *s, int rw)
         s->added = 1;
         op = EPOLL_CTL_ADD;
     } else if (!rw) {
+        s->added = 0;
         op = EPOLL_CTL_DEL;
     } else {
         op = EPOLL_CTL_MOD;
@@ -66,7 +67,8 @@ socknext(Socket **s, int64 timeout)
     int r;
     struct epoll_event ev = {.events=0};
 
-    r = epoll_wait(epfd, &ev, 1, (int)(timeout/1000000));
+    // Round up, so we never wake before a deadline and spin.
+    r = epoll_wait(epfd, &ev, 1, (int)((timeout + 999999)/1000000));
     if (r == -1 && errno != EINTR) {
         twarn("epoll_wait");
         exit(1);
@@ -84,3 +86,19 @@ socknext(Socket **s, int64 timeout)
     }
     return 0;
 }
+
+
+// sysfalloc allocates disk space of len bytes with posix_fallocate,
+// and falls back to rawfalloc if the file system can't do that.
+// Returns 0 on success, and a positive errno otherwise.
+int
+sysfalloc(int fd, int len)
+{
+    int r;
+
+    r = posix_fallocate(fd, 0, len);
+    if (r == EINVAL || r == EOPNOTSUPP) {
+        return rawfalloc(fd, len);
+    }
+    return r;
+}
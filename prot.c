@@ -25,6 +25,7 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "0123456789-+/;.$_()"
 
 #define CMD_PUT "put "
+#define CMD_PUT_BATCH "put-batch "
 #define CMD_PEEKJOB "peek "
 #define CMD_PEEK_READY "peek-ready"
 #define CMD_PEEK_DELAYED "peek-delayed"
@@ -32,9 +33,13 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_RESERVE "reserve"
 #define CMD_RESERVE_TIMEOUT "reserve-with-timeout "
 #define CMD_RESERVE_JOB "reserve-job "
+#define CMD_RESERVE_BATCH "reserve-batch "
 #define CMD_DELETE "delete "
 #define CMD_RELEASE "release "
 #define CMD_BURY "bury "
+#define CMD_DELETE_MANY "delete-many "
+#define CMD_RELEASE_MANY "release-many "
+#define CMD_BURY_MANY "bury-many "
 #define CMD_KICK "kick "
 #define CMD_KICKJOB "kick-job "
 #define CMD_TOUCH "touch "
@@ -49,9 +54,18 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_STATS_TUBE "stats-tube "
 #define CMD_QUIT "quit"
 #define CMD_PAUSE_TUBE "pause-tube"
+#define CMD_DURABILITY_TUBE "durability-tube "
+#define CMD_SUBSCRIBE "subscribe "
+#define CMD_PUT_IN "put-in "
+#define CMD_RESERVE_FROM "reserve-from "
+#define CMD_PUT_MULTI "put-multi "
+#define CMD_PUT_GROUP "put-group "
+#define CMD_EXPIRE_TUBE "expire-tube "
 
 #define CONSTSTRLEN(m) (sizeof(m) - 1)
 
+#define CMD_PUT_LEN CONSTSTRLEN(CMD_PUT)
+#define CMD_PUT_BATCH_LEN CONSTSTRLEN(CMD_PUT_BATCH)
 #define CMD_PEEK_READY_LEN CONSTSTRLEN(CMD_PEEK_READY)
 #define CMD_PEEK_DELAYED_LEN CONSTSTRLEN(CMD_PEEK_DELAYED)
 #define CMD_PEEK_BURIED_LEN CONSTSTRLEN(CMD_PEEK_BURIED)
@@ -59,9 +73,13 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_RESERVE_LEN CONSTSTRLEN(CMD_RESERVE)
 #define CMD_RESERVE_TIMEOUT_LEN CONSTSTRLEN(CMD_RESERVE_TIMEOUT)
 #define CMD_RESERVE_JOB_LEN CONSTSTRLEN(CMD_RESERVE_JOB)
+#define CMD_RESERVE_BATCH_LEN CONSTSTRLEN(CMD_RESERVE_BATCH)
 #define CMD_DELETE_LEN CONSTSTRLEN(CMD_DELETE)
 #define CMD_RELEASE_LEN CONSTSTRLEN(CMD_RELEASE)
 #define CMD_BURY_LEN CONSTSTRLEN(CMD_BURY)
+#define CMD_DELETE_MANY_LEN CONSTSTRLEN(CMD_DELETE_MANY)
+#define CMD_RELEASE_MANY_LEN CONSTSTRLEN(CMD_RELEASE_MANY)
+#define CMD_BURY_MANY_LEN CONSTSTRLEN(CMD_BURY_MANY)
 #define CMD_KICK_LEN CONSTSTRLEN(CMD_KICK)
 #define CMD_KICKJOB_LEN CONSTSTRLEN(CMD_KICKJOB)
 #define CMD_TOUCH_LEN CONSTSTRLEN(CMD_TOUCH)
@@ -75,10 +93,16 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define CMD_LIST_TUBES_WATCHED_LEN CONSTSTRLEN(CMD_LIST_TUBES_WATCHED)
 #define CMD_STATS_TUBE_LEN CONSTSTRLEN(CMD_STATS_TUBE)
 #define CMD_PAUSE_TUBE_LEN CONSTSTRLEN(CMD_PAUSE_TUBE)
+#define CMD_DURABILITY_TUBE_LEN CONSTSTRLEN(CMD_DURABILITY_TUBE)
+#define CMD_SUBSCRIBE_LEN CONSTSTRLEN(CMD_SUBSCRIBE)
+#define CMD_PUT_IN_LEN CONSTSTRLEN(CMD_PUT_IN)
+#define CMD_RESERVE_FROM_LEN CONSTSTRLEN(CMD_RESERVE_FROM)
+#define CMD_PUT_MULTI_LEN CONSTSTRLEN(CMD_PUT_MULTI)
+#define CMD_PUT_GROUP_LEN CONSTSTRLEN(CMD_PUT_GROUP)
+#define CMD_EXPIRE_TUBE_LEN CONSTSTRLEN(CMD_EXPIRE_TUBE)
 
-#define MSG_FOUND "FOUND"
 #define MSG_NOTFOUND "NOT_FOUND\r\n"
-#define MSG_RESERVED "RESERVED"
+#define MSG_RESERVED_BATCH_FMT "RESERVED-BATCH %d %zu\r\n"
 #define MSG_DEADLINE_SOON "DEADLINE_SOON\r\n"
 #define MSG_TIMED_OUT "TIMED_OUT\r\n"
 #define MSG_DELETED "DELETED\r\n"
@@ -86,9 +110,13 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define MSG_BURIED "BURIED\r\n"
 #define MSG_KICKED "KICKED\r\n"
 #define MSG_TOUCHED "TOUCHED\r\n"
-#define MSG_BURIED_FMT "BURIED %"PRIu64"\r\n"
-#define MSG_INSERTED_FMT "INSERTED %"PRIu64"\r\n"
+#define MSG_INSERTED_BATCH_FMT "INSERTED-BATCH %"PRIu64" %d\r\n"
+#define MSG_DELETED_MANY "DELETED-MANY"
+#define MSG_RELEASED_MANY "RELEASED-MANY"
+#define MSG_BURIED_MANY "BURIED-MANY"
 #define MSG_NOT_IGNORED "NOT_IGNORED\r\n"
+#define MSG_UPDATED "UPDATED\r\n"
+#define MSG_SUBSCRIBED "SUBSCRIBED\r\n"
 
 #define MSG_OUT_OF_MEMORY "OUT_OF_MEMORY\r\n"
 #define MSG_INTERNAL_ERROR "INTERNAL_ERROR\r\n"
@@ -134,7 +162,19 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
 #define OP_PAUSE_TUBE 23
 #define OP_KICKJOB 24
 #define OP_RESERVE_JOB 25
-#define TOTAL_OPS 26
+#define OP_DURABILITY_TUBE 26
+#define OP_PUT_BATCH 27
+#define OP_RESERVE_BATCH 28
+#define OP_DELETE_MANY 29
+#define OP_RELEASE_MANY 30
+#define OP_BURY_MANY 31
+#define OP_SUBSCRIBE 32
+#define OP_PUT_IN 33
+#define OP_RESERVE_FROM 34
+#define OP_PUT_MULTI 35
+#define OP_PUT_GROUP 36
+#define OP_EXPIRE_TUBE 37
+#define TOTAL_OPS 38
 
 #define STATS_FMT "---\n" \
     "current-jobs-urgent: %" PRIu64 "\n" \
@@ -182,7 +222,13 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "binlog-current-index: %d\n" \
     "binlog-records-migrated: %" PRId64 "\n" \
     "binlog-records-written: %" PRId64 "\n" \
+    "binlog-bytes-migrated: %" PRId64 "\n" \
+    "binlog-space-amplification: %.2f\n" \
+    "binlog-compaction-lag: %" PRId64 ".%03" PRId64 "\n" \
     "binlog-max-size: %d\n" \
+    "binlog-pending-unlinks: %d\n" \
+    "binlog-snapshots: %" PRId64 "\n" \
+    "binlog-streams: %d\n" \
     "draining: %s\n" \
     "id: %s\n" \
     "hostname: %s\n" \
@@ -198,6 +244,7 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "current-jobs-delayed: %zu\n" \
     "current-jobs-buried: %" PRIu64 "\n" \
     "total-jobs: %" PRIu64 "\n" \
+    "total-expired: %" PRIu64 "\n" \
     "current-using: %u\n" \
     "current-watching: %u\n" \
     "current-waiting: %" PRIu64 "\n" \
@@ -205,6 +252,8 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "cmd-pause-tube: %" PRIu64 "\n" \
     "pause: %" PRIu64 "\n" \
     "pause-time-left: %" PRId64 "\n" \
+    "durability: %s\n" \
+    "expire-ms: %" PRId64 "\n" \
     "\r\n"
 
 #define STATS_JOB_FMT "---\n" \
@@ -222,11 +271,56 @@ size_t job_data_size_limit = JOB_DATA_SIZE_LIMIT_DEFAULT;
     "releases: %u\n" \
     "buries: %u\n" \
     "kicks: %u\n" \
+    "durability: %s\n" \
+    "age-ms: %" PRId64 "\n" \
+    "delay-ms: %" PRId64 "\n" \
+    "ttr-ms: %" PRId64 "\n" \
+    "time-left-ms: %" PRId64 "\n" \
     "\r\n"
 
+// The binary protocol. A client picks it by sending BIN_MAGIC as its first
+// byte. Requests have a header of BIN_REQ_SIZE bytes, replies one of
+// BIN_REPLY_SIZE bytes; see doc/protocol.txt. A put has BIN_PUT_SIZE bytes
+// of arguments before the body.
+#define BIN_MAGIC 0x80
+#define BIN_REQ_SIZE 12
+#define BIN_REPLY_SIZE 20
+#define BIN_PUT_SIZE 12
+
+// Binary reply status codes. They stand for the words of the text replies
+// in bin_words.
+#define ST_INSERTED 1
+#define ST_BURIED 2
+#define ST_RESERVED 3
+#define ST_FOUND 4
+#define ST_DELETED 5
+#define ST_RELEASED 6
+#define ST_TOUCHED 7
+#define ST_USING 8
+#define ST_WATCHING 9
+#define ST_NOT_IGNORED 10
+#define ST_NOT_FOUND 11
+#define ST_DEADLINE_SOON 12
+#define ST_TIMED_OUT 13
+#define ST_DRAINING 14
+#define ST_JOB_TOO_BIG 15
+#define ST_OUT_OF_MEMORY 16
+#define ST_INTERNAL_ERROR 17
+#define ST_BAD_FORMAT 18
+#define ST_UNKNOWN_COMMAND 19
+#define TOTAL_ST 20
+
 // The size of the throw-away (BITBUCKET) buffer. Arbitrary.
 #define BUCKET_BUF_SIZE 1024
 
+// The maximum number of jobs in one put-batch, reserve-batch,
+// delete-many, release-many or bury-many command.
+#define BATCH_MAX 1000
+
+// The most jobs prottick expires at a time. If more are due, it
+// lets the server handle other events before it goes on.
+#define EXPIRE_BATCH 1000
+
 static uint64 ready_ct = 0;
 static uint64 timeout_ct = 0;
 static uint64 op_ct[TOTAL_OPS] = {0};
@@ -276,9 +370,66 @@ static const char * op_names[] = {
     CMD_PAUSE_TUBE,
     CMD_KICKJOB,
     CMD_RESERVE_JOB,
+    CMD_DURABILITY_TUBE,
+    CMD_PUT_BATCH,
+    CMD_RESERVE_BATCH,
+    CMD_DELETE_MANY,
+    CMD_RELEASE_MANY,
+    CMD_BURY_MANY,
+    CMD_SUBSCRIBE,
+    CMD_PUT_IN,
+    CMD_RESERVE_FROM,
+    CMD_PUT_MULTI,
+    CMD_PUT_GROUP,
+    CMD_EXPIRE_TUBE,
+};
+
+static const char *const bin_words[TOTAL_ST] = {
+    [ST_INSERTED] = "INSERTED",
+    [ST_BURIED] = "BURIED",
+    [ST_RESERVED] = "RESERVED",
+    [ST_FOUND] = "FOUND",
+    [ST_DELETED] = "DELETED",
+    [ST_RELEASED] = "RELEASED",
+    [ST_TOUCHED] = "TOUCHED",
+    [ST_USING] = "USING",
+    [ST_WATCHING] = "WATCHING",
+    [ST_NOT_IGNORED] = "NOT_IGNORED",
+    [ST_NOT_FOUND] = "NOT_FOUND",
+    [ST_DEADLINE_SOON] = "DEADLINE_SOON",
+    [ST_TIMED_OUT] = "TIMED_OUT",
+    [ST_DRAINING] = "DRAINING",
+    [ST_JOB_TOO_BIG] = "JOB_TOO_BIG",
+    [ST_OUT_OF_MEMORY] = "OUT_OF_MEMORY",
+    [ST_INTERNAL_ERROR] = "INTERNAL_ERROR",
+    [ST_BAD_FORMAT] = "BAD_FORMAT",
+    [ST_UNKNOWN_COMMAND] = "UNKNOWN_COMMAND",
+};
+
+// The text replies for the status codes that make up a whole line.
+static char *const st_msgs[TOTAL_ST] = {
+    [ST_BURIED] = MSG_BURIED,
+    [ST_DELETED] = MSG_DELETED,
+    [ST_RELEASED] = MSG_RELEASED,
+    [ST_TOUCHED] = MSG_TOUCHED,
+    [ST_NOT_IGNORED] = MSG_NOT_IGNORED,
+    [ST_NOT_FOUND] = MSG_NOTFOUND,
+    [ST_DEADLINE_SOON] = MSG_DEADLINE_SOON,
+    [ST_TIMED_OUT] = MSG_TIMED_OUT,
+    [ST_DRAINING] = MSG_DRAINING,
+    [ST_JOB_TOO_BIG] = MSG_JOB_TOO_BIG,
+    [ST_OUT_OF_MEMORY] = MSG_OUT_OF_MEMORY,
+    [ST_INTERNAL_ERROR] = MSG_INTERNAL_ERROR,
+    [ST_BAD_FORMAT] = MSG_BAD_FORMAT,
+    [ST_UNKNOWN_COMMAND] = MSG_UNKNOWN_COMMAND,
 };
 
 static Job *remove_buried_job(Job *j);
+static Job *remove_ready_job(Job *j);
+static Job *remove_delayed_job(Job *j);
+static int ready_insert(Job *j);
+static void expire_track(Job *j);
+static void dedup_walwait(Conn *c, Job *j);
 
 // epollq_add schedules connection c in the s->conns heap, adds c
 // to the epollq list to change expected operation in event notifications.
@@ -337,6 +488,78 @@ epollq_apply()
 #define reply_serr(c, e) \
     (twarnx("server error: %s", (e)), reply_msg((c), (e)))
 
+#define conn_bin(c) ((c)->proto == 'b')
+
+// trailer returns the number of bytes that follow a job body
+// on the wire: the "\r\n" of the text protocol, or none.
+static int
+trailer(Conn *c)
+{
+    return conn_bin(c) ? 0 : 2;
+}
+
+// Integers in binary commands are big-endian.
+static uint32
+get32(const char *p)
+{
+    const byte *b = (const byte *)p;
+    return (uint32)b[0] << 24 | (uint32)b[1] << 16 | (uint32)b[2] << 8 | b[3];
+}
+
+static uint64
+get64(const char *p)
+{
+    return (uint64)get32(p) << 32 | get32(p + 4);
+}
+
+static void
+put32(char *p, uint32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void
+put64(char *p, uint64 v)
+{
+    put32(p, v >> 32);
+    put32(p + 4, v);
+}
+
+// fill_bin makes c->reply the header of a binary reply with status st,
+// value v, and len bytes of c->out_job to follow.
+static void
+fill_bin(Conn *c, int st, uint64 v, uint32 len)
+{
+    char *p = c->reply_buf;
+
+    p[0] = st;
+    p[1] = p[2] = p[3] = 0;
+    put32(p + 4, c->reqid);
+    put64(p + 8, v);
+    put32(p + 16, len);
+    c->reply = p;
+    c->reply_len = BIN_REPLY_SIZE;
+    c->reply_sent = 0;
+}
+
+// reply_bin replies to a binary command; see fill_bin.
+static void
+reply_bin(Conn *c, int st, uint64 v, uint32 len, int state)
+{
+    epollq_add(c, 'w');
+
+    fill_bin(c, st, v, len);
+    c->state = state;
+    if (verbose >= 2) {
+        printf(">%d reply %s %"PRIu64"\n", c->sock.fd, bin_words[st], v);
+    }
+}
+
+// reply sends the len bytes at line to c. For a binary client they
+// must be a reply header; see fill_bin.
 static void
 reply(Conn *c, char *line, int len, int state)
 {
@@ -349,11 +572,23 @@ reply(Conn *c, char *line, int len, int state)
     c->reply_len = len;
     c->reply_sent = 0;
     c->state = state;
-    if (verbose >= 2) {
+    if (verbose >= 2 && !conn_bin(c)) {
         printf(">%d reply %.*s\n", c->sock.fd, len-2, line);
     }
 }
 
+// reply_st replies with status st. For a text client it must have
+// a line in st_msgs.
+static void
+reply_st(Conn *c, int st)
+{
+    if (conn_bin(c)) {
+        reply_bin(c, st, 0, 0, STATE_SEND_WORD);
+        return;
+    }
+    reply(c, st_msgs[st], strlen(st_msgs[st]), STATE_SEND_WORD);
+}
+
 static void
 reply_line(Conn*, int, const char*, ...)
 __attribute__((format(printf, 3, 4)));
@@ -379,19 +614,50 @@ reply_line(Conn *c, int state, const char *fmt, ...)
     reply(c, c->reply_buf, r, state);
 }
 
+// reply_nums replies with status st and the line <word> <a>, or
+// <word> <a> <b> if b is not negative, where word is that of st.
+// A binary client gets a as the value and b as the length.
+// The busiest replies look like this, so it formats the numbers
+// itself rather than going through printf.
+static void
+reply_nums(Conn *c, int state, int st, uint64 a, int64 b)
+{
+    char *p = c->reply_buf;
+    size_t n = strlen(bin_words[st]);
+
+    if (conn_bin(c)) {
+        reply_bin(c, st, a, b < 0 ? 0 : b, state);
+        return;
+    }
+
+    memcpy(p, bin_words[st], n);
+    p += n;
+    *p++ = ' ';
+    p += fmtu64(p, a);
+    if (b >= 0) {
+        *p++ = ' ';
+        p += fmtu64(p, b);
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    *p = '\0';
+    reply(c, c->reply_buf, p - c->reply_buf, state);
+}
+
 // reply_job tells the connection c which job to send,
-// and replies with this line: <msg> <job_id> <job_size>.
+// and replies with status st: <word> <job_id> <job_size>.
 static void
-reply_job(Conn *c, Job *j, const char *msg)
+reply_job(Conn *c, Job *j, int st)
 {
+    job_ref(j);
     c->out_job = j;
     c->out_job_sent = 0;
-    reply_line(c, STATE_SEND_JOB, "%s %"PRIu64" %u\r\n",
-               msg, j->r.id, j->r.body_size - 2);
+    reply_nums(c, STATE_SEND_JOB, st, j->r.id, j->r.body_size - 2);
 }
 
 // remove_waiting_conn unsets CONN_TYPE_WAITING for the connection,
-// removes it from the waiting_conns set of every tube it's watching.
+// removes it from the waiting_conns set of every tube it's watching,
+// or that its reserve-from named, and forgets the latter.
 // Noop if connection is not waiting.
 void
 remove_waiting_conn(Conn *c)
@@ -402,23 +668,26 @@ remove_waiting_conn(Conn *c)
     c->type &= ~CONN_TYPE_WAITING;
     global_stat.waiting_ct--;
     size_t i;
-    for (i = 0; i < c->watch.len; i++) {
-        Tube *t = c->watch.items[i];
+    Ms *l = connresvtubes(c);
+    for (i = 0; i < l->len; i++) {
+        Tube *t = l->items[i];
         t->stat.waiting_ct--;
         ms_remove(&t->waiting_conns, c);
     }
+    ms_clear(&c->from);
 }
 
 // enqueue_waiting_conn sets CONN_TYPE_WAITING for the connection,
-// adds it to the waiting_conns set of every tube it's watching.
+// adds it to the waiting_conns set of every tube it reserves from.
 static void
 enqueue_waiting_conn(Conn *c)
 {
     c->type |= CONN_TYPE_WAITING;
     global_stat.waiting_ct++;
     size_t i;
-    for (i = 0; i < c->watch.len; i++) {
-        Tube *t = c->watch.items[i];
+    Ms *l = connresvtubes(c);
+    for (i = 0; i < l->len; i++) {
+        Tube *t = l->items[i];
         t->stat.waiting_ct++;
         ms_append(&t->waiting_conns, c);
     }
@@ -451,6 +720,88 @@ next_awaited_job(int64 now)
     return j;
 }
 
+// next_watched_job returns the next ready job with the smallest priority
+// in the tubes c reserves from, or NULL if there is none.
+// If jobs has the same priority it picks the job with smaller id.
+static Job *
+next_watched_job(Conn *c, int64 now)
+{
+    size_t i;
+    Job *j = NULL;
+    Ms *l = connresvtubes(c);
+
+    for (i = 0; i < l->len; i++) {
+        Tube *t = l->items[i];
+        if (t->pause && t->unpause_at > now)
+            continue;
+        if (t->ready.len) {
+            Job *candidate = t->ready.data[0];
+            if (!j || job_pri_less(candidate, j)) {
+                j = candidate;
+            }
+        }
+    }
+    return j;
+}
+
+// reserve_batch reserves job j for c together with the next ready jobs
+// of the tubes c watches, up to c->resvmax jobs in all, and replies with
+// all of them at once. Job j must be already removed from the ready heap.
+// On the failure to allocate the reply the jobs are put back.
+static void
+reserve_batch(Conn *c, Job *j, int64 now)
+{
+    Job *js[BATCH_MAX];
+    int i, n = 0;
+    size_t z = 0;
+    char *buf;
+
+    js[n++] = j;
+    while (n < c->resvmax && (j = next_watched_job(c, now))) {
+        js[n++] = remove_ready_job(j);
+    }
+
+    // Each job goes as "<id> <bytes>\r\n<data>\r\n".
+    for (i = 0; i < n; i++) {
+        j = js[i];
+        z += snprintf(NULL, 0, "%"PRIu64" %d\r\n", j->r.id, j->r.body_size - 2);
+        z += j->r.body_size;
+    }
+
+    c->out_data = malloc(z + 2);
+    if (!c->out_data) {
+        // The heaps had room for these jobs just now, so this can't fail.
+        for (i = 0; i < n; i++) {
+            j = js[i];
+            ready_insert(j);
+            expire_track(j);
+            ready_ct++;
+            if (j->r.pri < URGENT_THRESHOLD) {
+                global_stat.urgent_ct++;
+                j->tube->stat.urgent_ct++;
+            }
+        }
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    c->out_len = z + 2;
+    buf = c->out_data;
+    for (i = 0; i < n; i++) {
+        j = js[i];
+        global_stat.reserved_ct++;
+        conn_reserve_job(c, j);
+        buf += sprintf(buf, "%"PRIu64" %d\r\n", j->r.id, j->r.body_size - 2);
+        memcpy(buf, j->body, j->r.body_size);
+        buf += j->r.body_size;
+    }
+    buf[0] = '\r';
+    buf[1] = '\n';
+
+    c->out_job_sent = 0;
+    reply_line(c, STATE_SEND_JOB, MSG_RESERVED_BATCH_FMT, n, z);
+}
+
 // process_queue performs reservation for every jobs that is awaited for.
 static void
 process_queue()
@@ -459,23 +810,22 @@ process_queue()
     int64 now = nanoseconds();
 
     while ((j = next_awaited_job(now))) {
-        heapremove(&j->tube->ready, j->heap_index);
-        ready_ct--;
-        if (j->r.pri < URGENT_THRESHOLD) {
-            global_stat.urgent_ct--;
-            j->tube->stat.urgent_ct--;
-        }
+        remove_ready_job(j);
 
         Conn *c = ms_take(&j->tube->waiting_conns);
         if (c == NULL) {
             twarnx("waiting_conns is empty");
             continue;
         }
-        global_stat.reserved_ct++;
 
         remove_waiting_conn(c);
+        if (c->resvmax) {
+            reserve_batch(c, j, now);
+            continue;
+        }
+        global_stat.reserved_ct++;
         conn_reserve_job(c, j);
-        reply_job(c, j, MSG_RESERVED);
+        reply_job(c, j, ST_RESERVED);
     }
 }
 
@@ -499,6 +849,70 @@ soonest_delayed_job()
     return j;
 }
 
+// soonest_expiring_job returns the ready or delayed job
+// with the smallest expires_at among all tubes.
+static Job *
+soonest_expiring_job()
+{
+    Job *j = NULL;
+    size_t i;
+
+    for (i = 0; i < tubes.len; i++) {
+        Tube *t = tubes.items[i];
+        if (t->expiring.len == 0) {
+            continue;
+        }
+        Job *nj = t->expiring.data[0];
+        if (!j || nj->expires_at < j->expires_at)
+            j = nj;
+    }
+    return j;
+}
+
+// ready_insert puts ready job j in its tube's ready heap, unless its
+// message group holds it back; see group.c.
+// Returns 1 on success, or 0 if the heap could not grow.
+static int
+ready_insert(Job *j)
+{
+    if (j->group) {
+        return group_ready(j);
+    }
+    return heapinsert(&j->tube->ready, j);
+}
+
+// expire_track puts job j, which has just become ready or delayed,
+// in its tube's heap of expiring jobs, if it has a time to live.
+// Without memory for it, j does not expire until it moves again.
+static void
+expire_track(Job *j)
+{
+    if (j->expires_at && !j->expiring) {
+        j->expiring = heapinsert(&j->tube->expiring, j);
+    }
+}
+
+// expire_untrack takes job j out of its tube's heap of expiring jobs,
+// once it is no longer ready or delayed.
+static void
+expire_untrack(Job *j)
+{
+    if (j->expiring) {
+        heapremove(&j->tube->expiring, j->expire_index);
+        j->expiring = 0;
+    }
+}
+
+// settle_group lets the next job of message group g, if any, be
+// reserved once no other job of g is reserved or ready for that.
+static void
+settle_group(Group *g)
+{
+    if (g && group_settle(g)) {
+        process_queue();
+    }
+}
+
 // enqueue_job inserts job j in the tube, returns 1 on success, otherwise 0.
 // If update_store then it writes an entry to WAL.
 // On success it processes the queue.
@@ -516,7 +930,7 @@ enqueue_job(Server *s, Job *j, int64 delay, char update_store)
             return 0;
         j->r.state = Delayed;
     } else {
-        r = heapinsert(&j->tube->ready, j);
+        r = ready_insert(j);
         if (!r)
             return 0;
         j->r.state = Ready;
@@ -526,12 +940,12 @@ enqueue_job(Server *s, Job *j, int64 delay, char update_store)
             j->tube->stat.urgent_ct++;
         }
     }
+    expire_track(j);
 
     if (update_store) {
-        if (!walwrite(&s->wal, j)) {
+        if (!walwrite(srvwal(s, j), j)) {
             return 0;
         }
-        walmaint(&s->wal);
     }
 
     // The call below makes this function do too much.
@@ -544,12 +958,13 @@ static int
 bury_job(Server *s, Job *j, char update_store)
 {
     if (update_store) {
-        int z = walresvupdate(&s->wal);
+        int z = walresvupdate(srvwal(s, j));
         if (!z)
             return 0;
         j->walresv += z;
     }
 
+    expire_untrack(j);
     job_list_insert(&j->tube->buried, j);
     global_stat.buried_ct++;
     j->tube->stat.buried_ct++;
@@ -558,23 +973,44 @@ bury_job(Server *s, Job *j, char update_store)
     j->r.bury_ct++;
 
     if (update_store) {
-        if (!walwrite(&s->wal, j)) {
+        if (!walwrite(srvwal(s, j), j)) {
             return 0;
         }
-        walmaint(&s->wal);
     }
 
     return 1;
 }
 
+// expire_job deletes ready or delayed job j, whose time to live
+// is up. The delete records of the jobs expired in one tick go to
+// the binlog together, at the end of the loop iteration.
+static void
+expire_job(Server *s, Job *j)
+{
+    if (!remove_ready_job(j))
+        remove_delayed_job(j);
+    j->tube->stat.expired_ct++;
+    j->r.state = Invalid;
+    if (!walwrite(srvwal(s, j), j)) {
+        twarnx("failed to write the deletion of expired job %"PRIu64, j->r.id);
+    }
+    settle_group(j->group);
+    job_free(j);
+}
+
 void
 enqueue_reserved_jobs(Conn *c)
 {
     while (!job_list_is_empty(&c->reserved_jobs)) {
         Job *j = job_list_remove(c->reserved_jobs.next);
+        if (j->group) {
+            j->group->active--;
+        }
         int r = enqueue_job(c->srv, j, 0, 0);
         if (r < 1)
             bury_job(c->srv, j, 0);
+        settle_group(j->group);
+        c->reserved_ct--;
         global_stat.reserved_ct--;
         j->tube->stat.reserved_ct--;
         c->soonest_job = NULL;
@@ -587,7 +1023,7 @@ kick_buried_job(Server *s, Job *j)
     int r;
     int z;
 
-    z = walresvupdate(&s->wal);
+    z = walresvupdate(srvwal(s, j));
     if (!z)
         return 0;
     j->walresv += z;
@@ -623,7 +1059,7 @@ kick_delayed_job(Server *s, Job *j)
     int r;
     int z;
 
-    z = walresvupdate(&s->wal);
+    z = walresvupdate(srvwal(s, j));
     if (!z)
         return 0;
     j->walresv += z;
@@ -705,18 +1141,26 @@ remove_delayed_job(Job *j)
     if (!j || j->r.state != Delayed)
         return NULL;
     heapremove(&j->tube->delay, j->heap_index);
+    expire_untrack(j);
 
     return j;
 }
 
 // remove_ready_job returns non-NULL value if job j was in the ready state.
 // It removes the job from the tube ready heap and updates counters.
+// If j is in a message group, the caller must reserve it, or call
+// settle_group once it is done with it.
 static Job *
 remove_ready_job(Job *j)
 {
     if (!j || j->r.state != Ready)
         return NULL;
-    heapremove(&j->tube->ready, j->heap_index);
+    if (j->group) {
+        group_unready(j);
+    } else {
+        heapremove(&j->tube->ready, j->heap_index);
+    }
+    expire_untrack(j);
     ready_ct--;
     if (j->r.pri < URGENT_THRESHOLD) {
         global_stat.urgent_ct--;
@@ -774,36 +1218,101 @@ scan_line_end(const char *s, int size)
     return 0;
 }
 
-/* parse the command line */
-static int
-which_cmd(Conn *c)
-{
-#define TEST_CMD(s,c,o) if (strncmp((s), (c), CONSTSTRLEN(c)) == 0) return (o);
-    TEST_CMD(c->cmd, CMD_PUT, OP_PUT);
-    TEST_CMD(c->cmd, CMD_PEEKJOB, OP_PEEKJOB);
-    TEST_CMD(c->cmd, CMD_PEEK_READY, OP_PEEK_READY);
-    TEST_CMD(c->cmd, CMD_PEEK_DELAYED, OP_PEEK_DELAYED);
-    TEST_CMD(c->cmd, CMD_PEEK_BURIED, OP_PEEK_BURIED);
-    TEST_CMD(c->cmd, CMD_RESERVE_TIMEOUT, OP_RESERVE_TIMEOUT);
-    TEST_CMD(c->cmd, CMD_RESERVE_JOB, OP_RESERVE_JOB);
-    TEST_CMD(c->cmd, CMD_RESERVE, OP_RESERVE);
-    TEST_CMD(c->cmd, CMD_DELETE, OP_DELETE);
-    TEST_CMD(c->cmd, CMD_RELEASE, OP_RELEASE);
-    TEST_CMD(c->cmd, CMD_BURY, OP_BURY);
-    TEST_CMD(c->cmd, CMD_KICK, OP_KICK);
-    TEST_CMD(c->cmd, CMD_KICKJOB, OP_KICKJOB);
-    TEST_CMD(c->cmd, CMD_TOUCH, OP_TOUCH);
-    TEST_CMD(c->cmd, CMD_STATSJOB, OP_STATSJOB);
-    TEST_CMD(c->cmd, CMD_STATS_TUBE, OP_STATS_TUBE);
-    TEST_CMD(c->cmd, CMD_STATS, OP_STATS);
-    TEST_CMD(c->cmd, CMD_USE, OP_USE);
-    TEST_CMD(c->cmd, CMD_WATCH, OP_WATCH);
-    TEST_CMD(c->cmd, CMD_IGNORE, OP_IGNORE);
-    TEST_CMD(c->cmd, CMD_LIST_TUBES_WATCHED, OP_LIST_TUBES_WATCHED);
-    TEST_CMD(c->cmd, CMD_LIST_TUBE_USED, OP_LIST_TUBE_USED);
-    TEST_CMD(c->cmd, CMD_LIST_TUBES, OP_LIST_TUBES);
-    TEST_CMD(c->cmd, CMD_QUIT, OP_QUIT);
-    TEST_CMD(c->cmd, CMD_PAUSE_TUBE, OP_PAUSE_TUBE);
+// scan_cmd returns the size of the complete command at the start of
+// c->cmd, or 0 if there is none yet. The first byte a client sends
+// picks its protocol: BIN_MAGIC for binary, otherwise text.
+static size_t
+scan_cmd(Conn *c)
+{
+    uint32 n;
+
+    if (!c->proto && c->cmd_read) {
+        c->proto = 't';
+        if ((byte)c->cmd[0] == BIN_MAGIC) {
+            c->proto = 'b';
+            memmove(c->cmd, c->cmd + 1, --c->cmd_read);
+        }
+    }
+    if (!conn_bin(c)) {
+        return scan_line_end(c->cmd, c->cmd_read);
+    }
+
+    if (c->cmd_read < BIN_REQ_SIZE)
+        return 0;
+    n = get32(c->cmd + 8);
+    if (c->cmd[0] == OP_PUT && n > BIN_PUT_SIZE) {
+        n = BIN_PUT_SIZE; // the body is read like a text put's
+    }
+    if (n > LINE_BUF_SIZE - BIN_REQ_SIZE) {
+        n = 0; // dispatch_bin throws it away
+    }
+    if (c->cmd_read < BIN_REQ_SIZE + n)
+        return 0;
+    return BIN_REQ_SIZE + n;
+}
+
+// cmdtab is a hash table of the command words in op_names, set up
+// by prot_init. A slot holds an op, or 0 if it is empty. It is big
+// enough that every word has a slot of its own with the current
+// hash; probing keeps it correct when new words collide.
+static byte cmdtab[256];
+
+// cmdlen[op] is the length of the command word in op_names[op].
+// A word that takes arguments is stored there with a trailing space.
+static byte cmdlen[TOTAL_OPS];
+
+// cmdhash hashes the word at the start of s, which ends at a space
+// or NUL, and stores its length in *n.
+static uint
+cmdhash(const char *s, size_t *n)
+{
+    uint32 h = 2166136261u; // FNV-1a
+    size_t i;
+
+    for (i = 0; s[i] && s[i] != ' '; i++) {
+        h = (h ^ (byte)s[i]) * 16777619;
+    }
+    *n = i;
+    return h;
+}
+
+static void
+cmdtab_init(void)
+{
+    int op;
+    uint i;
+    size_t n;
+
+    memset(cmdtab, 0, sizeof cmdtab);
+    for (op = 1; op < TOTAL_OPS; op++) {
+        i = cmdhash(op_names[op], &n);
+        cmdlen[op] = n;
+        while (cmdtab[i % sizeof cmdtab]) {
+            i++;
+        }
+        cmdtab[i % sizeof cmdtab] = op;
+    }
+}
+
+// Prot_which returns the op of the command on the NUL-terminated
+// line, or OP_UNKNOWN. A command that takes arguments must be
+// followed by a space.
+int
+prot_which(const char *line)
+{
+    size_t n;
+    uint i = cmdhash(line, &n);
+    int op;
+
+    while ((op = cmdtab[i % sizeof cmdtab])) {
+        const char *w = op_names[op];
+        if (cmdlen[op] == n && memcmp(w, line, n) == 0) {
+            if (w[n] == ' ' && line[n] != ' ')
+                return OP_UNKNOWN;
+            return op;
+        }
+        i++;
+    }
     return OP_UNKNOWN;
 }
 
@@ -824,7 +1333,7 @@ fill_extra_data(Conn *c)
     int64 job_data_bytes = 0;
     /* how many bytes should we put into the job body? */
     if (c->in_job) {
-        job_data_bytes = min(extra_bytes, c->in_job->r.body_size);
+        job_data_bytes = min(extra_bytes, c->in_job->r.body_size - 2 + trailer(c));
         memcpy(c->in_job->body, c->cmd + c->cmd_len, job_data_bytes);
         c->in_job_read = job_data_bytes;
     } else if (c->in_job_read) {
@@ -840,25 +1349,75 @@ fill_extra_data(Conn *c)
     c->cmd_len = 0; /* we no longer know the length of the new command */
 }
 
-#define skip(conn,n,msg) (_skip(conn, n, msg, CONSTSTRLEN(msg)))
+static void enqueue_batch(Conn *c);
+static void enqueue_multi(Conn *c, Job *j);
+static void ack_many(Conn *c, Job *l);
+
+// batch_next is called when a job of a put-batch command has been
+// read, or skipped. It waits for the next job, if there is one,
+// or inserts the whole batch.
+static void
+batch_next(Conn *c)
+{
+    if (--c->batchleft > 0) {
+        // Not conn_want_command: c is already reading and
+        // the next job may be in c->cmd.
+        c->state = STATE_WANT_COMMAND;
+        return;
+    }
+    enqueue_batch(c);
+}
+
+// batch_fail records msg as the reply to a put-batch command,
+// unless an earlier job failed already, and moves on to the next job.
+static void
+batch_fail(Conn *c, char *msg)
+{
+    if (!c->batcherr) {
+        c->batcherr = msg;
+    }
+    batch_next(c);
+}
+
+// batch_abort drops the put-batch command c is reading, if any.
+static void
+batch_abort(Conn *c)
+{
+    while (!job_list_is_empty(&c->batch)) {
+        job_free(job_list_remove(c->batch.next));
+    }
+    c->batchleft = 0;
+    c->batcherr = NULL;
+}
 
+// skip throws away the next n bytes from c and then replies with
+// status st, which must have a line in st_msgs.
 static void
-_skip(Conn *c, int64 n, char *msg, int msglen)
+skip(Conn *c, int64 n, int st)
 {
     /* Invert the meaning of in_job_read while throwing away data -- it
      * counts the bytes that remain to be thrown away. */
     c->in_job = 0;
     c->in_job_read = n;
+    ms_clear(&c->fanout);
     fill_extra_data(c);
 
     if (c->in_job_read == 0) {
-        reply(c, msg, msglen, STATE_SEND_WORD);
+        if (c->batchleft) {
+            batch_fail(c, st_msgs[st]);
+            return;
+        }
+        reply_st(c, st);
         return;
     }
 
-    c->reply = msg;
-    c->reply_len = msglen;
-    c->reply_sent = 0;
+    if (conn_bin(c)) {
+        fill_bin(c, st, 0, 0);
+    } else {
+        c->reply = st_msgs[st];
+        c->reply_len = strlen(st_msgs[st]);
+        c->reply_sent = 0;
+    }
     c->state = STATE_BITBUCKET;
 }
 
@@ -866,35 +1425,70 @@ static void
 enqueue_incoming_job(Conn *c)
 {
     int r;
+    uint64 id;
     Job *j = c->in_job;
 
     c->in_job = NULL; /* the connection no longer owns this job */
     c->in_job_read = 0;
 
+    if (c->manyop) {
+        ack_many(c, j);
+        return;
+    }
+
     /* check if the trailer is present and correct */
-    if (memcmp(j->body + j->r.body_size - 2, "\r\n", 2)) {
+    if (!conn_bin(c) && memcmp(j->body + j->r.body_size - 2, "\r\n", 2)) {
         job_free(j);
+        ms_clear(&c->fanout);
+        if (c->batchleft) {
+            batch_fail(c, MSG_EXPECTED_CRLF);
+            return;
+        }
         reply_msg(c, MSG_EXPECTED_CRLF);
         return;
     }
 
+    if (c->batchleft) {
+        job_list_insert(&c->batch, j);
+        batch_next(c);
+        return;
+    }
+
+    if (c->fanout.len) {
+        enqueue_multi(c, j);
+        return;
+    }
+
     if (verbose >= 2) {
         printf("<%d job %"PRIu64"\n", c->sock.fd, j->r.id);
     }
 
     if (drain_mode) {
         job_free(j);
-        reply_serr(c, MSG_DRAINING);
+        twarnx("server error: " MSG_DRAINING);
+        reply_st(c, ST_DRAINING);
+        return;
+    }
+
+    // A put with the key of a recent one gets that one's job.
+    if (j->dedup && dedup_find(j->dedup, &id, nanoseconds())) {
+        job_free(j);
+        reply_nums(c, STATE_SEND_WORD, ST_INSERTED, id, -1);
+        dedup_walwait(c, job_find(id));
         return;
     }
 
     if (j->walresv) {
-        reply_serr(c, MSG_INTERNAL_ERROR);
+        twarnx("server error: " MSG_INTERNAL_ERROR);
+        reply_st(c, ST_INTERNAL_ERROR);
         return;
     }
-    j->walresv = walresvput(&c->srv->wal, j);
+    j->dur = j->tube->durability;
+    j->nowal = j->dur == Durnone;
+    j->walresv = walresvput(srvwal(c->srv, j), j);
     if (!j->walresv) {
-        reply_serr(c, MSG_OUT_OF_MEMORY);
+        twarnx("server error: " MSG_OUT_OF_MEMORY);
+        reply_st(c, ST_OUT_OF_MEMORY);
         return;
     }
 
@@ -903,49 +1497,202 @@ enqueue_incoming_job(Conn *c)
 
     // Dead code: condition cannot happen, r can take 1 or 0 values only.
     if (r < 0) {
-        reply_serr(c, MSG_INTERNAL_ERROR);
+        twarnx("server error: " MSG_INTERNAL_ERROR);
+        reply_st(c, ST_INTERNAL_ERROR);
         return;
     }
 
     global_stat.total_jobs_ct++;
     j->tube->stat.total_jobs_ct++;
+    if (j->dedup) {
+        dedup_add(j->dedup, j->r.id, j->r.created_at, nanoseconds());
+    }
 
     if (r == 1) {
-        reply_line(c, STATE_SEND_WORD, MSG_INSERTED_FMT, j->r.id);
+        reply_nums(c, STATE_SEND_WORD, ST_INSERTED, j->r.id, -1);
         return;
     }
 
     /* out of memory trying to grow the queue, so it gets buried */
     bury_job(c->srv, j, 0);
-    reply_line(c, STATE_SEND_WORD, MSG_BURIED_FMT, j->r.id);
+    reply_nums(c, STATE_SEND_WORD, ST_BURIED, j->r.id, -1);
 }
 
-static uint
-uptime()
+// resv_batch reserves binlog space for the first jobs in the list
+// batch, with one reservation in each binlog stream, and returns the
+// number of jobs it reserved space for. It takes all of them unless
+// they would fill more than half a binlog file in some stream. Returns
+// 0 if the binlog is out of space; nothing is reserved then.
+static int
+resv_batch(Server *s, Job *batch)
 {
-    return (nanoseconds() - started_at) / 1000000000;
+    int size[Walstreams] = {0};
+    uint64 id = job_peek_id();
+    int n = 0, k, z;
+    Wal *w;
+    Job *j;
+
+    for (j = batch->next; j != batch; j = j->next) {
+        j->dur = j->tube->durability;
+        j->nowal = j->dur == Durnone;
+        j->r.id = id + n; // what job_store will give it, for srvwal
+        w = srvwal(s, j);
+        j->walresv = 1; // as walresvput does if w is not in use
+        for (k = 0; k < s->nwal && s->wals[k] != w; k++);
+        if (k < s->nwal && w->use) {
+            z = walputmax(j);
+            if (n && size[k] + z > w->filesize / 2)
+                break;
+            size[k] += z;
+            j->walresv = z;
+        }
+        n++;
+    }
+
+    for (k = 0; k < s->nwal; k++) {
+        if (size[k] && !walresvputs(s->wals[k], size[k])) {
+            while (k--) {
+                if (size[k])
+                    walunresv(s->wals[k], size[k]);
+            }
+            return 0;
+        }
+    }
+    return n;
 }
 
-static int
-fmt_stats(char *buf, size_t size, void *x)
+// enqueue_batch inserts the jobs of a put-batch command once all of
+// them have been read, so that they get consecutive ids. Binlog space
+// is reserved for all of them at once (see resv_batch) before any is
+// inserted, so their records go to the wal writer together, and the
+// reply waits for all of them at once. A batch too big for that is
+// reserved and inserted a part at a time; if the binlog runs out of
+// space, only the parts before are inserted. Jobs get ids only once
+// they are inserted.
+static void
+enqueue_batch(Conn *c)
 {
-    int whead = 0, wcur = 0;
-    Server *s = x;
-    struct rusage ru;
+    Job *j;
+    uint64 first = 0;
+    int n = 0, m, r;
+    char *err = c->batcherr;
 
-    s = x;
+    c->batcherr = NULL;
+    if (!err && drain_mode) {
+        err = MSG_DRAINING;
+    }
+    while (!err && !job_list_is_empty(&c->batch)) {
+        m = resv_batch(c->srv, &c->batch);
+        if (!m)
+            break;
+        for (; m; m--) {
+            j = job_list_remove(c->batch.next);
+            job_store(j);
+            if (!n)
+                first = j->r.id;
+            n++;
+
+            r = enqueue_job(c->srv, j, j->r.delay, 1);
+            if (r < 1) {
+                /* out of memory trying to grow the queue, so it gets buried */
+                bury_job(c->srv, j, 0);
+            }
+            global_stat.total_jobs_ct++;
+            j->tube->stat.total_jobs_ct++;
+        }
+    }
+    if (!err && !n) {
+        err = MSG_OUT_OF_MEMORY;
+    }
 
-    if (s->wal.head) {
-        whead = s->wal.head->seq;
+    while (!job_list_is_empty(&c->batch)) {
+        j = job_list_remove(c->batch.next);
+        j->r.id = 0; // never stored
+        job_free(j);
     }
 
-    if (s->wal.cur) {
-        wcur = s->wal.cur->seq;
+    if (err) {
+        reply(c, err, strlen(err), STATE_SEND_WORD);
+        return;
     }
+    reply_line(c, STATE_SEND_WORD, MSG_INSERTED_BATCH_FMT, first, n);
+}
 
-    getrusage(RUSAGE_SELF, &ru); /* don't care if it fails */
-    return snprintf(buf, size, STATS_FMT,
-                    global_stat.urgent_ct,
+// enqueue_multi inserts the jobs of a put-multi command: j, which
+// has the body, goes into the first tube of c->fanout, and a job that
+// shares its body goes into each of the others. They are inserted as
+// a put-batch would insert them, so they get consecutive ids.
+static void
+enqueue_multi(Conn *c, Job *j)
+{
+    Job *k;
+    size_t i;
+
+    job_list_insert(&c->batch, j);
+    for (i = 1; i < c->fanout.len; i++) {
+        k = job_new_shared(j, c->fanout.items[i]);
+        if (!k) {
+            c->batcherr = MSG_OUT_OF_MEMORY;
+            break;
+        }
+        job_list_insert(&c->batch, k);
+    }
+    ms_clear(&c->fanout);
+    enqueue_batch(c);
+}
+
+static uint
+uptime()
+{
+    return (nanoseconds() - started_at) / 1000000000;
+}
+
+static int
+fmt_stats(char *buf, size_t size, void *x)
+{
+    int whead = 0, wcur = 0, wunlink = 0, i;
+    int64 wlive = 0, wlag = 0, wsize = 0, wbehind = 0;
+    int64 nmig = 0, nrec = 0, nmigbytes = 0, nsnap = 0;
+    double wamp = 0;
+    Server *s = x;
+    Wal *w;
+    struct rusage ru;
+
+    s = x;
+
+    // Sum up the binlog streams. Indexes are per stream; report
+    // the oldest and the newest of them.
+    for (i = 0; i < s->nwal; i++) {
+        w = s->wals[i];
+        if (w->head && (!whead || w->head->seq < whead)) {
+            whead = w->head->seq;
+        }
+        if (w->cur) {
+            wcur = w->cur->seq > wcur ? w->cur->seq : wcur;
+            wunlink += walhkunlinks(w);
+        }
+        if (w->cbehind && (!wbehind || w->cbehind < wbehind)) {
+            wbehind = w->cbehind;
+        }
+        wlive += w->alive + w->resv;
+        wsize += (int64)w->nfile * w->filesize;
+        nmig += w->nmig;
+        nrec += w->nrec;
+        nmigbytes += w->nmigbytes;
+        nsnap += w->nsnap;
+    }
+
+    if (wlive) {
+        wamp = (double)wsize / wlive;
+    }
+
+    if (wbehind) {
+        wlag = nanoseconds() - wbehind;
+    }
+
+    getrusage(RUSAGE_SELF, &ru); /* don't care if it fails */
+    return snprintf(buf, size, STATS_FMT,
+                    global_stat.urgent_ct,
                     ready_ct,
                     global_stat.reserved_ct,
                     get_delayed_job_ct(),
@@ -988,9 +1735,15 @@ fmt_stats(char *buf, size_t size, void *x)
                     uptime(),
                     whead,
                     wcur,
-                    s->wal.nmig,
-                    s->wal.nrec,
+                    nmig,
+                    nrec,
+                    nmigbytes,
+                    wamp,
+                    wlag / 1000000000, wlag / 1000000 % 1000,
                     s->wal.filesize,
+                    wunlink,
+                    nsnap,
+                    s->nwal,
                     drain_mode ? "true" : "false",
                     instance_hex,
                     node_info.nodename,
@@ -1011,26 +1764,19 @@ fmt_stats(char *buf, size_t size, void *x)
 static int
 read_u64(uint64 *num, const char *buf, char **end)
 {
-    uintmax_t tnum;
-    char *tend;
+    uint64 tnum;
+    int n;
 
-    errno = 0;
     while (buf[0] == ' ')
         buf++;
-    if (buf[0] < '0' || '9' < buf[0])
+    n = scanu64(&tnum, buf);
+    if (!n)
         return -1;
-    tnum = strtoumax(buf, &tend, 10);
-    if (tend == buf)
-        return -1;
-    if (errno)
-        return -1;
-    if (!end && tend[0] != '\0')
-        return -1;
-    if (tnum > UINT64_MAX)
+    if (!end && buf[n] != '\0')
         return -1;
 
-    if (num) *num = (uint64)tnum;
-    if (end) *end = tend;
+    if (num) *num = tnum;
+    if (end) *end = (char *)buf + n;
     return 0;
 }
 
@@ -1038,18 +1784,10 @@ read_u64(uint64 *num, const char *buf, char **end)
 static int
 read_u32(uint32 *num, const char *buf, char **end)
 {
-    uintmax_t tnum;
+    uint64 tnum;
     char *tend;
 
-    errno = 0;
-    while (buf[0] == ' ')
-        buf++;
-    if (buf[0] < '0' || '9' < buf[0])
-        return -1;
-    tnum = strtoumax(buf, &tend, 10);
-    if (tend == buf)
-        return -1;
-    if (errno)
+    if (read_u64(&tnum, buf, &tend))
         return -1;
     if (!end && tend[0] != '\0')
         return -1;
@@ -1061,19 +1799,55 @@ read_u32(uint32 *num, const char *buf, char **end)
     return 0;
 }
 
-/* Read a delay value in seconds from the given buffer and
-   place it in duration in nanoseconds.
+/* Read a delay value in seconds, or in milliseconds if it ends in "ms",
+   from the given buffer and place it in duration in nanoseconds.
    The interface and behavior are analogous to read_u32(). */
 static int
 read_duration(int64 *duration, const char *buf, char **end)
 {
-    int r;
-    uint32 dur_sec;
+    uint32 n;
+    char *tend;
+    int64 unit = 1000000000;
 
-    r = read_u32(&dur_sec, buf, end);
-    if (r)
-        return r;
-    *duration = ((int64) dur_sec) * 1000000000;
+    if (read_u32(&n, buf, &tend))
+        return -1;
+    if (tend[0] == 'm' && tend[1] == 's') {
+        unit = 1000000;
+        tend += 2;
+    }
+    if (!end && tend[0] != '\0')
+        return -1;
+
+    *duration = n * unit;
+    if (end) *end = tend;
+    return 0;
+}
+
+// read_timeout reads the timeout of a reserve command, in seconds, or
+// in milliseconds if it ends in "ms", and places it in timeout in
+// nanoseconds. A negative number means to wait for ever and is stored
+// as -1. As with strtol, leading spaces and a sign are allowed, no
+// number at all means 0, as it always has for reserve-with-timeout,
+// and *end is set just past the number.
+// Returns 0 on success, or -1 if the number is out of range.
+static int
+read_timeout(int64 *timeout, const char *buf, char **end)
+{
+    long n;
+    char *tend;
+    int64 unit = 1000000000;
+
+    errno = 0;
+    n = strtol(buf, &tend, 10);
+    if (errno)
+        return -1;
+    if (tend[0] == 'm' && tend[1] == 's') {
+        unit = 1000000;
+        tend += 2;
+    }
+
+    *timeout = n < 0 ? -1 : (n < INT32_MAX ? n : INT32_MAX) * unit;
+    *end = tend;
     return 0;
 }
 
@@ -1096,7 +1870,7 @@ read_tube_name(char **tubename, char *buf, char **end)
 }
 
 static void
-wait_for_job(Conn *c, int timeout)
+wait_for_job(Conn *c, int64 timeout)
 {
     c->state = STATE_WAIT;
     enqueue_waiting_conn(c);
@@ -1108,6 +1882,42 @@ wait_for_job(Conn *c, int timeout)
     epollq_add(c, 'h');
 }
 
+// wait_for_push makes a subscribed conn wait for a job again,
+// once it is done with its last command, if it holds fewer reserved
+// jobs than it has credits. The job goes out as if it was reserved.
+// Unlike wait_for_job, this keeps c reading commands meanwhile;
+// dispatch_cmd takes c off the waiting lists before each command.
+static void
+wait_for_push(Conn *c)
+{
+    if (!c->credits || conn_waiting(c) || c->batchleft ||
+        c->state != STATE_WANT_COMMAND || c->reserved_ct >= c->credits) {
+        return;
+    }
+    enqueue_waiting_conn(c);
+    process_queue();
+}
+
+// do_reserve runs a reserve command of the given type. The reply
+// has up to max jobs if it is nonzero; see reserve_batch.
+static void
+do_reserve(Conn *c, int type, int64 timeout, int max)
+{
+    op_ct[type]++;
+    connsetworker(c);
+
+    if (conndeadlinesoon(c) && !conn_ready(c)) {
+        ms_clear(&c->from);
+        reply_st(c, ST_DEADLINE_SOON);
+        return;
+    }
+
+    /* try to get a new job for this guy */
+    c->resvmax = max;
+    wait_for_job(c, timeout);
+    process_queue();
+}
+
 typedef int(*fmt_fn)(char *, size_t, void *);
 
 static void
@@ -1118,19 +1928,15 @@ do_stats(Conn *c, fmt_fn fmt, void *data)
     /* first, measure how big a buffer we will need */
     stats_len = fmt(NULL, 0, data) + 16;
 
-    c->out_job = allocate_job(stats_len); /* fake job to hold stats data */
-    if (!c->out_job) {
+    c->out_data = malloc(stats_len);
+    if (!c->out_data) {
         reply_serr(c, MSG_OUT_OF_MEMORY);
         return;
     }
 
-    /* Mark this job as a copy so it can be appropriately freed later on */
-    c->out_job->r.state = Copy;
-
     /* now actually format the stats data */
-    r = fmt(c->out_job->body, stats_len, data);
-    /* and set the actual body size */
-    c->out_job->r.body_size = r;
+    r = fmt(c->out_data, stats_len, data);
+    c->out_len = r;
     if (r > stats_len) {
         reply_serr(c, MSG_INTERNAL_ERROR);
         return;
@@ -1154,17 +1960,15 @@ do_list_tubes(Conn *c, Ms *l)
         resp_z += 3 + strlen(t->name); /* including "- " and "\n" */
     }
 
-    c->out_job = allocate_job(resp_z); /* fake job to hold response data */
-    if (!c->out_job) {
+    c->out_data = malloc(resp_z);
+    if (!c->out_data) {
         reply_serr(c, MSG_OUT_OF_MEMORY);
         return;
     }
-
-    /* Mark this job as a copy so it can be appropriately freed later on */
-    c->out_job->r.state = Copy;
+    c->out_len = resp_z;
 
     /* now actually format the response */
-    buf = c->out_job->body;
+    buf = c->out_data;
     buf += snprintf(buf, 5, "---\n");
     for (i = 0; i < l->len; i++) {
         t = l->items[i];
@@ -1186,7 +1990,7 @@ fmt_job_stats(char *buf, size_t size, Job *j)
 
     t = nanoseconds();
     if (j->r.state == Reserved || j->r.state == Delayed) {
-        time_left = (j->r.deadline_at - t) / 1000000000;
+        time_left = j->r.deadline_at - t;
     } else {
         time_left = 0;
     }
@@ -1201,13 +2005,18 @@ fmt_job_stats(char *buf, size_t size, Job *j)
             (t - j->r.created_at) / 1000000000,
             j->r.delay / 1000000000,
             j->r.ttr / 1000000000,
-            time_left,
+            time_left / 1000000000,
             file,
             j->r.reserve_ct,
             j->r.timeout_ct,
             j->r.release_ct,
             j->r.bury_ct,
-            j->r.kick_ct);
+            j->r.kick_ct,
+            durnames[j->dur],
+            (t - j->r.created_at) / 1000000,
+            j->r.delay / 1000000,
+            j->r.ttr / 1000000,
+            time_left / 1000000);
 }
 
 static int
@@ -1223,18 +2032,21 @@ fmt_stats_tube(char *buf, size_t size, Tube *t)
     return snprintf(buf, size, STATS_TUBE_FMT,
             t->name,
             t->stat.urgent_ct,
-            t->ready.len,
+            t->ready.len + t->held_ct,
             t->stat.reserved_ct,
             t->delay.len,
             t->stat.buried_ct,
             t->stat.total_jobs_ct,
+            t->stat.expired_ct,
             t->using_ct,
             t->watching_ct,
             t->stat.waiting_ct,
             t->stat.total_delete_ct,
             t->stat.pause_ct,
             t->pause / 1000000000,
-            time_left);
+            time_left,
+            durnames[t->durability],
+            t->expire / 1000000);
 }
 
 static void
@@ -1243,7 +2055,7 @@ maybe_enqueue_incoming_job(Conn *c)
     Job *j = c->in_job;
 
     /* do we have a complete job? */
-    if (c->in_job_read == j->r.body_size) {
+    if (c->in_job_read == j->r.body_size - 2 + trailer(c)) {
         enqueue_incoming_job(c);
         return;
     }
@@ -1252,15 +2064,121 @@ maybe_enqueue_incoming_job(Conn *c)
     c->state = STATE_WANT_DATA;
 }
 
+static void put_body(Conn *c, Tube *t, Group *g, uint32 pri, int64 delay,
+                     int64 ttr, uint32 body_size, uint64 dedup);
+
+// put_job reads the arguments of a put command,
+// "<pri> <delay> <ttr> <bytes> [<key>]" at args, and starts reading the
+// body of a job for tube t. It does the same for each job of a put-batch command.
+// If g is not NULL, the job goes in message group g of tube t.
+// Returns 0, or -1 if args are malformed; the caller replies then.
+static int
+put_job(Conn *c, Tube *t, Group *g, char *args)
+{
+    uint32 pri, body_size;
+    int64 delay, ttr;
+    uint64 dedup = 0;
+    size_t n;
+    char *delay_buf, *ttr_buf, *size_buf, *end_buf;
+
+    if (read_u32(&pri, args, &delay_buf) ||
+        read_duration(&delay, delay_buf, &ttr_buf) ||
+        read_duration(&ttr, ttr_buf, &size_buf) ||
+        read_u32(&body_size, size_buf, &end_buf)) {
+        return -1;
+    }
+    // The safety margin takes the last second of the ttr, see
+    // conndeadlinesoon. A ttr of 0 is raised to that in put_body.
+    if (ttr > 0 && ttr < 1000000000) {
+        return -1;
+    }
+    if (!c->batchleft && !c->fanout.len) {
+        op_ct[OP_PUT]++;
+    }
+
+    if (body_size > job_data_size_limit) {
+        /* throw away the job body and respond with JOB_TOO_BIG */
+        skip(c, (int64)body_size + 2, ST_JOB_TOO_BIG);
+        return 0;
+    }
+
+    // A put, put-in or put-group may end with a dedup key.
+    if (end_buf[0] == ' ' && !c->batchleft && !c->fanout.len) {
+        end_buf++;
+        n = strlen(end_buf);
+        if (n < 1 || n > Dedupkeymax || strcspn(end_buf, " ") != n) {
+            return -1;
+        }
+        dedup = dedup_key(t, end_buf, n);
+    } else if (end_buf[0] != '\0') {
+        /* don't allow trailing garbage */
+        return -1;
+    }
+
+    put_body(c, t, g, pri, delay, ttr, body_size, dedup);
+    return 0;
+}
+
+// put_body starts reading the body of a put command into tube t
+// once its arguments are known. G is the job's message group, or NULL;
+// dedup is the put's dedup key, or 0.
+static void
+put_body(Conn *c, Tube *t, Group *g, uint32 pri, int64 delay, int64 ttr,
+         uint32 body_size, uint64 dedup)
+{
+    connsetproducer(c);
+
+    if (ttr < 1000000000) {
+        ttr = 1000000000;
+    }
+
+    // The jobs of a batch or put-multi get their ids in enqueue_batch.
+    if (c->batchleft || c->fanout.len) {
+        c->in_job = job_new(pri, delay, ttr, body_size + 2, t);
+    } else {
+        c->in_job = make_job(pri, delay, ttr, body_size + 2, t);
+    }
+
+    /* OOM? */
+    if (!c->in_job) {
+        /* throw away the job body and respond with OUT_OF_MEMORY */
+        twarnx("server error: " MSG_OUT_OF_MEMORY);
+        skip(c, body_size + trailer(c), ST_OUT_OF_MEMORY);
+        return;
+    }
+
+    c->in_job->dedup = dedup;
+    if (g) {
+        c->in_job->group = g;
+        group_iref(g);
+    }
+
+    // A binary client sends no trailer, but jobs keep one.
+    if (conn_bin(c)) {
+        memcpy(c->in_job->body + body_size, "\r\n", 2);
+    }
+
+    fill_extra_data(c);
+
+    /* it's possible we already have a complete job */
+    maybe_enqueue_incoming_job(c);
+}
+
 /* j can be NULL */
+// If j is in a message group, the caller must call settle_group
+// once it is done with it.
 static Job *
 remove_this_reserved_job(Conn *c, Job *j)
 {
     j = job_list_remove(j);
     if (j) {
+        c->reserved_ct--;
         global_stat.reserved_ct--;
         j->tube->stat.reserved_ct--;
         j->reserver = NULL;
+        if (j->group) {
+            j->group->active--;
+        }
     }
     c->soonest_job = NULL;
     return j;
@@ -1274,6 +2192,241 @@ remove_reserved_job(Conn *c, Job *j)
     return remove_this_reserved_job(c, j);
 }
 
+// delete_job deletes the job with the given id for c
+// and returns the status of the delete command.
+static int
+delete_job(Conn *c, uint64 id)
+{
+    Job *jf = job_find(id);
+    Job *j = remove_reserved_job(c, jf);
+    if (!j)
+        j = remove_ready_job(jf);
+    if (!j)
+        j = remove_buried_job(jf);
+    if (!j)
+        j = remove_delayed_job(jf);
+
+    if (!j)
+        return ST_NOT_FOUND;
+
+    j->tube->stat.total_delete_ct++;
+
+    j->r.state = Invalid;
+    int r = walwrite(srvwal(c->srv, j), j);
+    settle_group(j->group);
+    job_free(j);
+
+    if (!r) {
+        twarnx("server error: " MSG_INTERNAL_ERROR);
+        return ST_INTERNAL_ERROR;
+    }
+    return ST_DELETED;
+}
+
+// release_job releases the job with the given id reserved by c
+// and returns the status of the release command. It is ST_BURIED
+// if there was no memory to put the job back, so it got buried.
+static int
+release_job(Conn *c, uint64 id, uint32 pri, int64 delay)
+{
+    Job *j = remove_reserved_job(c, job_find(id));
+
+    if (!j)
+        return ST_NOT_FOUND;
+
+    /* We want to update the delay deadline on disk, so reserve space for
+     * that. */
+    if (delay) {
+        int z = walresvupdate(srvwal(c->srv, j));
+        if (!z) {
+            twarnx("server error: " MSG_OUT_OF_MEMORY);
+            return ST_OUT_OF_MEMORY;
+        }
+        j->walresv += z;
+    }
+
+    j->r.pri = pri;
+    j->r.delay = delay;
+    j->r.release_ct++;
+
+    int r = enqueue_job(c->srv, j, delay, !!delay);
+    if (r < 0) {
+        twarnx("server error: " MSG_INTERNAL_ERROR);
+        return ST_INTERNAL_ERROR;
+    }
+    if (r == 1) {
+        settle_group(j->group);
+        return ST_RELEASED;
+    }
+
+    /* out of memory trying to grow the queue, so it gets buried */
+    bury_job(c->srv, j, 0);
+    settle_group(j->group);
+    return ST_BURIED;
+}
+
+// bury_reserved_job buries the job with the given id reserved by c
+// and returns the status of the bury command.
+static int
+bury_reserved_job(Conn *c, uint64 id, uint32 pri)
+{
+    Job *j = remove_reserved_job(c, job_find(id));
+
+    if (!j)
+        return ST_NOT_FOUND;
+
+    j->r.pri = pri;
+    if (!bury_job(c->srv, j, 1)) {
+        twarnx("server error: " MSG_INTERNAL_ERROR);
+        return ST_INTERNAL_ERROR;
+    }
+    settle_group(j->group);
+    return ST_BURIED;
+}
+
+// read_ids reads the <bytes> argument at size_buf of a delete-many,
+// release-many or bury-many command and starts reading the id list.
+// The list goes into a job that is never stored, which keeps
+// pri and delay too.
+// Returns 0, or -1 if the argument is malformed; the caller replies then.
+static int
+read_ids(Conn *c, int op, uint32 pri, int64 delay, char *size_buf)
+{
+    uint32 z;
+
+    if (read_u32(&z, size_buf, NULL))
+        return -1;
+    op_ct[op]++;
+
+    if (z > job_data_size_limit) {
+        /* throw away the list and respond with JOB_TOO_BIG */
+        skip(c, (int64)z + 2, ST_JOB_TOO_BIG);
+        return 0;
+    }
+
+    c->in_job = allocate_job(z + 2);
+    if (!c->in_job) {
+        twarnx("server error: " MSG_OUT_OF_MEMORY);
+        skip(c, (int64)z + 2, ST_OUT_OF_MEMORY);
+        return 0;
+    }
+    c->in_job->r.pri = pri;
+    c->in_job->r.delay = delay;
+    c->manyop = op;
+
+    fill_extra_data(c);
+    maybe_enqueue_incoming_job(c);
+    return 0;
+}
+
+// next_ids reads the next item of an id list at *p, either an id
+// or a range "<first>-<last>", into lo and hi and moves *p past it.
+// Returns 1, 0 at the end of the list, or -1 if the item is malformed.
+static int
+next_ids(char **p, uint64 *lo, uint64 *hi)
+{
+    char *end;
+
+    while (**p == ' ')
+        (*p)++;
+    if (**p == '\0')
+        return 0;
+    if (read_u64(lo, *p, &end))
+        return -1;
+    *hi = *lo;
+    if (end[0] == '-' && (read_u64(hi, end + 1, &end) || *hi < *lo))
+        return -1;
+    if (end[0] != ' ' && end[0] != '\0')
+        return -1;
+    *p = end;
+    return 1;
+}
+
+// ack_many runs the delete-many, release-many or bury-many command
+// c->manyop with the id list in the copy job l. It checks the whole
+// list first, so a malformed list changes nothing. The reply holds
+// the number of jobs the command succeeded for, and the ids that
+// it failed for, in the order of the list.
+static void
+ack_many(Conn *c, Job *l)
+{
+    int op = c->manyop, n = 0, done = 0, r, st, ok;
+    uint64 lo, hi, id;
+    char *p, *m, *buf, *out;
+
+    c->manyop = 0;
+    if (memcmp(l->body + l->r.body_size - 2, "\r\n", 2)) {
+        job_free(l);
+        reply_msg(c, MSG_EXPECTED_CRLF);
+        return;
+    }
+    l->body[l->r.body_size - 2] = '\0';
+
+    p = l->body;
+    while ((r = next_ids(&p, &lo, &hi)) > 0) {
+        if (hi - lo >= (uint64)(BATCH_MAX - n)) {
+            r = -1;
+            break;
+        }
+        n += hi - lo + 1;
+    }
+    if (r < 0 || n == 0) {
+        job_free(l);
+        reply_msg(c, MSG_BAD_FORMAT);
+        return;
+    }
+
+    // Room for every id to fail, with a space after each.
+    out = malloc(n * 21 + 2);
+    if (!out) {
+        job_free(l);
+        reply_serr(c, MSG_OUT_OF_MEMORY);
+        return;
+    }
+
+    // A release that ends up burying the job counts as failed.
+    ok = ST_BURIED;
+    if (op == OP_DELETE_MANY) {
+        ok = ST_DELETED;
+    } else if (op == OP_RELEASE_MANY) {
+        ok = ST_RELEASED;
+    }
+    buf = out;
+    p = l->body;
+    while (next_ids(&p, &lo, &hi) > 0) {
+        for (id = lo; ; id++) {
+            if (op == OP_DELETE_MANY) {
+                st = delete_job(c, id);
+            } else if (op == OP_RELEASE_MANY) {
+                st = release_job(c, id, l->r.pri, l->r.delay);
+            } else {
+                st = bury_reserved_job(c, id, l->r.pri);
+            }
+            if (st == ok) {
+                done++;
+            } else {
+                buf += sprintf(buf, "%s%"PRIu64, buf == out ? "" : " ", id);
+            }
+            if (id == hi)
+                break;
+        }
+    }
+    job_free(l);
+    buf[0] = '\r';
+    buf[1] = '\n';
+
+    m = MSG_BURIED_MANY;
+    if (op == OP_DELETE_MANY) {
+        m = MSG_DELETED_MANY;
+    } else if (op == OP_RELEASE_MANY) {
+        m = MSG_RELEASED_MANY;
+    }
+    c->out_data = out;
+    c->out_len = buf - out + 2;
+    c->out_job_sent = 0;
+    reply_line(c, STATE_SEND_JOB, "%s %d %d\r\n", m, done, c->out_len - 2);
+}
+
 static bool
 is_valid_tube(const char *name, size_t max)
 {
@@ -1283,79 +2436,243 @@ is_valid_tube(const char *name, size_t max)
         name[0] != '-';
 }
 
+// read_tube_list reads the comma-separated tube names at the start
+// of buf into a, making the tubes that do not exist, and points *end
+// just past them. It returns 0 on success, -1 if a name is malformed,
+// or 1 if the server is out of memory; a is empty then.
+static int
+read_tube_list(Ms *a, char *buf, char **end)
+{
+    char *name = buf, *p, sep;
+    Tube *t = NULL;
+    int r;
+
+    for (;;) {
+        p = name + strspn(name, NAME_CHARS);
+        sep = *p;
+        *p = '\0';
+        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            *p = sep;
+            ms_clear(a);
+            return -1;
+        }
+        TUBE_ASSIGN(t, tube_find_or_make(name));
+        *p = sep;
+        r = t && (ms_contains(a, t) || ms_append(a, t));
+        TUBE_ASSIGN(t, NULL);
+        if (!r) {
+            ms_clear(a);
+            return 1;
+        }
+        if (sep != ',') {
+            *end = p;
+            return 0;
+        }
+        name = p + 1;
+    }
+}
+
+// use_tube makes c use the tube named name.
+// Returns ST_USING, or ST_OUT_OF_MEMORY.
+static int
+use_tube(Conn *c, const char *name)
+{
+    Tube *t = NULL;
+
+    TUBE_ASSIGN(t, tube_find_or_make(name));
+    if (!t)
+        return ST_OUT_OF_MEMORY;
+
+    c->use->using_ct--;
+    TUBE_ASSIGN(c->use, t);
+    TUBE_ASSIGN(t, NULL);
+    c->use->using_ct++;
+    return ST_USING;
+}
+
+// watch_tube adds the tube named name to the tubes c watches.
+// Returns ST_WATCHING, or ST_OUT_OF_MEMORY.
+static int
+watch_tube(Conn *c, const char *name)
+{
+    Tube *t = NULL;
+    int r = 1;
+
+    TUBE_ASSIGN(t, tube_find_or_make(name));
+    if (!t)
+        return ST_OUT_OF_MEMORY;
+
+    if (!ms_contains(&c->watch, t))
+        r = ms_append(&c->watch, t);
+    TUBE_ASSIGN(t, NULL);
+    return r ? ST_WATCHING : ST_OUT_OF_MEMORY;
+}
+
+// ignore_tube removes the tube named name from the tubes c watches.
+// Returns ST_WATCHING, or ST_NOT_IGNORED if it is the last one.
+static int
+ignore_tube(Conn *c, const char *name)
+{
+    size_t i;
+    Tube *t;
+
+    for (i = 0; i < c->watch.len; i++) {
+        t = c->watch.items[i];
+        if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0) {
+            if (c->watch.len < 2)
+                return ST_NOT_IGNORED;
+            ms_remove(&c->watch, t); /* may free t if refcount => 0 */
+            break;
+        }
+    }
+    return ST_WATCHING;
+}
+
+// reply_watch replies to a watch or ignore command that ended
+// with status st.
+static void
+reply_watch(Conn *c, int st)
+{
+    if (st == ST_WATCHING) {
+        reply_nums(c, STATE_SEND_WORD, st, c->watch.len, -1);
+        return;
+    }
+    if (st == ST_OUT_OF_MEMORY) {
+        twarnx("server error: " MSG_OUT_OF_MEMORY);
+    }
+    reply_st(c, st);
+}
+
 static void
 dispatch_cmd(Conn *c)
 {
-    int r, timeout = -1;
+    int r, dur, odur;
+    int64 timeout = -1;
     uint i;
-    uint count;
+    uint count = 0;
     Job *j = 0;
     byte type;
-    char *size_buf, *delay_buf, *ttr_buf, *pri_buf, *end_buf, *name;
+    char *delay_buf, *pri_buf, *end_buf, *dur_buf, *name;
     uint32 pri;
-    uint32 body_size;
-    int64 delay, ttr;
+    int64 delay, odelay;
     uint64 id;
     Tube *t = NULL;
+    Group *g;
 
     /* NUL-terminate this string so we can use strtol and friends */
     c->cmd[c->cmd_len - 2] = '\0';
-    printf("%zu %s\n", c->cmd_len, c->cmd);
+
+    // A subscribed conn does not wait for jobs while it runs a
+    // command; see wait_for_push.
+    if (c->credits) {
+        remove_waiting_conn(c);
+    }
+
+    if (c->batchleft) {
+        // This is the line of the next job in a put-batch command.
+        if (memchr(c->cmd, '\0', c->cmd_len - 2) || put_job(c, c->use, NULL, c->cmd)) {
+            batch_abort(c);
+            reply_msg(c, MSG_BAD_FORMAT);
+        }
+        return;
+    }
 
     /* check for possible maliciousness */
-    if (strlen(c->cmd) != c->cmd_len - 2) {
+    if (memchr(c->cmd, '\0', c->cmd_len - 2)) {
         reply_msg(c, MSG_BAD_FORMAT);
         return;
     }
 
-    type = which_cmd(c);
+    type = prot_which(c->cmd);
     if (verbose >= 2) {
         printf("<%d command %s\n", c->sock.fd, op_names[type]);
     }
 
     switch (type) {
     case OP_PUT:
-        if (read_u32(&pri, c->cmd + 4, &delay_buf) ||
-            read_duration(&delay, delay_buf, &ttr_buf) ||
-            read_duration(&ttr, ttr_buf, &size_buf) ||
-            read_u32(&body_size, size_buf, &end_buf)) {
+        if (put_job(c, c->use, NULL, c->cmd + CMD_PUT_LEN)) {
             reply_msg(c, MSG_BAD_FORMAT);
-            return;
         }
-        op_ct[type]++;
+        return;
 
-        if (body_size > job_data_size_limit) {
-            /* throw away the job body and respond with JOB_TOO_BIG */
-            skip(c, (int64)body_size + 2, MSG_JOB_TOO_BIG);
+    case OP_PUT_IN:
+        if (read_tube_name(&name, c->cmd + CMD_PUT_IN_LEN, &pri_buf) ||
+            *pri_buf != ' ') {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
-
-        /* don't allow trailing garbage */
-        if (end_buf[0] != '\0') {
+        *pri_buf = '\0';
+        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
-
-        connsetproducer(c);
-
-        if (ttr < 1000000000) {
-            ttr = 1000000000;
+        TUBE_ASSIGN(t, tube_find_or_make(name));
+        if (!t) {
+            reply_serr(c, MSG_OUT_OF_MEMORY);
+            return;
+        }
+        r = put_job(c, t, NULL, pri_buf + 1);
+        TUBE_ASSIGN(t, NULL);
+        if (r) {
+            reply_msg(c, MSG_BAD_FORMAT);
         }
+        return;
 
-        c->in_job = make_job(pri, delay, ttr, body_size + 2, c->use);
+    case OP_PUT_GROUP:
+        if (read_tube_name(&name, c->cmd + CMD_PUT_GROUP_LEN, &pri_buf) ||
+            *pri_buf != ' ') {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        *pri_buf = '\0';
+        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        g = group_find_or_make(c->use, name);
+        if (!g) {
+            reply_serr(c, MSG_OUT_OF_MEMORY);
+            return;
+        }
+        group_iref(g);
+        r = put_job(c, c->use, g, pri_buf + 1);
+        group_dref(g);
+        if (r) {
+            reply_msg(c, MSG_BAD_FORMAT);
+        }
+        return;
 
-        /* OOM? */
-        if (!c->in_job) {
-            /* throw away the job body and respond with OUT_OF_MEMORY */
-            twarnx("server error: " MSG_OUT_OF_MEMORY);
-            skip(c, body_size + 2, MSG_OUT_OF_MEMORY);
+    case OP_PUT_MULTI:
+        r = read_tube_list(&c->fanout, c->cmd + CMD_PUT_MULTI_LEN, &pri_buf);
+        if (r > 0) {
+            reply_serr(c, MSG_OUT_OF_MEMORY);
+            return;
+        }
+        if (r || *pri_buf != ' ' || c->fanout.len > BATCH_MAX) {
+            ms_clear(&c->fanout);
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
+        op_ct[type]++;
+        if (put_job(c, c->fanout.items[0], NULL, pri_buf + 1)) {
+            ms_clear(&c->fanout);
+            reply_msg(c, MSG_BAD_FORMAT);
+        }
+        return;
 
-        fill_extra_data(c);
+    case OP_PUT_BATCH:
+        errno = 0;
+        count = strtoul(c->cmd + CMD_PUT_BATCH_LEN, &end_buf, 10);
+        if (end_buf == c->cmd + CMD_PUT_BATCH_LEN || *end_buf || errno ||
+            count < 1 || count > BATCH_MAX) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
 
-        /* it's possible we already have a complete job */
-        maybe_enqueue_incoming_job(c);
+        // The jobs follow, each with a line like put's arguments.
+        connsetproducer(c);
+        c->batchleft = count;
         return;
 
     case OP_PEEK_READY:
@@ -1367,14 +2684,14 @@ dispatch_cmd(Conn *c)
         op_ct[type]++;
 
         if (c->use->ready.len) {
-            j = job_copy(c->use->ready.data[0]);
+            j = c->use->ready.data[0];
         }
 
         if (!j) {
             reply_msg(c, MSG_NOTFOUND);
             return;
         }
-        reply_job(c, j, MSG_FOUND);
+        reply_job(c, j, ST_FOUND);
         return;
 
     case OP_PEEK_DELAYED:
@@ -1386,14 +2703,14 @@ dispatch_cmd(Conn *c)
         op_ct[type]++;
 
         if (c->use->delay.len) {
-            j = job_copy(c->use->delay.data[0]);
+            j = c->use->delay.data[0];
         }
 
         if (!j) {
             reply_msg(c, MSG_NOTFOUND);
             return;
         }
-        reply_job(c, j, MSG_FOUND);
+        reply_job(c, j, ST_FOUND);
         return;
 
     case OP_PEEK_BURIED:
@@ -1405,7 +2722,7 @@ dispatch_cmd(Conn *c)
         op_ct[type]++;
 
         if (buried_job_p(c->use))
-            j = job_copy(c->use->buried.next);
+            j = c->use->buried.next;
         else
             j = NULL;
 
@@ -1413,7 +2730,7 @@ dispatch_cmd(Conn *c)
             reply_msg(c, MSG_NOTFOUND);
             return;
         }
-        reply_job(c, j, MSG_FOUND);
+        reply_job(c, j, ST_FOUND);
         return;
 
     case OP_PEEKJOB:
@@ -1423,44 +2740,77 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        /* So, peek is annoying, because some other connection might free the
-         * job while we are still trying to write it out. So we copy it and
-         * free the copy when it's done sending, in the "conn_want_command" function. */
-        j = job_copy(job_find(id));
+        // Some other connection might delete the job while we are still
+        // writing it out; reply_job takes a reference to keep it around.
+        j = job_find(id);
 
         if (!j) {
             reply_msg(c, MSG_NOTFOUND);
             return;
         }
-        reply_job(c, j, MSG_FOUND);
+        reply_job(c, j, ST_FOUND);
         return;
 
-    case OP_RESERVE_TIMEOUT:
+    case OP_RESERVE_BATCH:
         errno = 0;
-        timeout = strtol(c->cmd + CMD_RESERVE_TIMEOUT_LEN, &end_buf, 10);
-        if (errno) {
+        count = strtoul(c->cmd + CMD_RESERVE_BATCH_LEN, &end_buf, 10);
+        if (end_buf == c->cmd + CMD_RESERVE_BATCH_LEN || *end_buf != ' ' ||
+            errno || count < 1 || count > BATCH_MAX) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        if (read_timeout(&timeout, end_buf + 1, &end_buf) || *end_buf) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
         /* Falls through */
 
+    case OP_RESERVE_FROM:
+        if (type == OP_RESERVE_FROM) {
+            if (c->credits) {
+                reply_msg(c, MSG_BAD_FORMAT);
+                return;
+            }
+            r = read_tube_list(&c->from, c->cmd + CMD_RESERVE_FROM_LEN, &name);
+            if (r > 0) {
+                reply_serr(c, MSG_OUT_OF_MEMORY);
+                return;
+            }
+            if (r || *name != ' ') {
+                ms_clear(&c->from);
+                reply_msg(c, MSG_BAD_FORMAT);
+                return;
+            }
+            if (read_timeout(&timeout, name + 1, &end_buf) || *end_buf) {
+                ms_clear(&c->from);
+                reply_msg(c, MSG_BAD_FORMAT);
+                return;
+            }
+        }
+        /* Falls through */
+
+    case OP_RESERVE_TIMEOUT:
+        if (type == OP_RESERVE_TIMEOUT) {
+            if (read_timeout(&timeout, c->cmd + CMD_RESERVE_TIMEOUT_LEN,
+                             &end_buf)) {
+                reply_msg(c, MSG_BAD_FORMAT);
+                return;
+            }
+        }
+        /* Falls through */
+
     case OP_RESERVE:
         /* don't allow trailing garbage */
         if (type == OP_RESERVE && c->cmd_len != CMD_RESERVE_LEN + 2) {
             reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
-        op_ct[type]++;
-        connsetworker(c);
-
-        if (conndeadlinesoon(c) && !conn_ready(c)) {
-            reply_msg(c, MSG_DEADLINE_SOON);
+        // Jobs come to a subscribed conn without asking.
+        if (c->credits) {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
-
-        /* try to get a new job for this guy */
-        wait_for_job(c, timeout);
-        process_queue();
+        do_reserve(c, type, timeout, count);
         return;
 
     case OP_RESERVE_JOB:
@@ -1502,7 +2852,7 @@ dispatch_cmd(Conn *c)
         global_stat.reserved_ct++;
 
         conn_reserve_job(c, j);
-        reply_job(c, j, MSG_RESERVED);
+        reply_job(c, j, ST_RESERVED);
         return;
 
     case OP_DELETE:
@@ -1512,80 +2862,19 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        {
-            Job *jf = job_find(id);
-            j = remove_reserved_job(c, jf);
-            if (!j)
-                j = remove_ready_job(jf);
-            if (!j)
-                j = remove_buried_job(jf);
-            if (!j)
-                j = remove_delayed_job(jf);
-        }
-
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
-            return;
-        }
-
-        j->tube->stat.total_delete_ct++;
-
-        j->r.state = Invalid;
-        r = walwrite(&c->srv->wal, j);
-        walmaint(&c->srv->wal);
-        job_free(j);
-
-        if (!r) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
-            return;
-        }
-        reply_msg(c, MSG_DELETED);
+        reply_st(c, delete_job(c, id));
         return;
-
-    case OP_RELEASE:
-        if (read_u64(&id, c->cmd + CMD_RELEASE_LEN, &pri_buf) ||
-            read_u32(&pri, pri_buf, &delay_buf) ||
-            read_duration(&delay, delay_buf, NULL)) {
-            reply_msg(c, MSG_BAD_FORMAT);
-            return;
-        }
-        op_ct[type]++;
-
-        j = remove_reserved_job(c, job_find(id));
-
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
-            return;
-        }
-
-        /* We want to update the delay deadline on disk, so reserve space for
-         * that. */
-        if (delay) {
-            int z = walresvupdate(&c->srv->wal);
-            if (!z) {
-                reply_serr(c, MSG_OUT_OF_MEMORY);
-                return;
-            }
-            j->walresv += z;
-        }
-
-        j->r.pri = pri;
-        j->r.delay = delay;
-        j->r.release_ct++;
-
-        r = enqueue_job(c->srv, j, delay, !!delay);
-        if (r < 0) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
-            return;
-        }
-        if (r == 1) {
-            reply_msg(c, MSG_RELEASED);
+
+    case OP_RELEASE:
+        if (read_u64(&id, c->cmd + CMD_RELEASE_LEN, &pri_buf) ||
+            read_u32(&pri, pri_buf, &delay_buf) ||
+            read_duration(&delay, delay_buf, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
             return;
         }
+        op_ct[type]++;
 
-        /* out of memory trying to grow the queue, so it gets buried */
-        bury_job(c->srv, j, 0);
-        reply_msg(c, MSG_BURIED);
+        reply_st(c, release_job(c, id, pri, delay));
         return;
 
     case OP_BURY:
@@ -1597,20 +2886,28 @@ dispatch_cmd(Conn *c)
 
         op_ct[type]++;
 
-        j = remove_reserved_job(c, job_find(id));
+        reply_st(c, bury_reserved_job(c, id, pri));
+        return;
 
-        if (!j) {
-            reply_msg(c, MSG_NOTFOUND);
-            return;
+    case OP_DELETE_MANY:
+        if (read_ids(c, type, 0, 0, c->cmd + CMD_DELETE_MANY_LEN)) {
+            reply_msg(c, MSG_BAD_FORMAT);
         }
+        return;
 
-        j->r.pri = pri;
-        r = bury_job(c->srv, j, 1);
-        if (!r) {
-            reply_serr(c, MSG_INTERNAL_ERROR);
-            return;
+    case OP_RELEASE_MANY:
+        if (read_u32(&pri, c->cmd + CMD_RELEASE_MANY_LEN, &delay_buf) ||
+            read_duration(&delay, delay_buf, &end_buf) ||
+            read_ids(c, type, pri, delay, end_buf)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+        }
+        return;
+
+    case OP_BURY_MANY:
+        if (read_u32(&pri, c->cmd + CMD_BURY_MANY_LEN, &end_buf) ||
+            read_ids(c, type, pri, 0, end_buf)) {
+            reply_msg(c, MSG_BAD_FORMAT);
         }
-        reply_msg(c, MSG_BURIED);
         return;
 
     case OP_KICK:
@@ -1749,17 +3046,10 @@ dispatch_cmd(Conn *c)
         }
         op_ct[type]++;
 
-        TUBE_ASSIGN(t, tube_find_or_make(name));
-        if (!t) {
+        if (use_tube(c, name) != ST_USING) {
             reply_serr(c, MSG_OUT_OF_MEMORY);
             return;
         }
-
-        c->use->using_ct--;
-        TUBE_ASSIGN(c->use, t);
-        TUBE_ASSIGN(t, NULL);
-        c->use->using_ct++;
-
         reply_line(c, STATE_SEND_WORD, "USING %s\r\n", c->use->name);
         return;
 
@@ -1770,22 +3060,7 @@ dispatch_cmd(Conn *c)
             return;
         }
         op_ct[type]++;
-
-        TUBE_ASSIGN(t, tube_find_or_make(name));
-        if (!t) {
-            reply_serr(c, MSG_OUT_OF_MEMORY);
-            return;
-        }
-
-        r = 1;
-        if (!ms_contains(&c->watch, t))
-            r = ms_append(&c->watch, t);
-        TUBE_ASSIGN(t, NULL);
-        if (!r) {
-            reply_serr(c, MSG_OUT_OF_MEMORY);
-            return;
-        }
-        reply_line(c, STATE_SEND_WORD, "WATCHING %zu\r\n", c->watch.len);
+        reply_watch(c, watch_tube(c, name));
         return;
 
     case OP_IGNORE:
@@ -1795,24 +3070,7 @@ dispatch_cmd(Conn *c)
             return;
         }
         op_ct[type]++;
-
-        t = NULL;
-        for (i = 0; i < c->watch.len; i++) {
-            t = c->watch.items[i];
-            if (strncmp(t->name, name, MAX_TUBE_NAME_LEN) == 0)
-                break;
-            t = NULL;
-        }
-
-        if (t && c->watch.len < 2) {
-            reply_msg(c, MSG_NOT_IGNORED);
-            return;
-        }
-
-        if (t)
-            ms_remove(&c->watch, t); /* may free t if refcount => 0 */
-        t = NULL;
-        reply_line(c, STATE_SEND_WORD, "WATCHING %zu\r\n", c->watch.len);
+        reply_watch(c, ignore_tube(c, name));
         return;
 
     case OP_QUIT:
@@ -1851,11 +3109,204 @@ dispatch_cmd(Conn *c)
         reply_line(c, STATE_SEND_WORD, "PAUSED\r\n");
         return;
 
+    case OP_DURABILITY_TUBE:
+        if (read_tube_name(&name, c->cmd + CMD_DURABILITY_TUBE_LEN, &dur_buf) ||
+            *dur_buf != ' ') {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        *dur_buf++ = '\0';
+        while (*dur_buf == ' ')
+            dur_buf++;
+        dur = durparse(dur_buf);
+        if (dur == -1 || !is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        odur = tube_durability(name);
+        if (!tube_set_durability(name, dur)) {
+            reply_serr(c, MSG_OUT_OF_MEMORY);
+            return;
+        }
+        if (!walsavetubes(&c->srv->wal)) {
+            tube_set_durability(name, odur);
+            reply_serr(c, MSG_INTERNAL_ERROR);
+            return;
+        }
+        reply_msg(c, MSG_UPDATED);
+        return;
+
+    case OP_EXPIRE_TUBE:
+        if (read_tube_name(&name, c->cmd + CMD_EXPIRE_TUBE_LEN, &delay_buf) ||
+            read_duration(&delay, delay_buf, NULL)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+
+        *delay_buf = '\0';
+        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        odelay = tube_expire(name);
+        if (!tube_set_expire(name, delay)) {
+            reply_serr(c, MSG_OUT_OF_MEMORY);
+            return;
+        }
+        if (!walsavetubes(&c->srv->wal)) {
+            tube_set_expire(name, odelay);
+            reply_serr(c, MSG_INTERNAL_ERROR);
+            return;
+        }
+        reply_msg(c, MSG_UPDATED);
+        return;
+
+    case OP_SUBSCRIBE:
+        errno = 0;
+        count = strtoul(c->cmd + CMD_SUBSCRIBE_LEN, &end_buf, 10);
+        if (end_buf == c->cmd + CMD_SUBSCRIBE_LEN || *end_buf || errno ||
+            count > BATCH_MAX) {
+            reply_msg(c, MSG_BAD_FORMAT);
+            return;
+        }
+        op_ct[type]++;
+        connsetworker(c);
+
+        // The jobs start coming once the reply is out.
+        c->credits = count;
+        c->resvmax = 0;
+        c->pending_timeout = -1;
+        reply_msg(c, MSG_SUBSCRIBED);
+        return;
+
     default:
         reply_msg(c, MSG_UNKNOWN_COMMAND);
     }
 }
 
+// dispatch_bin runs the binary command at c->cmd. Its arguments are
+// read from fixed-width fields, or are the whole of a tube name.
+static void
+dispatch_bin(Conn *c)
+{
+    char *a = c->cmd + BIN_REQ_SIZE;
+    int op = (byte)c->cmd[0];
+    uint32 n = c->cmd_len - BIN_REQ_SIZE; // bytes of a in c->cmd
+    uint32 len = get32(c->cmd + 8);
+    int64 timeout = -1;
+    char name[MAX_TUBE_NAME_LEN];
+
+    c->reqid = get32(c->cmd + 4);
+    if (n < len && op != OP_PUT) {
+        skip(c, len - n, ST_BAD_FORMAT);
+        return;
+    }
+
+    switch (op) {
+    case OP_PUT:
+        if (len < BIN_PUT_SIZE) {
+            reply_st(c, ST_BAD_FORMAT);
+            return;
+        }
+        op_ct[op]++;
+        len -= BIN_PUT_SIZE;
+        if (len > job_data_size_limit) {
+            skip(c, len, ST_JOB_TOO_BIG);
+            return;
+        }
+        put_body(c, c->use, NULL, get32(a), (int64)get32(a + 4) * 1000000000,
+                 (int64)get32(a + 8) * 1000000000, len, 0);
+        return;
+
+    case OP_RESERVE_TIMEOUT:
+        if (n != 4) {
+            reply_st(c, ST_BAD_FORMAT);
+            return;
+        }
+        if ((int32)get32(a) >= 0) {
+            timeout = (int64)get32(a) * 1000000000;
+        }
+        do_reserve(c, op, timeout, 0);
+        return;
+
+    case OP_RESERVE:
+        if (n != 0) {
+            reply_st(c, ST_BAD_FORMAT);
+            return;
+        }
+        do_reserve(c, op, timeout, 0);
+        return;
+
+    case OP_DELETE:
+    case OP_TOUCH:
+        if (n != 8) {
+            reply_st(c, ST_BAD_FORMAT);
+            return;
+        }
+        op_ct[op]++;
+        if (op == OP_DELETE) {
+            reply_st(c, delete_job(c, get64(a)));
+        } else if (touch_job(c, job_find(get64(a)))) {
+            reply_st(c, ST_TOUCHED);
+        } else {
+            reply_st(c, ST_NOT_FOUND);
+        }
+        return;
+
+    case OP_RELEASE:
+        if (n != 16) {
+            reply_st(c, ST_BAD_FORMAT);
+            return;
+        }
+        op_ct[op]++;
+        reply_st(c, release_job(c, get64(a), get32(a + 8),
+                                (int64)get32(a + 12) * 1000000000));
+        return;
+
+    case OP_BURY:
+        if (n != 12) {
+            reply_st(c, ST_BAD_FORMAT);
+            return;
+        }
+        op_ct[op]++;
+        reply_st(c, bury_reserved_job(c, get64(a), get32(a + 8)));
+        return;
+
+    case OP_USE:
+    case OP_WATCH:
+    case OP_IGNORE:
+        if (n >= MAX_TUBE_NAME_LEN || memchr(a, '\0', n)) {
+            reply_st(c, ST_BAD_FORMAT);
+            return;
+        }
+        memcpy(name, a, n);
+        name[n] = '\0';
+        if (!is_valid_tube(name, MAX_TUBE_NAME_LEN - 1)) {
+            reply_st(c, ST_BAD_FORMAT);
+            return;
+        }
+        op_ct[op]++;
+
+        if (op == OP_WATCH) {
+            reply_watch(c, watch_tube(c, name));
+        } else if (op == OP_IGNORE) {
+            reply_watch(c, ignore_tube(c, name));
+        } else if (use_tube(c, name) == ST_USING) {
+            reply_bin(c, ST_USING, 0, 0, STATE_SEND_WORD);
+        } else {
+            twarnx("server error: " MSG_OUT_OF_MEMORY);
+            reply_st(c, ST_OUT_OF_MEMORY);
+        }
+        return;
+
+    default:
+        reply_st(c, ST_UNKNOWN_COMMAND);
+    }
+}
+
 /* There are three reasons this function may be called. We need to check for
  * all of them.
  *
@@ -1871,7 +3322,7 @@ conn_timeout(Conn *c)
     Job *j;
 
     /* Check if the client was trying to reserve a job. */
-    if (conn_waiting(c) && conndeadlinesoon(c))
+    if (conn_waiting(c) && !c->credits && conndeadlinesoon(c))
         should_timeout = 1;
 
     /* Check if any reserved jobs have run out of time. We should do this
@@ -1880,29 +3331,28 @@ conn_timeout(Conn *c)
         if (j->r.deadline_at >= nanoseconds())
             break;
 
-        /* This job is in the middle of being written out. If we return it to
-         * the ready queue, someone might free it before we finish writing it
-         * out to the socket. So we'll copy it here and free the copy when it's
-         * done sending. */
-        if (j == c->out_job) {
-            c->out_job = job_copy(c->out_job);
-        }
-
+        // This job might be in the middle of being written out. Once
+        // it is back in the ready queue, someone might delete it, but
+        // the reference taken by reply_job keeps it around for us.
         timeout_ct++; /* stats */
         j->r.timeout_ct++;
         int r = enqueue_job(c->srv, remove_this_reserved_job(c, j), 0, 0);
         if (r < 1)
             bury_job(c->srv, j, 0); /* out of memory, so bury it */
+        settle_group(j->group);
         connsched(c);
     }
 
     if (should_timeout) {
         remove_waiting_conn(c);
-        reply_msg(c, MSG_DEADLINE_SOON);
+        reply_st(c, ST_DEADLINE_SOON);
     } else if (conn_waiting(c) && c->pending_timeout >= 0) {
         c->pending_timeout = -1;
         remove_waiting_conn(c);
-        reply_msg(c, MSG_TIMED_OUT);
+        reply_st(c, ST_TIMED_OUT);
+    } else {
+        // The jobs that timed out gave their credits back.
+        wait_for_push(c);
     }
 }
 
@@ -1918,10 +3368,7 @@ conn_want_command(Conn *c)
 {
     epollq_add(c, 'r');
 
-    /* was this a peek or stats command? */
-    if (c->out_job && c->out_job->r.state == Copy)
-        job_free(c->out_job);
-    c->out_job = NULL;
+    connfreeout(c);
 
     c->reply_sent = 0; /* now that we're done, reset this */
     c->state = STATE_WANT_COMMAND;
@@ -1930,11 +3377,17 @@ conn_want_command(Conn *c)
 static void
 conn_process_io(Conn *c)
 {
-    int r;
+    int r, len;
     int64 to_read;
     Job *j;
+    char *body;
     struct iovec iov[2];
 
+    if (c->walwait) {
+        // The reply is held back until the wal writer catches up.
+        return;
+    }
+
     switch (c->state) {
     case STATE_WANT_COMMAND:
         r = read(c->sock.fd, c->cmd + c->cmd_read, LINE_BUF_SIZE - c->cmd_read);
@@ -1948,7 +3401,7 @@ conn_process_io(Conn *c)
         }
 
         c->cmd_read += r;
-        c->cmd_len = scan_line_end(c->cmd, c->cmd_read);
+        c->cmd_len = scan_cmd(c);
         if (c->cmd_len) {
             // We found complete command line. Bail out to h_conn.
             return;
@@ -1981,6 +3434,7 @@ conn_process_io(Conn *c)
         c->cmd_len = scan_line_end(c->cmd, c->cmd_read);
         if (c->cmd_len) {
             // Found the EOL. Reply and reuse whatever was read afer the EOL.
+            batch_abort(c);
             reply_msg(c, MSG_BAD_FORMAT);
             fill_extra_data(c);
             return;
@@ -2014,6 +3468,10 @@ conn_process_io(Conn *c)
         /* (c->in_job_read < 0) can't happen */
 
         if (c->in_job_read == 0) {
+            if (c->batchleft) {
+                batch_fail(c, c->reply);
+                return;
+            }
             reply(c, c->reply, c->reply_len, STATE_SEND_WORD);
         }
         return;
@@ -2021,7 +3479,8 @@ conn_process_io(Conn *c)
     case STATE_WANT_DATA:
         j = c->in_job;
 
-        r = read(c->sock.fd, j->body + c->in_job_read, j->r.body_size -c->in_job_read);
+        r = read(c->sock.fd, j->body + c->in_job_read,
+                 j->r.body_size - 2 + trailer(c) - c->in_job_read);
         if (r == -1) {
             check_err(c, "read()");
             return;
@@ -2061,11 +3520,17 @@ conn_process_io(Conn *c)
         break;
     case STATE_SEND_JOB:
         j = c->out_job;
+        body = c->out_data;
+        len = c->out_len;
+        if (j) {
+            body = j->body;
+            len = j->r.body_size - 2 + trailer(c);
+        }
 
         iov[0].iov_base = (void *)(c->reply + c->reply_sent);
         iov[0].iov_len = c->reply_len - c->reply_sent; /* maybe 0 */
-        iov[1].iov_base = j->body + c->out_job_sent;
-        iov[1].iov_len = j->r.body_size - c->out_job_sent;
+        iov[1].iov_base = body + c->out_job_sent;
+        iov[1].iov_len = len - c->out_job_sent;
 
         r = writev(c->sock.fd, iov, 2);
         if (r == -1) {
@@ -2084,11 +3549,11 @@ conn_process_io(Conn *c)
             c->reply_sent = c->reply_len;
         }
 
-        /* (c->out_job_sent > j->r.body_size) can't happen */
+        /* (c->out_job_sent > len) can't happen */
 
         /* are we done? */
-        if (c->out_job_sent == j->r.body_size) {
-            if (verbose >= 2) {
+        if (c->out_job_sent == len) {
+            if (verbose >= 2 && j) {
                 printf(">%d job %"PRIu64"\n", c->sock.fd, j->r.id);
             }
             conn_want_command(c);
@@ -2101,7 +3566,7 @@ conn_process_io(Conn *c)
         if (c->halfclosed) {
             c->pending_timeout = -1;
             remove_waiting_conn(c);
-            reply_msg(c, MSG_TIMED_OUT);
+            reply_st(c, ST_TIMED_OUT);
             return;
         }
         break;
@@ -2111,6 +3576,67 @@ conn_process_io(Conn *c)
 #define want_command(c) ((c)->sock.fd && ((c)->state == STATE_WANT_COMMAND))
 #define cmd_data_ready(c) (want_command(c) && (c)->cmd_read)
 
+// walhold removes c from event notifications until it has had
+// n more wal acknowledgements, see h_walack.
+static void
+walhold(Conn *c, int n)
+{
+    if (n) {
+        c->walwait += n;
+        epollq_rmconn(c);
+        epollq_add(c, 0);
+    }
+}
+
+// conn_walwait holds back the reply of c until the wal writers have
+// written the records its command produced, that is, until each
+// stream that got a Durgroup record past queue position pos[i] has
+// acked it. Records of Durasync tubes don't hold back replies, and
+// neither do those of a stream that has stopped being used, since
+// its records are no longer handed to the writer.
+// Until then c is removed from event notifications, see h_walack.
+static void
+conn_walwait(Conn *c, uint64 *pos)
+{
+    Server *s = c->srv;
+    int i, n = 0;
+
+    if (c->state != STATE_SEND_WORD && c->state != STATE_SEND_JOB)
+        return;
+    for (i = 0; i < s->nwal; i++) {
+        Wal *w = s->wals[i];
+        if (w->use && w->syncpos > pos[i] && walqwait(w, c)) {
+            n++;
+        }
+    }
+    walhold(c, n);
+}
+
+// dedup_walwait holds back the reply of c to a put that got job j by
+// its dedup key, until the record of the put that made j is written,
+// as the reply to that put was. The record is somewhere in the queue
+// of j's stream; if j is gone, NULL, it may be in that of any stream.
+static void
+dedup_walwait(Conn *c, Job *j)
+{
+    Server *s = c->srv;
+    int i, n = 0;
+
+    if (j && j->dur != Durgroup)
+        return;
+    for (i = 0; i < s->nwal; i++) {
+        Wal *w = s->wals[i];
+        if (j && srvwal(s, j) != w)
+            continue;
+        if (w->use && walqwait(w, c)) {
+            n++;
+        }
+    }
+    walhold(c, n);
+}
+
+
+
 static void
 h_conn(const int fd, const short which, Conn *c)
 {
@@ -2126,14 +3652,68 @@ h_conn(const int fd, const short which, Conn *c)
         c->halfclosed = 1;
     }
 
+    Server *s = c->srv;
+    uint64 walpos[Walstreams];
+    int i, use = 0;
+
+    // Each stream can stop being used on its own, see walwrite.
+    for (i = 0; i < s->nwal; i++) {
+        if (s->wals[i]->use) {
+            walpos[i] = walqpos(s->wals[i]);
+            use = 1;
+        }
+    }
     conn_process_io(c);
-    while (cmd_data_ready(c) && (c->cmd_len = scan_line_end(c->cmd, c->cmd_read))) {
-        dispatch_cmd(c);
+    while (cmd_data_ready(c) && (c->cmd_len = scan_cmd(c))) {
+        if (conn_bin(c)) {
+            dispatch_bin(c);
+        } else {
+            dispatch_cmd(c);
+        }
         fill_extra_data(c);
     }
+    wait_for_push(c);
     if (c->state == STATE_CLOSE) {
         epollq_rmconn(c);
         connclose(c);
+    } else if (use) {
+        conn_walwait(c, walpos);
+    }
+    epollq_apply();
+}
+
+
+// walerr returns nonzero if any wal writer has failed to write.
+static int
+walerr(Server *s)
+{
+    int i;
+
+    for (i = 0; i < s->nwal; i++) {
+        if (walqerr(s->wals[i]))
+            return 1;
+    }
+    return 0;
+}
+
+// h_walack is called when the wal writer has acknowledged records.
+// It resumes replies to conns that waited for them.
+void
+h_walack(Wal *w, int ev)
+{
+    Conn *c;
+
+    UNUSED_PARAMETER(ev);
+    walqdrain(w);
+    while ((c = walqacked(w))) {
+        if (--c->walwait > 0)
+            continue;
+        if (walerr(c->srv) && c->state == STATE_SEND_WORD) {
+            twarnx("server error: " MSG_INTERNAL_ERROR);
+            reply_st(c, ST_INTERNAL_ERROR);
+        } else {
+            epollq_add(c, 'w');
+        }
     }
     epollq_apply();
 }
@@ -2153,9 +3733,27 @@ prottick(Server *s)
     Tube *t;
     int64 period = 0x34630B8A000LL; /* 1 hour in nanoseconds */
     int64 d;
+    int n;
 
     now = nanoseconds();
 
+    // Delete the jobs whose time to live is up, a batch at a time,
+    // before any of them could become ready or be reserved.
+    n = 0;
+    while ((j = soonest_expiring_job())) {
+        d = j->expires_at - now;
+        if (d > 0) {
+            period = min(period, d);
+            break;
+        }
+        if (n == EXPIRE_BATCH) {
+            period = 0;
+            break;
+        }
+        expire_job(s, j);
+        n++;
+    }
+
     // Enqueue all jobs that are no longer delayed.
     // Capture the smallest period from the soonest delayed job.
     while ((j = soonest_delayed_job())) {
@@ -2185,6 +3783,14 @@ prottick(Server *s)
         }
     }
 
+    // Compact the binlog a little, if it needs it.
+    for (i = 0; i < (size_t)s->nwal; i++) {
+        d = walmaint(s->wals[i], now);
+        if (d > 0) {
+            period = min(period, d);
+        }
+    }
+
     // Process connections with pending timeouts. Release jobs with expired ttr.
     // Capture the smallest period from the soonest connection.
     while (s->conns.len) {
@@ -2274,6 +3880,7 @@ prot_init()
 {
     started_at = nanoseconds();
     memset(op_ct, 0, sizeof(op_ct));
+    cmdtab_init();
 
     int dev_random = open("/dev/urandom", O_RDONLY);
     if (dev_random < 0) {
@@ -2291,6 +3898,13 @@ prot_init()
     for (i = 0; i < instance_id_bytes; i++) {
         sprintf(instance_hex + (i * 2), "%02x", rand_data[i]);
     }
+
+    // A binlog may replace this with the seed it was written with.
+    r = read(dev_random, dedup_seed, sizeof(dedup_seed));
+    if (r != sizeof(dedup_seed)) {
+        twarn("read /dev/urandom");
+        exit(50);
+    }
     close(dev_random);
 
     if (uname(&node_info) == -1) {
@@ -2306,41 +3920,81 @@ prot_init()
 }
 
 // For each job in list, inserts the job into the appropriate data
-// structures and adds it to the log.
+// structures and reserves log space for its eventual delete.
+// Ready and delayed jobs are appended to their heaps, and each heap
+// is rebuilt once at the end, so this takes linear time.
 //
 // Returns 1 on success, 0 on failure.
 int
 prot_replay(Server *s, Job *list)
 {
-    Job *j, *nj;
-    int64 t;
-    int r;
+    Job *j, *nj, grouped;
+    int64 n, now;
+    size_t i;
+    Heap *h;
+    int r, k;
 
+    for (k = 0; k < s->nwal; k++) {
+        n = 0;
+        for (j = list->next ; j != list ; j = j->next) {
+            n += srvwal(s, j) == s->wals[k];
+        }
+        if (!walresvupdates(s->wals[k], n)) {
+            twarnx("failed to reserve space");
+            return 0;
+        }
+    }
+
+    // Ready jobs of message groups go in last, once the heaps
+    // are in order, because their groups may hold them.
+    job_list_reset(&grouped);
+    now = nanoseconds();
     for (j = list->next ; j != list ; j = nj) {
         nj = j->next;
         job_list_remove(j);
-        int z = walresvupdate(&s->wal);
-        if (!z) {
-            twarnx("failed to reserve space");
-            return 0;
+        // A job in the binlog was not put with durability none; the
+        // class it was put with is not stored, so take the tube's.
+        if (j->tube->durability != Durnone) {
+            j->dur = j->tube->durability;
         }
-        int64 delay = 0;
-        switch (j->r.state) {
-        case Buried: {
+        if (j->r.state == Buried) {
             bury_job(s, j, 0);
-            break;
+            continue;
         }
-        case Delayed:
-            t = nanoseconds();
-            if (t < j->r.deadline_at) {
-                delay = j->r.deadline_at - t;
+
+        j->reserver = NULL;
+        if (j->r.state == Delayed && now < j->r.deadline_at) {
+            h = &j->tube->delay;
+        } else {
+            h = &j->tube->ready;
+            j->r.state = Ready;
+            ready_ct++;
+            if (j->r.pri < URGENT_THRESHOLD) {
+                global_stat.urgent_ct++;
+                j->tube->stat.urgent_ct++;
+            }
+            if (j->group) {
+                job_list_insert(&grouped, j);
+                continue;
             }
-            /* Falls through */
-        default:
-            r = enqueue_job(s, j, delay, 0);
-            if (r < 1)
-                twarnx("error recovering job %"PRIu64, j->r.id);
         }
+        r = heapappend(h, j);
+        if (!r)
+            twarnx("error recovering job %"PRIu64, j->r.id);
+        expire_track(j);
+    }
+
+    for (i = 0; i < tubes.len; i++) {
+        Tube *t = tubes.items[i];
+        heapify(&t->ready);
+        heapify(&t->delay);
+    }
+
+    while (!job_list_is_empty(&grouped)) {
+        j = job_list_remove(grouped.next);
+        if (!ready_insert(j))
+            twarnx("error recovering job %"PRIu64, j->r.id);
+        expire_track(j);
     }
     return 1;
 }
@@ -7,25 +7,52 @@ struct Server srv = {
     .port = Portdef,
     .wal = {
         .filesize = Filesizedef,
+        .cbytes = Compactbytesdef,
+        .ctime = Compacttimedef,
     },
 };
 
-// srv_acquire_wal tries to lock the wal dir specified by s->wal and
-// replay entries from it to initialize the s state with jobs.
-// On errors it exits from the program.
+// srv_acquire_wal tries to lock the wal dirs specified by s->wal and
+// s->waldirs and replay entries from them to initialize the s state
+// with jobs. On errors it exits from the program.
 void srv_acquire_wal(Server *s) {
-    if (s->wal.use) {
-        // We want to make sure that only one beanstalkd tries
-        // to use the wal directory at a time. So acquire a lock
-        // now and never release it.
-        if (!waldirlock(&s->wal)) {
-            twarnx("failed to lock wal dir %s", s->wal.dir);
-            exit(10);
+    int i;
+
+    s->wals[0] = &s->wal;
+    if (!s->nwal) {
+        s->nwal = 1;
+    }
+    for (i = 1; i < s->nwal; i++) {
+        Wal *w = malloc(sizeof *w);
+        if (!w) {
+            twarnx("out of memory");
+            exit(1);
         }
+        *w = s->wal;
+        w->id = i;
+        w->dir = s->waldirs[i];
+        s->wals[i] = w;
+    }
 
+    if (s->wal.use) {
         Job list = {.prev=NULL, .next=NULL};
         list.prev = list.next = &list;
-        walinit(&s->wal, &list);
+
+        for (i = 0; i < s->nwal; i++) {
+            // We want to make sure that only one beanstalkd tries
+            // to use the wal directory at a time. So acquire a lock
+            // now and never release it.
+            if (!waldirlock(s->wals[i])) {
+                twarnx("failed to lock wal dir %s", s->wals[i]->dir);
+                exit(10);
+            }
+        }
+
+        // Each job's records are all in one stream, so the streams
+        // can be read one after another into the same list.
+        for (i = 0; i < s->nwal; i++) {
+            walinit(s->wals[i], &list);
+        }
         int ok = prot_replay(s, &list);
         if (!ok) {
             twarnx("failed to replay log");
@@ -34,10 +61,37 @@ void srv_acquire_wal(Server *s) {
     }
 }
 
+
+// srvwal returns the binlog stream that gets j's records.
+// A job stays in the stream it was first written to, so that its
+// records are replayed in order; new jobs are spread by id.
+// A new job that shares a body goes with the job that has it,
+// so that its record can refer to that job's (see filewrjobfull).
+// Jobs put in Durnone tubes get a stream that is not in use.
+Wal *
+srvwal(Server *s, Job *j)
+{
+    static Wal nowal; // never in use, see walwrite
+
+    if (j->nowal) {
+        return &nowal;
+    }
+    if (j->file) {
+        return j->file->w;
+    }
+    if (j->bodyof && !j->bodyof->nowal) {
+        return srvwal(s, j->bodyof);
+    }
+    if (s->nwal < 2) {
+        return &s->wal;
+    }
+    return s->wals[j->r.id % s->nwal];
+}
+
 void
 srvserve(Server *s)
 {
-    int r;
+    int r, i;
     Socket *sock;
 
     if (sockinit() == -1) {
@@ -62,10 +116,27 @@ srvserve(Server *s)
         exit(2);
     }
 
+    for (i = 0; i < s->nwal; i++) {
+        if (!s->wals[i]->use) continue;
+        r = sockwant(&s->wals[i]->sock, 'r');
+        if (r == -1) {
+            twarn("sockwant");
+            exit(2);
+        }
+    }
 
     for (;;) {
         int64 period = prottick(s);
 
+        // Hand everything the last event and prottick produced
+        // to the wal writers in one go. Streams are tested one by
+        // one, since one of them failing does not stop the others.
+        for (i = 0; i < s->nwal; i++) {
+            if (s->wals[i]->use) {
+                walqflush(s->wals[i]);
+            }
+        }
+
         int rw = socknext(&sock, period);
         if (rw == -1) {
             twarnx("socknext");
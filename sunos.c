@@ -46,6 +46,7 @@ sockwant(Socket *s, int rw)
         s->added = 1;
         return port_associate(portfd, PORT_SOURCE_FD, s->fd, events, (void *)s);
     } else if (!rw) {
+        s->added = 0;
         return port_dissociate(portfd, PORT_SOURCE_FD, s->fd);
     } else {
         port_dissociate(portfd, PORT_SOURCE_FD, s->fd);
@@ -89,3 +90,19 @@ socknext(Socket **s, int64 timeout)
 
     return 0;
 }
+
+
+// sysfalloc allocates disk space of len bytes with posix_fallocate,
+// and falls back to rawfalloc if the file system can't do that.
+// Returns 0 on success, and a positive errno otherwise.
+int
+sysfalloc(int fd, int len)
+{
+    int r;
+
+    r = posix_fallocate(fd, 0, len);
+    if (r == EINVAL || r == EOPNOTSUPP) {
+        return rawfalloc(fd, len);
+    }
+    return r;
+}
@@ -216,6 +216,65 @@ cttest_heap_remove_k()
     free(h.data);
 }
 
+void
+cttest_heap_heapify()
+{
+    Heap h = {
+        .less = job_pri_less,
+        .setpos = job_setpos,
+    };
+    const int n = 100;
+    Job *j;
+    int i;
+    uint32 last = 0;
+
+    for (i = 0; i < n; i++) {
+        j = make_job((i * 37) % n, 0, 1, 0, 0);
+        assertf(j, "allocate job");
+        assertf(heapappend(&h, j), "append should succeed");
+    }
+    heapify(&h);
+
+    for (i = 0; i < n; i++) {
+        assertf(((Job *)h.data[i])->heap_index == (size_t)i, "should match");
+    }
+    for (i = 0; i < n; i++) {
+        j = heapremove(&h, 0);
+        assertf(j->r.pri >= last, "should come out in order");
+        last = j->r.pri;
+        job_free(j);
+    }
+    free(h.data);
+}
+
+void
+ctbench_heap_heapify(int n)
+{
+    Job **j = calloc(n, sizeof *j);
+    int i;
+    for (i = 0; i < n; i++) {
+        j[i] = make_job(1, 0, 1, 0, 0);
+        assert(j[i]);
+        j[i]->r.pri = -j[i]->r.id;
+    }
+    Heap h = {
+        .less = job_pri_less,
+        .setpos = job_setpos,
+    };
+
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        heapappend(&h, j[i]);
+    }
+    heapify(&h);
+    ctstoptimer();
+
+    for (i = 0; i < n; i++)
+        job_free(heapremove(&h, 0));
+    free(h.data);
+    free(j);
+}
+
 void
 ctbench_heap_insert(int n)
 {
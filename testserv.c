@@ -19,6 +19,7 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <inttypes.h>
 
 static int srvpid, size;
 
@@ -265,7 +266,7 @@ static char *
 readline(int fd)
 {
     char c = 0, p = 0;
-    static char buf[1024];
+    static char buf[2048];
     fd_set rfd;
     struct timeval tv;
 
@@ -352,6 +353,135 @@ mustsend(int fd, char *s)
     fflush(stdout);
 }
 
+// Binary protocol ops and reply status codes, as in doc/protocol.txt.
+enum {
+    Bput = 1,
+    Breserve = 3,
+    Bdelete = 4,
+    Brelease = 5,
+    Bbury = 6,
+    Buse = 11,
+    Bwatch = 12,
+    Bignore = 13,
+    Breservetimeout = 20,
+    Btouch = 21,
+};
+enum {
+    Sinserted = 1,
+    Sburied = 2,
+    Sreserved = 3,
+    Sdeleted = 5,
+    Sreleased = 6,
+    Stouched = 7,
+    Susing = 8,
+    Swatching = 9,
+    Snotignored = 10,
+    Snotfound = 11,
+    Stimedout = 13,
+    Sjobtoobig = 15,
+    Sbadformat = 18,
+    Sunknown = 19,
+};
+
+static void
+putbe(char *p, uint64 v, int n)
+{
+    while (n--) {
+        p[n] = v;
+        v >>= 8;
+    }
+}
+
+static uint64
+getbe(const char *p, int n)
+{
+    uint64 v = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        v = v << 8 | (byte)p[i];
+    }
+    return v;
+}
+
+// fmtbin writes a binary request at buf and returns its size.
+// The args are n bytes at a.
+static int
+fmtbin(char *buf, int op, uint32 id, const char *a, int n)
+{
+    buf[0] = op;
+    buf[1] = buf[2] = buf[3] = 0;
+    putbe(buf + 4, id, 4);
+    putbe(buf + 8, n, 4);
+    memcpy(buf + 12, a, n);
+    return 12 + n;
+}
+
+static void
+mustsendbin(int fd, int op, uint32 id, const char *a, int n)
+{
+    char buf[1024];
+
+    writefull(fd, buf, fmtbin(buf, op, id, a, n));
+}
+
+// fmtput writes the args of a binary put at a and returns their size.
+static int
+fmtput(char *a, uint32 pri, uint32 delay, uint32 ttr, const char *body)
+{
+    putbe(a, pri, 4);
+    putbe(a + 4, delay, 4);
+    putbe(a + 8, ttr, 4);
+    memcpy(a + 12, body, strlen(body));
+    return 12 + strlen(body);
+}
+
+static void
+readfull(int fd, char *buf, int n)
+{
+    fd_set rfd;
+    struct timeval tv;
+    int r;
+
+    while (n > 0) {
+        FD_ZERO(&rfd);
+        FD_SET(fd, &rfd);
+        tv.tv_sec = timeout / 1000000000;
+        tv.tv_usec = (timeout/1000) % 1000000;
+        r = select(fd+1, &rfd, NULL, NULL, &tv);
+        if (r != 1) {
+            fputs("timeout", stderr);
+            exit(8);
+        }
+        r = read(fd, buf, n);
+        if (r < 1) {
+            perror("read");
+            exit(1);
+        }
+        buf += r;
+        n -= r;
+    }
+}
+
+// ckbin reads a binary reply and checks its fields and body.
+static void
+ckbin(int fd, int st, uint32 id, uint64 v, const char *body)
+{
+    char hdr[20], buf[1024];
+    int n;
+
+    readfull(fd, hdr, sizeof hdr);
+    n = getbe(hdr + 16, 4);
+    printf("<%d bin %d %u %"PRIu64" %d\n", fd, hdr[0], (uint)getbe(hdr + 4, 4),
+           getbe(hdr + 8, 8), n);
+    assertf(hdr[0] == st, "status %d != %d", hdr[0], st);
+    assertf(getbe(hdr + 4, 4) == id, "reqid %u != %u", (uint)getbe(hdr + 4, 4), id);
+    assertf(getbe(hdr + 8, 8) == v, "value %"PRIu64" != %"PRIu64, getbe(hdr + 8, 8), v);
+    assertf(n == (int)strlen(body), "len %d != %zu", n, strlen(body));
+    readfull(fd, buf, n);
+    assertf(memcmp(buf, body, n) == 0, "body \"%.*s\" != \"%s\"", n, buf, body);
+}
+
 static int
 filesize(char *path)
 {
@@ -374,6 +504,39 @@ cttest_unknown_command()
     ckresp(fd, "UNKNOWN_COMMAND\r\n");
 }
 
+void
+cttest_command_words()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    // Only whole words are commands, and those that take
+    // arguments need a space after them.
+    mustsend(fd, "put\r\n");
+    ckresp(fd, "UNKNOWN_COMMAND\r\n");
+    mustsend(fd, "reservex\r\n");
+    ckresp(fd, "UNKNOWN_COMMAND\r\n");
+    mustsend(fd, "stats-tubes\r\n");
+    ckresp(fd, "UNKNOWN_COMMAND\r\n");
+    mustsend(fd, "reserve x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "list-tube-used\r\n");
+    ckresp(fd, "USING default\r\n");
+    mustsend(fd, "watch a\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "put 0 0 1 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "delete 18446744073709551616\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete 18446744073709551615\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "delete +1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
 void
 cttest_too_long_commandline()
 {
@@ -547,6 +710,43 @@ cttest_peek_buried_kick()
     ckresp(fd, "KICKED 0\r\n");
 }
 
+void
+cttest_peek_then_delete()
+{
+    // The body is too big to fit in the socket buffers, so the job
+    // is deleted while the server is still sending it to fd.
+    const int len = 4*1024*1024;
+    char *body = malloc(len+2);
+    char *got = malloc(len+2);
+    assert(body && got);
+    int i;
+    for (i = 0; i < len; i++) {
+        body[i] = 'a' + i%26;
+    }
+    body[len] = '\r';
+    body[len+1] = '\n';
+
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    int fd2 = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 4194304\r\n");
+    writefull(fd, body, len+2);
+    ckresp(fd, "INSERTED 1\r\n");
+
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 4194304\r\n");
+    mustsend(fd2, "delete 1\r\n");
+    ckresp(fd2, "DELETED\r\n");
+    readfull(fd, got, len+2);
+    assert(memcmp(body, got, len+2) == 0);
+
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    free(body);
+    free(got);
+}
+
 void
 cttest_touch_bad_format()
 {
@@ -661,132 +861,894 @@ cttest_pause()
 }
 
 void
-cttest_underscore()
+cttest_milliseconds()
 {
+    int64 s, d;
+
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "use x_y\r\n");
-    ckresp(fd, "USING x_y\r\n");
+    s = nanoseconds();
+    mustsend(fd, "put 0 200ms 1500ms 1\r\nx\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+    mustsend(fd, "reserve-with-timeout 5\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
+    d = nanoseconds() - s;
+    assert(d >= 200000000 && d < 900000000);
+
+    s = nanoseconds();
+    mustsend(fd, "release 1 0 150ms\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "reserve-with-timeout 100ms\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+    d = nanoseconds() - s;
+    assert(d >= 100000000 && d < 500000000);
+    mustsend(fd, "pause-tube default 300ms\r\n");
+    ckresp(fd, "PAUSED\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "x\r\n");
+    d = nanoseconds() - s;
+    assert(d >= 300000000 && d < 900000000);
+
+    mustsend(fd, "put 0 0 1mss 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put 0 0 ms 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-with-timeout 99999999999999999999\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+
+    // No timeout at all means 0, as it always has.
+    mustsend(fd, "reserve-with-timeout \r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+
+    // A ttr under a second would be all safety margin.
+    mustsend(fd, "put 0 0 999ms 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put 0 0 1000ms 1\r\ny\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+
+    mustsend(fd, "put 0 250ms 1500ms 1\r\nz\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndelay: 0\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndelay-ms: 250\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nttr-ms: 1500\n");
 }
 
 void
-cttest_2cmdpacket()
+cttest_durability_tube()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "use a\r\nuse b\r\n");
-    ckresp(fd, "USING a\r\n");
-    ckresp(fd, "USING b\r\n");
+    mustsend(fd, "durability-tube default fast\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "durability-tube default\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "durability-tube x none\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "use x\r\n");
+    ckresp(fd, "USING x\r\n");
+    mustsend(fd, "stats-tube x\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: none\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: group\n");
+
+    // A job keeps the class its tube had when it was put.
+    mustsend(fd, "use default\r\n");
+    ckresp(fd, "USING default\r\n");
+    mustsend(fd, "durability-tube default async\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "durability-tube default group\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: async\n");
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: group\n");
 }
 
 void
-cttest_too_big()
+cttest_expire_tube()
 {
-    job_data_size_limit = 10;
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 11\r\n");
-    mustsend(fd, "delete 9999\r\n");
-    mustsend(fd, "put 0 0 0 1\r\n");
-    mustsend(fd, "x\r\n");
-    ckresp(fd, "JOB_TOO_BIG\r\n");
+    mustsend(fd, "put 10 0 100 1\r\na\r\n");
     ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "expire-tube default 100ms\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "put 5 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 5 100 1\r\nc\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nd\r\n");
+    ckresp(fd, "INSERTED 4\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 4 1\r\n");
+    ckresp(fd, "d\r\n");
+    usleep(200000);
+
+    // Job 1 was put before the tube had a time to live,
+    // and a reserved job does not expire.
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 3\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntotal-expired: 2\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nexpire-ms: 100\n");
+
+    // Once released, it does.
+    mustsend(fd, "release 4 0 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "peek 4\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+
+    // The setting is kept for the name while the tube is gone.
+    mustsend(fd, "expire-tube foo 1\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "use default\r\n");
+    ckresp(fd, "USING default\r\n");
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "stats-tube foo\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nexpire-ms: 1000\n");
+    mustsend(fd, "expire-tube default x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
 }
 
 void
-cttest_job_size_invalid()
+cttest_put_batch()
 {
-    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 4294967296\r\n");
-    mustsend(fd, "put 0 0 0 10b\r\n");
-    mustsend(fd, "put 0 0 0 --!@#$%^&&**()0b\r\n");
-    mustsend(fd, "put 0 0 0 1\r\n");
-    mustsend(fd, "x\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-    ckresp(fd, "BAD_FORMAT\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put-batch 3\r\n"
+                 "1 0 100 1\r\na\r\n"
+                 "2 0 100 2\r\nbb\r\n");
+    mustsend(fd, "3 1 100 3\r\nc");
+    mustsend(fd, "cc\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 3\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nd\r\n");
+    ckresp(fd, "INSERTED 4\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 4 1\r\n");
+    ckresp(fd, "d\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 2 2\r\n");
+    ckresp(fd, "bb\r\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: delayed\n");
 }
 
 void
-cttest_job_size_max_plus_1()
+cttest_put_batch_fail()
 {
-    /* verify that server reject the job larger than maximum allowed. */
-    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    job_data_size_limit = 10;
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 1073741825\r\n");
-
-    const int len = 1024*1024;
-    char body[len+1];
-    memset(body, 'a', len);
-    body[len] = 0;
 
-    int i;
-    for (i=0; i<JOB_DATA_SIZE_LIMIT_MAX; i+=len) {
-        mustsend(fd, body);
-    }
-    mustsend(fd, "x");
-    mustsend(fd, "\r\n");
+    // One job that can't be put fails the whole batch.
+    mustsend(fd, "put-batch 3\r\n"
+                 "0 0 100 1\r\na\r\n"
+                 "0 0 100 11\r\n01234567890\r\n"
+                 "0 0 100 1\r\nb\r\n");
     ckresp(fd, "JOB_TOO_BIG\r\n");
+    mustsend(fd, "put-batch 2\r\n"
+                 "0 0 100 1\r\na\r\r"
+                 "0 0 100 1\r\nb\r\n");
+    ckresp(fd, "EXPECTED_CRLF\r\n");
+    mustsend(fd, "put-batch 2\r\n"
+                 "0 0 x 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-batch 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-batch 1001\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "peek-ready\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
 }
 
 void
-cttest_delete_ready()
+cttest_reserve_batch()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 0 0\r\n");
-    mustsend(fd, "\r\n");
+    mustsend(fd, "put 5 0 100 1\r\na\r\n");
     ckresp(fd, "INSERTED 1\r\n");
-    mustsend(fd, "delete 1\r\n");
+    mustsend(fd, "use foo\r\n");
+    ckresp(fd, "USING foo\r\n");
+    mustsend(fd, "put 3 0 100 2\r\nbb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 5 0 100 3\r\nccc\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "watch foo\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+
+    // Jobs come in (pri, id) order across the watched tubes.
+    mustsend(fd, "reserve-batch 2 0\r\n");
+    ckresp(fd, "RESERVED-BATCH 2 17\r\n");
+    ckresp(fd, "2 2\r\n");
+    ckresp(fd, "bb\r\n");
+    ckresp(fd, "1 1\r\n");
+    ckresp(fd, "a\r\n");
+    ckresp(fd, "\r\n");
+    mustsend(fd, "reserve-batch 5 0\r\n");
+    ckresp(fd, "RESERVED-BATCH 1 10\r\n");
+    ckresp(fd, "3 3\r\n");
+    ckresp(fd, "ccc\r\n");
+    ckresp(fd, "\r\n");
+    mustsend(fd, "reserve-batch 5 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+
+    // Each job is reserved on its own.
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: reserved\n");
+    mustsend(fd, "release 1 0 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "delete 2\r\n");
     ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    mustsend(fd, "reserve-batch 0 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-batch 1001 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-batch 5\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-batch 5 0x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
 }
 
 void
-cttest_delete_reserved_by_other()
+cttest_reserve_batch_wait()
 {
     int port = SERVER();
-    int fd = mustdiallocal(port);
-    mustsend(fd, "put 0 0 1 1\r\n");
-    mustsend(fd, "a\r\n");
-    ckresp(fd, "INSERTED 1\r\n");
-
-    int o = mustdiallocal(port);
-    mustsend(o, "reserve\r\n");
-    ckresp(o, "RESERVED 1 1\r\n");
-    ckresp(o, "a\r\n");
+    int cons = mustdiallocal(port);
+    int prod = mustdiallocal(port);
 
-    mustsend(fd, "delete 1\r\n");
-    ckresp(fd, "NOT_FOUND\r\n");
+    // A waiting reserve-batch takes what is ready when it wakes up.
+    mustsend(cons, "reserve-batch 10 1\r\n");
+    mustsend(prod, "put 0 0 100 1\r\na\r\n");
+    ckresp(prod, "INSERTED 1\r\n");
+    ckresp(cons, "RESERVED-BATCH 1 8\r\n");
+    ckresp(cons, "1 1\r\n");
+    ckresp(cons, "a\r\n");
+    ckresp(cons, "\r\n");
+    mustsend(prod, "put-batch 2\r\n"
+                   "0 0 100 1\r\nb\r\n"
+                   "0 0 100 1\r\nc\r\n");
+    ckresp(prod, "INSERTED-BATCH 2 2\r\n");
+    mustsend(cons, "reserve-batch 10 1\r\n");
+    ckresp(cons, "RESERVED-BATCH 2 16\r\n");
+    ckresp(cons, "2 1\r\n");
+    ckresp(cons, "b\r\n");
+    ckresp(cons, "3 1\r\n");
+    ckresp(cons, "c\r\n");
+    ckresp(cons, "\r\n");
+    mustsend(cons, "reserve-batch 10 1\r\n");
+    ckresp(cons, "TIMED_OUT\r\n");
 }
 
 void
-cttest_delete_bad_format()
+cttest_delete_many()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "delete 18446744073709551616\r\n"); // UINT64_MAX+1
+    mustsend(fd, "put-batch 5\r\n"
+                 "0 0 100 1\r\na\r\n"
+                 "0 0 100 1\r\nb\r\n"
+                 "0 0 100 1\r\nc\r\n"
+                 "0 0 100 1\r\nd\r\n"
+                 "0 0 100 1\r\ne\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 5\r\n");
+    mustsend(fd, "delete-many 7\r\n2-3 5 7\r\n");
+    ckresp(fd, "DELETED-MANY 3 1\r\n");
+    ckresp(fd, "7\r\n");
+    mustsend(fd, "delete-many 7\r\n1 3 4-4\r\n");
+    ckresp(fd, "DELETED-MANY 2 1\r\n");
+    ckresp(fd, "3\r\n");
+    mustsend(fd, "peek-ready\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+
+    // A malformed list deletes nothing.
+    mustsend(fd, "put 0 0 100 1\r\nf\r\n");
+    ckresp(fd, "INSERTED 6\r\n");
+    mustsend(fd, "delete-many 5\r\n6 4-2\r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "delete 184467440737095516160000000000000000000000000000\r\n");
+    mustsend(fd, "delete-many 3\r\n6 x\r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "delete foo111\r\n");
+    mustsend(fd, "delete-many 8\r\n6 1-1000\r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
-    mustsend(fd, "delete 111foo\r\n");
+    mustsend(fd, "delete-many 0\r\n\r\n");
     ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete-many 1\r\n6\r\r");
+    ckresp(fd, "EXPECTED_CRLF\r\n");
+    mustsend(fd, "delete-many 1\r\n6\r\n");
+    ckresp(fd, "DELETED-MANY 1 0\r\n");
+    ckresp(fd, "\r\n");
 }
 
 void
-cttest_multi_tube()
+cttest_release_bury_many()
 {
     int port = SERVER();
     int fd = mustdiallocal(port);
-    mustsend(fd, "use abc\r\n");
-    ckresp(fd, "USING abc\r\n");
-    mustsend(fd, "put 999999 0 0 0\r\n");
-    mustsend(fd, "\r\n");
+    mustsend(fd, "put-batch 4\r\n"
+                 "0 0 100 1\r\na\r\n"
+                 "0 0 100 1\r\nb\r\n"
+                 "0 0 100 1\r\nc\r\n"
+                 "0 0 100 1\r\nd\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 4\r\n");
+    mustsend(fd, "reserve-batch 3 0\r\n");
+    ckresp(fd, "RESERVED-BATCH 3 24\r\n");
+    ckresp(fd, "1 1\r\n");
+    ckresp(fd, "a\r\n");
+    ckresp(fd, "2 1\r\n");
+    ckresp(fd, "b\r\n");
+    ckresp(fd, "3 1\r\n");
+    ckresp(fd, "c\r\n");
+    ckresp(fd, "\r\n");
+
+    // Job 4 is not reserved, so neither command takes it.
+    mustsend(fd, "bury-many 7 3\r\n3-4\r\n");
+    ckresp(fd, "BURIED-MANY 1 1\r\n");
+    ckresp(fd, "4\r\n");
+    mustsend(fd, "release-many 9 0 5\r\n1-2 4\r\n");
+    ckresp(fd, "RELEASED-MANY 2 1\r\n");
+    ckresp(fd, "4\r\n");
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\npri: 9\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: buried\npri: 7\n");
+    mustsend(fd, "release-many 9 0 x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "bury-many 3\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_subscribe()
+{
+    int port = SERVER();
+    int cons = mustdiallocal(port);
+    int prod = mustdiallocal(port);
+    mustsend(cons, "subscribe 2\r\n");
+    ckresp(cons, "SUBSCRIBED\r\n");
+    mustsend(prod, "put 0 0 100 1\r\na\r\n");
+    ckresp(prod, "INSERTED 1\r\n");
+    ckresp(cons, "RESERVED 1 1\r\n");
+    ckresp(cons, "a\r\n");
+    mustsend(prod, "put 0 0 100 1\r\nb\r\n");
+    ckresp(prod, "INSERTED 2\r\n");
+    mustsend(prod, "put 0 0 100 1\r\nc\r\n");
+    ckresp(prod, "INSERTED 3\r\n");
+    ckresp(cons, "RESERVED 2 1\r\n");
+    ckresp(cons, "b\r\n");
+
+    // The credits are used up until a job is deleted.
+    mustsend(cons, "stats-job 3\r\n");
+    ckrespsub(cons, "OK ");
+    ckrespsub(cons, "\nstate: ready\n");
+    mustsend(cons, "delete 1\r\n");
+    ckresp(cons, "DELETED\r\n");
+    ckresp(cons, "RESERVED 3 1\r\n");
+    ckresp(cons, "c\r\n");
+    mustsend(cons, "reserve-with-timeout 0\r\n");
+    ckresp(cons, "BAD_FORMAT\r\n");
+
+    mustsend(cons, "subscribe 0\r\n");
+    ckresp(cons, "SUBSCRIBED\r\n");
+    mustsend(cons, "delete 2\r\n");
+    ckresp(cons, "DELETED\r\n");
+    mustsend(prod, "put 0 0 100 1\r\nd\r\n");
+    ckresp(prod, "INSERTED 4\r\n");
+    mustsend(cons, "peek-ready\r\n");
+    ckresp(cons, "FOUND 4 1\r\n");
+    ckresp(cons, "d\r\n");
+    mustsend(cons, "subscribe 1001\r\n");
+    ckresp(cons, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_subscribe_ttr()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "subscribe 1\r\n");
+    ckresp(fd, "SUBSCRIBED\r\n");
+    mustsend(fd, "put 0 0 1 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+
+    // The job times out and comes back.
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntimeouts: 1\n");
+}
+
+void
+cttest_put_in()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-in foo 0 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "list-tube-used\r\n");
+    ckresp(fd, "USING default\r\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntube: foo\n");
+    mustsend(fd, "put-in foo\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-in -foo 0 0 100 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-in bar 0 0 x 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+
+    // A tube made for a malformed put-in goes away again.
+    mustsend(fd, "stats-tube bar\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+void
+cttest_put_dedup()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1 k1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\nb\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    // Keys are scoped per tube.
+    mustsend(fd, "put-in foo 0 0 100 1 k1\r\nc\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+
+    // A key is remembered after its job is gone.
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+
+    mustsend(fd, "put 0 0 100 1 k1 k2\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put 0 0 100 1 \r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-batch 1\r\n0 0 100 1 k1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_put_dedup_window()
+{
+    dedup_window = 100000000; // 100ms
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1 k1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    usleep(150000);
+    mustsend(fd, "put 0 0 100 1 k1\r\na\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\na\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+}
+
+void
+cttest_put_dedup_max()
+{
+    dedup_max = 2;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1 k1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 1 k2\r\na\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    // There is room for only two keys, so k1 is forgotten.
+    mustsend(fd, "put 0 0 100 1 k3\r\na\r\n");
+    ckresp(fd, "INSERTED 4\r\n");
+    mustsend(fd, "put 0 0 100 1 k2\r\na\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 100 1 k1\r\na\r\n");
+    ckresp(fd, "INSERTED 6\r\n");
+}
+
+void
+cttest_put_multi()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-multi a,b,c 5 0 100 3\r\nabc\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 3\r\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntube: c\n");
+
+    // The jobs share a body, which outlives the job it came with.
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "reserve-from b 0\r\n");
+    ckresp(fd, "RESERVED 2 3\r\n");
+    ckresp(fd, "abc\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "peek 3\r\n");
+    ckresp(fd, "FOUND 3 3\r\n");
+    ckresp(fd, "abc\r\n");
+
+    mustsend(fd, "put-multi a,-b 0 0 100 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-multi a,b\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-multi a,b 0 0 100 1\r\nx\r\r");
+    ckresp(fd, "EXPECTED_CRLF\r\n");
+    mustsend(fd, "peek 4\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+void
+cttest_put_group()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-group g 10 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put-group g 0 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 5 0 100 1\r\nc\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 3\n");
+
+    // Job 2 has the best priority, but waits for job 1.
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 3 1\r\n");
+    ckresp(fd, "c\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+
+    // A released job is still the first of its group.
+    mustsend(fd, "release 1 10 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+
+    mustsend(fd, "put-group -g 0 0 100 1\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "put-group g\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_reserve_from()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put-in foo 5 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put-in bar 3 0 100 1\r\nc\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+
+    // Job 1 has the best priority, but is in neither tube.
+    mustsend(fd, "reserve-from foo,bar 0\r\n");
+    ckresp(fd, "RESERVED 3 1\r\n");
+    ckresp(fd, "c\r\n");
+    mustsend(fd, "reserve-from foo,bar,baz 0\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "reserve-from foo,bar 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+
+    // The watch list is unchanged.
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "list-tubes-watched\r\n");
+    ckresp(fd, "OK 14\r\n");
+    ckresp(fd, "---\n- default\n\r\n");
+
+    mustsend(fd, "reserve-from foo, 0\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-from foo\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "reserve-from foo 0x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_reserve_from_wait()
+{
+    int port = SERVER();
+    int cons = mustdiallocal(port);
+    int prod = mustdiallocal(port);
+    mustsend(cons, "reserve-from foo,bar -1\r\n");
+    mustsend(prod, "put 0 0 100 1\r\na\r\n");
+    ckresp(prod, "INSERTED 1\r\n");
+    mustsend(prod, "stats-tube bar\r\n");
+    ckrespsub(prod, "OK ");
+    ckrespsub(prod, "\ncurrent-waiting: 1\n");
+    mustsend(prod, "put-in bar 0 0 100 1\r\nb\r\n");
+    ckresp(prod, "INSERTED 2\r\n");
+    ckresp(cons, "RESERVED 2 1\r\n");
+    ckresp(cons, "b\r\n");
+    mustsend(prod, "stats-tube bar\r\n");
+    ckrespsub(prod, "OK ");
+    ckrespsub(prod, "\ncurrent-waiting: 0\n");
+}
+
+void
+cttest_binary()
+{
+    char a[100], id[16];
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    writefull(fd, "\x80", 1);
+    mustsendbin(fd, Bput, 7, a, fmtput(a, 5, 0, 100, "hello"));
+    ckbin(fd, Sinserted, 7, 1, "");
+    mustsendbin(fd, Breserve, 8, "", 0);
+    ckbin(fd, Sreserved, 8, 1, "hello");
+    putbe(id, 1, 8);
+    mustsendbin(fd, Btouch, 9, id, 8);
+    ckbin(fd, Stouched, 9, 0, "");
+    mustsendbin(fd, Bdelete, 10, id, 8);
+    ckbin(fd, Sdeleted, 10, 0, "");
+    mustsendbin(fd, Bdelete, 11, id, 8);
+    ckbin(fd, Snotfound, 11, 0, "");
+    putbe(a, 0, 4);
+    mustsendbin(fd, Breservetimeout, 12, a, 4);
+    ckbin(fd, Stimedout, 12, 0, "");
+
+    mustsendbin(fd, Buse, 13, "foo", 3);
+    ckbin(fd, Susing, 13, 0, "");
+    mustsendbin(fd, Bwatch, 14, "foo", 3);
+    ckbin(fd, Swatching, 14, 2, "");
+    mustsendbin(fd, Bignore, 15, "default", 7);
+    ckbin(fd, Swatching, 15, 1, "");
+    mustsendbin(fd, Bignore, 15, "foo", 3);
+    ckbin(fd, Snotignored, 15, 0, "");
+    mustsendbin(fd, Bwatch, 15, "-foo", 4);
+    ckbin(fd, Sbadformat, 15, 0, "");
+    mustsendbin(fd, Bput, 16, a, fmtput(a, 0, 0, 100, ""));
+    ckbin(fd, Sinserted, 16, 2, "");
+    mustsendbin(fd, Breserve, 17, "", 0);
+    ckbin(fd, Sreserved, 17, 2, "");
+    putbe(a, 2, 8);
+    putbe(a + 8, 3, 4);
+    putbe(a + 12, 0, 4);
+    mustsendbin(fd, Brelease, 18, a, 16);
+    ckbin(fd, Sreleased, 18, 0, "");
+    mustsendbin(fd, Breserve, 19, "", 0);
+    ckbin(fd, Sreserved, 19, 2, "");
+    mustsendbin(fd, Bbury, 20, a, 12);
+    ckbin(fd, Sburied, 20, 0, "");
+
+    mustsendbin(fd, 99, 21, "", 0);
+    ckbin(fd, Sunknown, 21, 0, "");
+    mustsendbin(fd, Bdelete, 22, id, 4);
+    ckbin(fd, Sbadformat, 22, 0, "");
+    mustsendbin(fd, Bput, 23, a, 11);
+    ckbin(fd, Sbadformat, 23, 0, "");
+
+    // The body keeps its trailer for text clients.
+    int tfd = mustdiallocal(port);
+    mustsend(tfd, "peek 1\r\n");
+    ckresp(tfd, "NOT_FOUND\r\n");
+    mustsend(tfd, "peek 2\r\n");
+    ckresp(tfd, "FOUND 2 0\r\n");
+    ckresp(tfd, "\r\n");
+    mustsend(tfd, "use foo\r\n");
+    ckresp(tfd, "USING foo\r\n");
+    mustsend(tfd, "put 0 0 100 3\r\nabc\r\n");
+    ckresp(tfd, "INSERTED 3\r\n");
+    mustsendbin(fd, Breserve, 24, "", 0);
+    ckbin(fd, Sreserved, 24, 3, "abc");
+}
+
+void
+cttest_binary_pipeline()
+{
+    char buf[1024], a[400];
+    int n = 0;
+
+    job_data_size_limit = 10;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    // Requests sent at once get their replies in order.
+    buf[n++] = '\x80';
+    n += fmtbin(buf + n, Bput, 1, a, fmtput(a, 0, 0, 100, "a"));
+    n += fmtbin(buf + n, Bput, 2, a, fmtput(a, 0, 0, 100, "01234567890"));
+    memset(a, 0, 300);
+    n += fmtbin(buf + n, Bdelete, 3, a, 300);
+    n += fmtbin(buf + n, Bput, 4, a, fmtput(a, 0, 0, 100, "b"));
+    n += fmtbin(buf + n, Breserve, 5, "", 0);
+    writefull(fd, buf, n);
+    ckbin(fd, Sinserted, 1, 1, "");
+    ckbin(fd, Sjobtoobig, 2, 0, "");
+    ckbin(fd, Sbadformat, 3, 0, "");
+    ckbin(fd, Sinserted, 4, 2, "");
+    ckbin(fd, Sreserved, 5, 1, "a");
+}
+
+void
+cttest_underscore()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use x_y\r\n");
+    ckresp(fd, "USING x_y\r\n");
+}
+
+void
+cttest_2cmdpacket()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use a\r\nuse b\r\n");
+    ckresp(fd, "USING a\r\n");
+    ckresp(fd, "USING b\r\n");
+}
+
+void
+cttest_too_big()
+{
+    job_data_size_limit = 10;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 11\r\n");
+    mustsend(fd, "delete 9999\r\n");
+    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "JOB_TOO_BIG\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
+
+void
+cttest_job_size_invalid()
+{
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 4294967296\r\n");
+    mustsend(fd, "put 0 0 0 10b\r\n");
+    mustsend(fd, "put 0 0 0 --!@#$%^&&**()0b\r\n");
+    mustsend(fd, "put 0 0 0 1\r\n");
+    mustsend(fd, "x\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+}
+
+void
+cttest_job_size_max_plus_1()
+{
+    /* verify that server reject the job larger than maximum allowed. */
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 1073741825\r\n");
+
+    const int len = 1024*1024;
+    char body[len+1];
+    memset(body, 'a', len);
+    body[len] = 0;
+
+    int i;
+    for (i=0; i<JOB_DATA_SIZE_LIMIT_MAX; i+=len) {
+        mustsend(fd, body);
+    }
+    mustsend(fd, "x");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "JOB_TOO_BIG\r\n");
+}
+
+void
+cttest_delete_ready()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 0 0\r\n");
+    mustsend(fd, "\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+}
+
+void
+cttest_delete_reserved_by_other()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 1 1\r\n");
+    mustsend(fd, "a\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+
+    int o = mustdiallocal(port);
+    mustsend(o, "reserve\r\n");
+    ckresp(o, "RESERVED 1 1\r\n");
+    ckresp(o, "a\r\n");
+
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+void
+cttest_delete_bad_format()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "delete 18446744073709551616\r\n"); // UINT64_MAX+1
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete 184467440737095516160000000000000000000000000000\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete foo111\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+    mustsend(fd, "delete 111foo\r\n");
+    ckresp(fd, "BAD_FORMAT\r\n");
+}
+
+void
+cttest_multi_tube()
+{
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use abc\r\n");
+    ckresp(fd, "USING abc\r\n");
+    mustsend(fd, "put 999999 0 0 0\r\n");
+    mustsend(fd, "\r\n");
     ckresp(fd, "INSERTED 1\r\n");
     mustsend(fd, "use def\r\n");
     ckresp(fd, "USING def\r\n");
@@ -1554,6 +2516,274 @@ cttest_binlog_bury()
     ckresp(fd, "BURIED\r\n");
 }
 
+void
+cttest_binlog_updates()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 5 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 5 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 5 0 100 1\r\nc\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "bury 1 9\r\n");
+    ckresp(fd, "BURIED\r\n");
+    mustsend(fd, "kick 1\r\n");
+    ckresp(fd, "KICKED 1\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "release 2 6 3600\r\n");
+    ckresp(fd, "RELEASED\r\n");
+    mustsend(fd, "delete 3\r\n");
+    ckresp(fd, "DELETED\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\npri: 9\n");
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nreserves: 1\ntimeouts: 0\nreleases: 0\nburies: 1\nkicks: 1\n");
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: delayed\npri: 6\n");
+    mustsend(fd, "stats-job 2\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nreleases: 1\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+
+// Jobs in tubes with durability none are gone after a restart,
+// jobs in async tubes are not, and the settings are kept.
+void
+cttest_binlog_durability()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "durability-tube cache none\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "durability-tube log async\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "use cache\r\n");
+    ckresp(fd, "USING cache\r\n");
+    mustsend(fd, "put 0 0 100 1\r\na\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "use log\r\n");
+    ckresp(fd, "USING log\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "use default\r\n");
+    ckresp(fd, "USING default\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nc\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+
+    // Job 1 stays out of the binlog even now.
+    mustsend(fd, "durability-tube cache group\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "use cache\r\n");
+    ckresp(fd, "USING cache\r\n");
+    mustsend(fd, "durability-tube cache none\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nd\r\n");
+    ckresp(fd, "INSERTED 4\r\n");
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 4\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "FOUND 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "peek 3\r\n");
+    ckresp(fd, "FOUND 3 1\r\n");
+    ckresp(fd, "c\r\n");
+    mustsend(fd, "use cache\r\n");
+    ckresp(fd, "USING cache\r\n");
+    mustsend(fd, "stats-tube cache\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: none\n");
+    mustsend(fd, "stats-tube log\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ndurability: async\n");
+}
+
+void
+cttest_binlog_put_batch()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 2\r\n"
+                 "0 0 100 1\r\na\r\n"
+                 "0 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 2\r\n");
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "FOUND 2 1\r\n");
+    ckresp(fd, "b\r\n");
+}
+
+// A batch too big for one binlog file is written a part at a time.
+void
+cttest_binlog_put_batch_big()
+{
+    char buf[100*60], body[41];
+    int i, n;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 1024;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    memset(body, 'x', 40);
+    body[40] = '\0';
+    n = sprintf(buf, "put-batch 100\r\n");
+    for (i = 0; i < 100; i++) {
+        n += sprintf(buf+n, "0 0 100 40\r\n%s\r\n", body);
+    }
+    mustsend(fd, buf);
+    ckresp(fd, "INSERTED-BATCH 1 100\r\n");
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 100\n");
+    mustsend(fd, "peek 100\r\n");
+    ckresp(fd, "FOUND 100 40\r\n");
+}
+
+void
+cttest_binlog_delete_many()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-batch 3\r\n"
+                 "0 0 100 1\r\na\r\n"
+                 "0 0 100 1\r\nb\r\n"
+                 "0 0 100 1\r\nc\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 3\r\n");
+    mustsend(fd, "delete-many 5\r\n1 3-3\r\n");
+    ckresp(fd, "DELETED-MANY 2 0\r\n");
+    ckresp(fd, "\r\n");
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "FOUND 2 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "peek 3\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+// With several -b dirs, jobs are spread over them, and they are
+// all recovered, even after another dir has been added.
+void
+cttest_binlog_streams()
+{
+    char *dir[3];
+    int i, port, fd;
+
+    for (i = 0; i < 3; i++) {
+        dir[i] = fmtalloc("%s/%d", ctdir(), i);
+        mkdir(dir[i], 0700);
+    }
+    srv.wal.dir = dir[0];
+    srv.wal.use = 1;
+    srv.waldirs[1] = dir[1];
+    srv.nwal = 2;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    for (i = 0; i < 6; i++) {
+        mustsend(fd, "put 0 0 100 1\r\na\r\n");
+        ckrespsub(fd, "INSERTED ");
+    }
+    mustsend(fd, "delete 3\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 4\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 1 1\r\n");
+    ckresp(fd, "a\r\n");
+    mustsend(fd, "bury 1 0\r\n");
+    ckresp(fd, "BURIED\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbinlog-streams: 2\n");
+    kill_srvpid();
+
+    srv.waldirs[2] = dir[2];
+    srv.nwal = 3;
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-job 1\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: buried\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "stats-job 4\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "stats-job 6\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nstate: ready\n");
+
+    // Job 2 was written to the first dir, but would go to the
+    // third one now; its delete must follow it to the first.
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "put 0 0 100 1\r\nb\r\n");
+    ckresp(fd, "INSERTED 7\r\n");
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-job 2\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 7\r\n");
+    ckresp(fd, "FOUND 7 1\r\n");
+    ckresp(fd, "b\r\n");
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 3\n");
+}
+
+
 void
 cttest_binlog_basic()
 {
@@ -1569,51 +2799,196 @@ cttest_binlog_basic()
 
     kill_srvpid();
 
-    port = SERVER();
-    fd = mustdiallocal(port);
-    mustsend(fd, "delete 1\r\n");
-    ckresp(fd, "DELETED\r\n");
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+}
+
+void
+cttest_binlog_size_limit()
+{
+    int i = 0;
+    int gotsize;
+
+    size = 800;
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = size;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char *b2 = fmtalloc("%s/binlog.2", ctdir());
+    while (!exist(b2)) {
+        char *exp = fmtalloc("INSERTED %d\r\n", ++i);
+        mustsend(fd, "put 0 0 100 50\r\n");
+        mustsend(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+        ckresp(fd, exp);
+        free(exp);
+    }
+
+    char *b1 = fmtalloc("%s/binlog.1", ctdir());
+    gotsize = filesize(b1);
+    assertf(gotsize == size, "binlog.1 %d != %d", gotsize, size);
+    gotsize = filesize(b2);
+    assertf(gotsize == size, "binlog.2 %d != %d", gotsize, size);
+    free(b1);
+    free(b2);
+}
+
+void
+cttest_binlog_gc()
+{
+    int i = 0, n;
+
+    size = 800;
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = size;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    char *b1 = fmtalloc("%s/binlog.1", ctdir());
+    char *b2 = fmtalloc("%s/binlog.2", ctdir());
+    while (!exist(b2)) {
+        char *exp = fmtalloc("INSERTED %d\r\n", ++i);
+        mustsend(fd, "put 0 0 100 50\r\n");
+        mustsend(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+        ckresp(fd, exp);
+        free(exp);
+    }
+    for (n = 1; n <= i; n++) {
+        char *cmd = fmtalloc("delete %d\r\n", n);
+        mustsend(fd, cmd);
+        ckresp(fd, "DELETED\r\n");
+        free(cmd);
+    }
+
+    // binlog.1 is removed in the background.
+    for (n = 0; n < 1000; n++) {
+        mustsend(fd, "stats\r\n");
+        ckrespsub(fd, "OK ");
+        if (strstr(readline(fd), "\nbinlog-pending-unlinks: 0\n")) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(!exist(b1));
+    free(b1);
+    free(b2);
+}
+
+
+// ctxtswitches returns the number of times the main thread of process
+// pid has gone to sleep, or -1 if the system does not tell.
+static long
+ctxtswitches(int pid)
+{
+    char path[64], line[256];
+    long n = -1;
+    FILE *fp;
+
+    snprintf(path, sizeof path, "/proc/%d/status", pid);
+    fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof line, fp)) {
+        if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1)
+            break;
+    }
+    fclose(fp);
+    return n;
+}
+
+void
+cttest_binlog_compact_idle()
+{
+    long a, b;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    // One small job leaves the binlog mostly empty, but there is
+    // no older file to move it out of, so there is nothing to do.
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 1\r\nx\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    usleep(50000);
+
+    a = ctxtswitches(srvpid);
+    usleep(500000);
+    b = ctxtswitches(srvpid);
+    if (a >= 0 && b >= 0) {
+        assertf(b - a < 10, "idle server woke up %ld times", b - a);
+    }
+
+    mustsend(fd, "stats\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nbinlog-compaction-lag: 0.000\n");
 }
 
 void
-cttest_binlog_size_limit()
+cttest_binlog_compact()
 {
-    int i = 0;
-    int gotsize;
+    int i = 0, n;
+    char *line;
 
-    size = 4096;
+    size = 800;
     srv.wal.dir = ctdir();
     srv.wal.use = 1;
     srv.wal.filesize = size;
-    srv.wal.syncrate = 0;
-    srv.wal.wantsync = 1;
 
     int port = SERVER();
     int fd = mustdiallocal(port);
-    char *b2 = fmtalloc("%s/binlog.2", ctdir());
-    while (!exist(b2)) {
+    char *b3 = fmtalloc("%s/binlog.3", ctdir());
+    while (!exist(b3)) {
         char *exp = fmtalloc("INSERTED %d\r\n", ++i);
         mustsend(fd, "put 0 0 100 50\r\n");
         mustsend(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
         ckresp(fd, exp);
         free(exp);
     }
+    free(b3);
 
-    char *b1 = fmtalloc("%s/binlog.1", ctdir());
-    gotsize = filesize(b1);
-    assertf(gotsize == size, "binlog.1 %d != %d", gotsize, size);
-    gotsize = filesize(b2);
-    assertf(gotsize == size, "binlog.2 %d != %d", gotsize, size);
-    free(b1);
-    free(b2);
+    // Keep job 1 in binlog.1; compaction will have to move it.
+    for (n = 2; n <= i; n++) {
+        char *cmd = fmtalloc("delete %d\r\n", n);
+        mustsend(fd, cmd);
+        ckresp(fd, "DELETED\r\n");
+        free(cmd);
+    }
+
+    // Compaction runs in the background.
+    for (n = 0; n < 1000; n++) {
+        mustsend(fd, "stats\r\n");
+        ckrespsub(fd, "OK ");
+        line = readline(fd);
+        if (!strstr(line, "\nbinlog-oldest-index: 1\n")) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(!strstr(line, "\nbinlog-oldest-index: 1\n"));
+    assert(!strstr(line, "\nbinlog-bytes-migrated: 0\n"));
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
 }
 
+
 void
 cttest_binlog_allocation()
 {
     int i = 0;
 
-    size = 601;
+    size = 800;
     srv.wal.dir = ctdir();
     srv.wal.use = 1;
     srv.wal.filesize = size;
@@ -1683,10 +3058,196 @@ cttest_binlog_read()
     ckresp(fd, "NOT_FOUND\r\n");
 }
 
+void
+cttest_binlog_put_multi()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-multi a,b,c 0 0 120 4\r\ntest\r\n");
+    ckresp(fd, "INSERTED-BATCH 1 3\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "reserve-from b,c 0\r\n");
+    ckresp(fd, "RESERVED 2 4\r\n");
+    ckresp(fd, "test\r\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ntube: c\n");
+    mustsend(fd, "peek 3\r\n");
+    ckresp(fd, "FOUND 3 4\r\n");
+    ckresp(fd, "test\r\n");
+}
+
+void
+cttest_binlog_dedup()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 120 4 k1\r\ntest\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "put-in foo 0 0 120 4 k1\r\ntest\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 120 4 k1\r\ntest\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put-in foo 0 0 120 4 k1\r\ntest\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 120 4 k2\r\ntest\r\n");
+    ckresp(fd, "INSERTED 5\r\n");
+}
+
+void
+cttest_binlog_group()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put-group g 10 0 120 4\r\ntest\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put-group g 0 0 120 4\r\ntest\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "RESERVED 1 4\r\n");
+    ckresp(fd, "test\r\n");
+    mustsend(fd, "reserve-with-timeout 0\r\n");
+    ckresp(fd, "TIMED_OUT\r\n");
+}
+
+void
+cttest_binlog_expire()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 120 4\r\ntest\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "expire-tube default 500ms\r\n");
+    ckresp(fd, "UPDATED\r\n");
+    mustsend(fd, "put 0 0 120 4\r\ntest\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    usleep(600000);
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 4\r\n");
+    ckresp(fd, "test\r\n");
+
+    // The setting is stored too.
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\nexpire-ms: 500\n");
+}
+
+void
+cttest_binlog_pipelined()
+{
+    char buf[1024], *p = buf;
+    int i;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 1024;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+
+    // Send all commands at once, so the server handles
+    // many of them before the wal writer catches up.
+    for (i = 0; i < 40; i++) {
+        p += sprintf(p, "put 0 0 120 1\r\n%d\r\n", i % 10);
+    }
+    mustsend(fd, buf);
+    for (i = 1; i <= 40; i++) {
+        char exp[32];
+        sprintf(exp, "INSERTED %d\r\n", i);
+        ckresp(fd, exp);
+    }
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "stats-tube default\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 40\n");
+    mustsend(fd, "delete 40\r\n");
+    ckresp(fd, "DELETED\r\n");
+}
+
+
+void
+cttest_binlog_stale_spare()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    char *spare = fmtalloc("%s/spare.99", ctdir());
+    int sfd = open(spare, O_WRONLY|O_CREAT, 0400);
+    assert(sfd >= 0);
+    close(sfd);
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 120 4\r\n");
+    mustsend(fd, "test\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    assert(!exist(spare));
+    free(spare);
+
+    kill_srvpid();
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+}
+
+
 void
 cttest_binlog_disk_full()
 {
-    size = 1000;
+    size = 800;
     falloc = &wrapfalloc;
     fallocpat[0] = 1;
     fallocpat[2] = 1;
@@ -1750,7 +3311,7 @@ cttest_binlog_disk_full()
 void
 cttest_binlog_disk_full_delete()
 {
-    size = 1000;
+    size = 800;
     falloc = &wrapfalloc;
     fallocpat[0] = 1;
     fallocpat[1] = 1;
@@ -1794,27 +3355,182 @@ cttest_binlog_disk_full_delete()
     ckresp(fd, "OUT_OF_MEMORY\r\n");
 
     char *b1 = fmtalloc("%s/binlog.1", ctdir());
-    assert(exist(b1));
+    assert(exist(b1));
+    free(b1);
+
+    mustsend(fd, "delete 1\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 2\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 3\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 4\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 5\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 6\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 7\r\n");
+    ckresp(fd, "DELETED\r\n");
+    mustsend(fd, "delete 8\r\n");
+    ckresp(fd, "DELETED\r\n");
+}
+
+void
+cttest_binlog_bad_checksum()
+{
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "put 0 0 100 5\r\njob-1\r\n");
+    ckresp(fd, "INSERTED 1\r\n");
+    mustsend(fd, "put 0 0 100 5\r\njob-2\r\n");
+    ckresp(fd, "INSERTED 2\r\n");
+    mustsend(fd, "put 0 0 100 5\r\njob-3\r\n");
+    ckresp(fd, "INSERTED 3\r\n");
+    kill_srvpid();
+
+    // Flip a bit in the body of job 2.
+    char buf[4096], *p;
+    char *b1 = fmtalloc("%s/binlog.1", ctdir());
+    int bfd = open(b1, O_RDWR);
+    assert(bfd >= 0);
+    int n = read(bfd, buf, sizeof buf);
+    assert(n > 0);
+    for (p = buf; p + 5 <= buf + n && memcmp(p, "job-2", 5); p++);
+    assert(p + 5 <= buf + n);
+    p[4] ^= 1;
+    assert(pwrite(bfd, p, 5, p - buf) == 5);
+    close(bfd);
+    free(b1);
+
+    // Jobs from the bad record on are gone.
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "FOUND 1 5\r\n");
+    ckresp(fd, "job-1\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 3\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+}
+
+
+void
+cttest_binlog_snapshot()
+{
+    char *b1 = fmtalloc("%s/binlog.1", ctdir());
+    char body[101], *cmd;
+    int i;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 4096;
+    srv.wal.snapperiod = 10000000; // 10ms
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "use test\r\n");
+    ckresp(fd, "USING test\r\n");
+    mustsend(fd, "pause-tube test 3600\r\n");
+    ckresp(fd, "PAUSED\r\n");
+    memset(body, 'x', 100);
+    body[100] = '\0';
+    for (i = 1; i <= 100; i++) {
+        mustsend(fd, "put 0 0 100 100\r\n");
+        mustsend(fd, body);
+        mustsend(fd, "\r\n");
+        cmd = fmtalloc("INSERTED %d\r\n", i);
+        ckresp(fd, cmd);
+        free(cmd);
+    }
+    for (i = 1; i <= 100; i += 2) {
+        cmd = fmtalloc("delete %d\r\n", i);
+        mustsend(fd, cmd);
+        ckresp(fd, "DELETED\r\n");
+        free(cmd);
+    }
+
+    // binlog.1 still holds live jobs, but a snapshot
+    // makes it obsolete.
+    for (i = 0; i < 1000 && exist(b1); i++) {
+        usleep(10000);
+    }
+    assert(!exist(b1));
+
+    kill_srvpid();
+    srv.wal.snapperiod = 0;
+    port = SERVER();
+    fd = mustdiallocal(port);
+    mustsend(fd, "peek 1\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "peek 2\r\n");
+    ckresp(fd, "FOUND 2 100\r\n");
+    ckresp(fd, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+               "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\r\n");
+    mustsend(fd, "peek 99\r\n");
+    ckresp(fd, "NOT_FOUND\r\n");
+    mustsend(fd, "stats-tube test\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\ncurrent-jobs-ready: 50\n");
+    mustsend(fd, "stats-tube test\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npause: 3600\n");
+    free(b1);
+}
+
+
+void
+cttest_binlog_v7()
+{
+    int ver = 7, nl = 4;
+    Jobrec jr = {0};
+
+    // Write a version 7 binlog file by hand.
+    char *b1 = fmtalloc("%s/binlog.1", ctdir());
+    int bfd = open(b1, O_WRONLY|O_CREAT, 0600);
+    assert(bfd >= 0);
+    jr.id = 3;
+    jr.pri = 7;
+    jr.ttr = 120000000000LL;
+    jr.body_size = 6;
+    jr.state = Ready;
+    writefull(bfd, (char *)&ver, sizeof ver);
+    writefull(bfd, (char *)&nl, sizeof nl);
+    writefull(bfd, "test", nl);
+    writefull(bfd, (char *)&jr, sizeof jr);
+    writefull(bfd, "abcd\r\n", jr.body_size);
+    close(bfd);
     free(b1);
 
-    mustsend(fd, "delete 1\r\n");
-    ckresp(fd, "DELETED\r\n");
-    mustsend(fd, "delete 2\r\n");
-    ckresp(fd, "DELETED\r\n");
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+
+    int port = SERVER();
+    int fd = mustdiallocal(port);
+    mustsend(fd, "watch test\r\n");
+    ckresp(fd, "WATCHING 2\r\n");
+    mustsend(fd, "reserve\r\n");
+    ckresp(fd, "RESERVED 3 4\r\n");
+    ckresp(fd, "abcd\r\n");
+    mustsend(fd, "stats-job 3\r\n");
+    ckrespsub(fd, "OK ");
+    ckrespsub(fd, "\npri: 7\n");
+    mustsend(fd, "release 3 8 0\r\n");
+    ckresp(fd, "RELEASED\r\n");
+
+    // binlog.1 is still needed, and read again, after a restart.
+    kill_srvpid();
+    port = SERVER();
+    fd = mustdiallocal(port);
     mustsend(fd, "delete 3\r\n");
     ckresp(fd, "DELETED\r\n");
-    mustsend(fd, "delete 4\r\n");
-    ckresp(fd, "DELETED\r\n");
-    mustsend(fd, "delete 5\r\n");
-    ckresp(fd, "DELETED\r\n");
-    mustsend(fd, "delete 6\r\n");
-    ckresp(fd, "DELETED\r\n");
-    mustsend(fd, "delete 7\r\n");
-    ckresp(fd, "DELETED\r\n");
-    mustsend(fd, "delete 8\r\n");
-    ckresp(fd, "DELETED\r\n");
 }
 
+
 void
 cttest_binlog_v5()
 {
@@ -2021,6 +3737,327 @@ bench_put_delete_size(int n, int size, int walsize, int sync, int64 syncrate_ms)
     ctstoptimer();
 }
 
+// bench_put_batch puts n jobs of 8 bytes, batch jobs per round
+// trip with put-batch, or with put if batch is 1.
+static void
+bench_put_batch(int n, int batch)
+{
+    static const char job[] = "0 0 100 8\r\nabcdefgh\r\n";
+    char buf[50 + 100 * sizeof job];
+    int i, k, m, x, port, fd;
+
+    assert(batch <= 100);
+    port = SERVER();
+    fd = mustdiallocal(port);
+    ctresettimer();
+    for (i = 0; i < n; i += m) {
+        m = min(batch, n - i);
+        if (batch == 1) {
+            mustsend(fd, "put 0 0 100 8\r\nabcdefgh\r\n");
+            ckrespsub(fd, "INSERTED ");
+            continue;
+        }
+        k = sprintf(buf, "put-batch %d\r\n", m);
+        for (x = 0; x < m; x++) {
+            k += sprintf(buf + k, "%s", job);
+        }
+        mustsend(fd, buf);
+        ckrespsub(fd, "INSERTED-BATCH ");
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_put_0008(int n)
+{
+    bench_put_batch(n, 1);
+}
+
+void
+ctbench_put_batch_100_0008(int n)
+{
+    bench_put_batch(n, 100);
+}
+
+void
+ctbench_put_dedup_0008(int n)
+{
+    char buf[60];
+    int i, port, fd;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        sprintf(buf, "put 0 0 100 8 key-%d\r\nabcdefgh\r\n", i);
+        mustsend(fd, buf);
+        ckrespsub(fd, "INSERTED ");
+    }
+    ctstoptimer();
+}
+
+// bench_reserve_batch reserves n jobs of 8 bytes, batch jobs per
+// round trip with reserve-batch, or with reserve if batch is 1.
+static void
+bench_reserve_batch(int n, int batch)
+{
+    char buf[30];
+    int i, k, m, port, fd;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    for (i = 0; i < n; i++) {
+        mustsend(fd, "put 0 0 100 8\r\nabcdefgh\r\n");
+        ckrespsub(fd, "INSERTED ");
+    }
+    ctresettimer();
+    for (i = 0; i < n; i += m) {
+        m = min(batch, n - i);
+        if (batch == 1) {
+            mustsend(fd, "reserve\r\n");
+            ckrespsub(fd, "RESERVED ");
+            ckresp(fd, "abcdefgh\r\n");
+            continue;
+        }
+        sprintf(buf, "reserve-batch %d 0\r\n", m);
+        mustsend(fd, buf);
+        ckrespsub(fd, "RESERVED-BATCH ");
+        for (k = 0; k < m; k++) {
+            ckrespsub(fd, " 8\r\n");
+            ckresp(fd, "abcdefgh\r\n");
+        }
+        ckresp(fd, "\r\n");
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_reserve_0008(int n)
+{
+    bench_reserve_batch(n, 1);
+}
+
+void
+ctbench_reserve_batch_100_0008(int n)
+{
+    bench_reserve_batch(n, 100);
+}
+
+// bench_put_push puts n jobs of 8 bytes, one at a time, and has a
+// worker take and delete each of them, with a reserve command, or
+// with a subscribed conn if push is set.
+static void
+bench_put_push(int n, int push)
+{
+    char buf[30];
+    int i, port, prod, cons;
+
+    port = SERVER();
+    prod = mustdiallocal(port);
+    cons = mustdiallocal(port);
+    if (push) {
+        mustsend(cons, "subscribe 1\r\n");
+        ckresp(cons, "SUBSCRIBED\r\n");
+    }
+    ctresettimer();
+    for (i = 1; i <= n; i++) {
+        if (!push) {
+            mustsend(cons, "reserve\r\n");
+        }
+        mustsend(prod, "put 0 0 100 8\r\nabcdefgh\r\n");
+        ckrespsub(prod, "INSERTED ");
+        ckrespsub(cons, "RESERVED ");
+        ckresp(cons, "abcdefgh\r\n");
+        sprintf(buf, "delete %d\r\n", i);
+        mustsend(cons, buf);
+        ckresp(cons, "DELETED\r\n");
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_put_reserve_delete_0008(int n)
+{
+    bench_put_push(n, 0);
+}
+
+void
+ctbench_put_subscribe_delete_0008(int n)
+{
+    bench_put_push(n, 1);
+}
+
+// bench_pipeline puts, reserves and deletes n jobs of 8 bytes,
+// sending the three requests for a job in one write,
+// in the text protocol or, if bin is set, the binary one.
+static void
+bench_pipeline(int n, int bin)
+{
+    char buf[200], a[30];
+    int i, k, port, fd;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    if (bin) {
+        writefull(fd, "\x80", 1);
+    }
+    ctresettimer();
+    for (i = 1; i <= n; i++) {
+        if (!bin) {
+            sprintf(buf, "put 0 0 100 8\r\nabcdefgh\r\n"
+                         "reserve\r\ndelete %d\r\n", i);
+            mustsend(fd, buf);
+            ckrespsub(fd, "INSERTED ");
+            ckrespsub(fd, "RESERVED ");
+            ckresp(fd, "abcdefgh\r\n");
+            ckresp(fd, "DELETED\r\n");
+            continue;
+        }
+        k = fmtbin(buf, Bput, 1, a, fmtput(a, 0, 0, 100, "abcdefgh"));
+        k += fmtbin(buf + k, Breserve, 2, "", 0);
+        putbe(a, i, 8);
+        k += fmtbin(buf + k, Bdelete, 3, a, 8);
+        writefull(fd, buf, k);
+        ckbin(fd, Sinserted, 1, i, "");
+        ckbin(fd, Sreserved, 2, i, "abcdefgh");
+        ckbin(fd, Sdeleted, 3, 0, "");
+    }
+    ctstoptimer();
+}
+
+// bench_put_tubes puts n jobs of 8 bytes, spread over 100 tubes,
+// each with use and put, or with put-in if in is set.
+static void
+bench_put_tubes(int n, int in)
+{
+    char buf[60];
+    int i, port, fd;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        if (in) {
+            sprintf(buf, "put-in t%d 0 0 100 8\r\nabcdefgh\r\n", i%100);
+            mustsend(fd, buf);
+            ckrespsub(fd, "INSERTED ");
+            continue;
+        }
+        sprintf(buf, "use t%d\r\n", i%100);
+        mustsend(fd, buf);
+        ckrespsub(fd, "USING ");
+        mustsend(fd, "put 0 0 100 8\r\nabcdefgh\r\n");
+        ckrespsub(fd, "INSERTED ");
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_use_put_100_tubes_0008(int n)
+{
+    bench_put_tubes(n, 0);
+}
+
+void
+ctbench_put_in_100_tubes_0008(int n)
+{
+    bench_put_tubes(n, 1);
+}
+
+static void
+bench_prot_which(int n, char *line)
+{
+    int i;
+
+    prot_init();
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        prot_which(line);
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_prot_which_put(int n)
+{
+    bench_prot_which(n, "put 0 0 100 8");
+}
+
+void
+ctbench_prot_which_reserve_with_timeout(int n)
+{
+    bench_prot_which(n, "reserve-with-timeout 0");
+}
+
+void
+ctbench_prot_which_subscribe(int n)
+{
+    bench_prot_which(n, "subscribe 1");
+}
+
+void
+ctbench_prot_which_unknown(int n)
+{
+    bench_prot_which(n, "nont10knowncommand");
+}
+
+void
+ctbench_pipeline_text_0008(int n)
+{
+    bench_pipeline(n, 0);
+}
+
+void
+ctbench_pipeline_bin_0008(int n)
+{
+    bench_pipeline(n, 1);
+}
+
+// bench_delete_many deletes n jobs of 8 bytes, batch jobs per
+// round trip with delete-many, or with delete if batch is 1.
+static void
+bench_delete_many(int n, int batch)
+{
+    char buf[30], ids[30];
+    int i, k, m, port, fd;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    for (i = 0; i < n; i++) {
+        mustsend(fd, "put 0 0 100 8\r\nabcdefgh\r\n");
+        ckrespsub(fd, "INSERTED ");
+    }
+    ctresettimer();
+    for (i = 1; i <= n; i += m) {
+        m = min(batch, n - i + 1);
+        if (batch == 1) {
+            sprintf(buf, "delete %d\r\n", i);
+            mustsend(fd, buf);
+            ckresp(fd, "DELETED\r\n");
+            continue;
+        }
+        k = sprintf(ids, "%d-%d\r\n", i, i + m - 1);
+        sprintf(buf, "delete-many %d\r\n", k - 2);
+        mustsend(fd, buf);
+        mustsend(fd, ids);
+        ckrespsub(fd, "DELETED-MANY ");
+        ckresp(fd, "\r\n");
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_delete_0008(int n)
+{
+    bench_delete_many(n, 1);
+}
+
+void
+ctbench_delete_many_100_0008(int n)
+{
+    bench_delete_many(n, 100);
+}
+
 void
 ctbench_put_delete_0008(int n)
 {
@@ -2069,6 +4106,115 @@ ctbench_put_delete_wal_1024_no_fsync(int n)
     bench_put_delete_size(n, 1024, 512000, 0, 0);
 }
 
+void
+ctbench_put_delete_wal_65536_no_fsync(int n)
+{
+    bench_put_delete_size(n, 65536, 10240000, 0, 0);
+}
+
+// ctbench_binlog_replay measures server startup with 64MB of
+// jobs in the binlog, spread over 16 files. Startup time grows
+// linearly with the size of the binlog: for 20GB, it is about
+// 20000 divided by the reported MB/s, in seconds.
+void
+ctbench_binlog_replay(int n)
+{
+    enum { Size = 16384, Njob = 4096 };
+    char put[50], body[Size+3];
+    int i, port, fd;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.filesize = 4 << 20;
+    srv.wal.wantsync = 0;
+    job_data_size_limit = JOB_DATA_SIZE_LIMIT_MAX;
+
+    port = SERVER();
+    fd = mustdiallocal(port);
+    memset(body, 'a', Size);
+    memcpy(body + Size, "\r\n", 3);
+    sprintf(put, "put 0 0 0 %d\r\n", Size);
+    for (i = 0; i < Njob; i++) {
+        mustsend(fd, put);
+        mustsend(fd, body);
+        ckrespsub(fd, "INSERTED ");
+    }
+    close(fd);
+    kill_srvpid();
+
+    ctsetbytes(Size * Njob);
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        port = SERVER();
+        fd = mustdiallocal(port);
+        mustsend(fd, "stats-job 4096\r\n");
+        ckrespsub(fd, "OK ");
+        close(fd);
+        kill_srvpid();
+        close(srv.sock.fd);
+    }
+    ctstoptimer();
+}
+
+// bench_put_streams measures put throughput with an fsync after
+// every write (-f0) and the binlog striped over nstream dirs.
+// Several conns put at once, so that each stream has work to do.
+static void
+bench_put_streams(int n, int nstream)
+{
+    enum { Nconn = 16, Size = 1024 };
+    char put[50], body[Size+3];
+    int fd[Nconn], i, k, port;
+
+    srv.wal.dir = ctdir();
+    srv.wal.use = 1;
+    srv.wal.syncrate = 0;
+    srv.wal.wantsync = 1;
+    for (i = 1; i < nstream; i++) {
+        srv.waldirs[i] = fmtalloc("%s/%d", ctdir(), i);
+        mkdir(srv.waldirs[i], 0700);
+    }
+    srv.nwal = nstream;
+
+    port = SERVER();
+    for (k = 0; k < Nconn; k++) {
+        fd[k] = mustdiallocal(port);
+    }
+    memset(body, 'a', Size);
+    memcpy(body + Size, "\r\n", 3);
+    sprintf(put, "put 0 0 0 %d\r\n", Size);
+    ctsetbytes(Size);
+    ctresettimer();
+    for (i = 0; i < n; i += Nconn) {
+        for (k = 0; k < Nconn && i + k < n; k++) {
+            mustsend(fd[k], put);
+            mustsend(fd[k], body);
+        }
+        for (k = 0; k < Nconn && i + k < n; k++) {
+            ckrespsub(fd[k], "INSERTED ");
+        }
+    }
+    ctstoptimer();
+}
+
+void
+ctbench_put_wal_fsync_000ms_1_stream(int n)
+{
+    bench_put_streams(n, 1);
+}
+
+void
+ctbench_put_wal_fsync_000ms_2_streams(int n)
+{
+    bench_put_streams(n, 2);
+}
+
+void
+ctbench_put_wal_fsync_000ms_4_streams(int n)
+{
+    bench_put_streams(n, 4);
+}
+
 void
 ctbench_put_delete_wal_8192_fsync_000ms(int n)
 {
@@ -1,6 +1,7 @@
 #include "ct/ct.h"
 #include "dat.h"
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -30,6 +31,9 @@ cttest_opt_none()
     assert(job_data_size_limit == JOB_DATA_SIZE_LIMIT_DEFAULT);
     assert(srv.wal.filesize == Filesizedef);
     assert(srv.wal.wantsync == 0);
+    assert(srv.wal.cbytes == Compactbytesdef);
+    assert(srv.wal.ctime == Compacttimedef);
+    assert(srv.wal.snapperiod == 0);
     assert(srv.user == NULL);
     assert(srv.wal.dir == NULL);
     assert(srv.wal.use == 0);
@@ -141,6 +145,42 @@ cttest_optf()
     assert(srv.wal.wantsync == 1);
 }
 
+void
+cttest_optk()
+{
+    char *args[] = {
+        "-k1234",
+        NULL,
+    };
+
+    optparse(&srv, args);
+    assert(srv.wal.cbytes == 1234);
+}
+
+void
+cttest_optK()
+{
+    char *args[] = {
+        "-K12",
+        NULL,
+    };
+
+    optparse(&srv, args);
+    assert(srv.wal.ctime == 12000000);
+}
+
+void
+cttest_optS()
+{
+    char *args[] = {
+        "-S", "30",
+        NULL,
+    };
+
+    optparse(&srv, args);
+    assert(srv.wal.snapperiod == 30000000000LL);
+}
+
 void
 cttest_optF()
 {
@@ -177,6 +217,24 @@ cttest_optb()
     optparse(&srv, args);
     assert(strcmp(srv.wal.dir, "foo") == 0);
     assert(srv.wal.use == 1);
+    assert(srv.nwal == 1);
+}
+
+void
+cttest_optb_b()
+{
+    char *args[] = {
+        "-bfoo",
+        "-b",
+        "bar",
+        NULL,
+    };
+
+    optparse(&srv, args);
+    assert(strcmp(srv.wal.dir, "foo") == 0);
+    assert(srv.nwal == 2);
+    assert(strcmp(srv.waldirs[1], "bar") == 0);
+    assert(srv.wal.use == 1);
 }
 
 void
@@ -229,3 +287,136 @@ cttest_optVFVu()
     assert(srv.wal.wantsync == 0);
     assert(strcmp(srv.user, "kr") == 0);
 }
+
+void
+cttest_crc32c()
+{
+    char buf[1000];
+    int i, k;
+
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(crc32csw(0, "123456789", 9) == 0xe3069283);
+    assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+    // All alignments and lengths must agree with the portable code.
+    for (i = 0; i < (int)sizeof buf; i++) {
+        buf[i] = i * 7 + (i >> 3);
+    }
+    for (i = 0; i < 16; i++) {
+        for (k = 0; k < 100; k++) {
+            assert(crc32c(0, buf+i, k) == crc32csw(0, buf+i, k));
+        }
+        assert(crc32c(0, buf+i, 900) == crc32csw(0, buf+i, 900));
+    }
+}
+
+static void
+bench_crc32c(int n, Crc32c *f, int size)
+{
+    int i;
+    char *buf = malloc(size);
+
+    assert(buf);
+    memset(buf, 'a', size);
+    ctsetbytes(size);
+    ctresettimer();
+    for (i = 0; i < n; i++) {
+        f(0, buf, size);
+    }
+    ctstoptimer();
+    free(buf);
+}
+
+void
+ctbench_crc32c_1024(int n)
+{
+    bench_crc32c(n, crc32c, 1024);
+}
+
+void
+ctbench_crc32c_65536(int n)
+{
+    bench_crc32c(n, crc32c, 65536);
+}
+
+void
+ctbench_crc32csw_65536(int n)
+{
+    bench_crc32c(n, crc32csw, 65536);
+}
+
+void
+cttest_scanu64()
+{
+    uint64 n = 7;
+
+    assert(scanu64(&n, "0") == 1 && n == 0);
+    assert(scanu64(&n, "123 4") == 3 && n == 123);
+    assert(scanu64(&n, "18446744073709551615x") == 20);
+    assert(n == UINT64_MAX);
+    n = 7;
+    assert(scanu64(&n, "18446744073709551616") == 0 && n == 7);
+    assert(scanu64(&n, "99999999999999999999") == 0 && n == 7);
+    assert(scanu64(&n, "") == 0 && n == 7);
+    assert(scanu64(&n, " 1") == 0 && n == 7);
+    assert(scanu64(&n, "-1") == 0 && n == 7);
+}
+
+void
+cttest_fmtu64()
+{
+    char buf[21];
+    uint64 v[] = {0, 9, 10, 123456789, UINT64_MAX};
+    int i, k;
+
+    for (i = 0; i < (int)(sizeof v / sizeof *v); i++) {
+        char exp[21];
+        sprintf(exp, "%"PRIu64, v[i]);
+        k = fmtu64(buf, v[i]);
+        buf[k] = '\0';
+        assert(strcmp(buf, exp) == 0);
+    }
+}
+
+void
+ctbench_scanu64(int n)
+{
+    uint64 v;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        scanu64(&v, "1234567890");
+    }
+}
+
+void
+ctbench_strtoull(int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        strtoull("1234567890", NULL, 10);
+    }
+}
+
+void
+ctbench_fmtu64(int n)
+{
+    char buf[20];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        fmtu64(buf, 1234567890 + i);
+    }
+}
+
+void
+ctbench_snprintf_u64(int n)
+{
+    char buf[21];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        snprintf(buf, sizeof buf, "%"PRIu64, (uint64)1234567890 + i);
+    }
+}
@@ -4,6 +4,14 @@
 #include <string.h>
 
 struct Ms tubes;
+struct Ms tubedurs;
+struct Ms tubettls;
+
+const char *durnames[] = {
+    [Durgroup] = "group",
+    [Durasync] = "async",
+    [Durnone]  = "none",
+};
 
 Tube *
 make_tube(const char *name)
@@ -22,11 +30,15 @@ make_tube(const char *name)
     t->delay.less = job_delay_less;
     t->ready.setpos = job_setpos;
     t->delay.setpos = job_setpos;
+    t->expiring.less = job_expire_less;
+    t->expiring.setpos = job_expire_setpos;
 
     Job j = {.tube = NULL};
     t->buried = j;
     t->buried.prev = t->buried.next = &t->buried;
     ms_init(&t->waiting_conns, NULL, NULL);
+    t->durability = tube_durability(t->name);
+    t->expire = tube_expire(t->name);
 
     return t;
 }
@@ -37,6 +49,7 @@ tube_free(Tube *t)
     ms_remove(&tubes, t);
     free(t->ready.data);
     free(t->delay.data);
+    free(t->expiring.data);
     ms_clear(&t->waiting_conns);
     free(t);
 }
@@ -103,3 +116,126 @@ tube_find_or_make(const char *name)
     return make_and_insert_tube(name);
 }
 
+
+// durparse returns the durability class called name,
+// or -1 if there is none.
+int
+durparse(const char *name)
+{
+    int i;
+
+    for (i = Durgroup; i <= Durnone; i++) {
+        if (strcmp(name, durnames[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static Tubedur *
+find_tubedur(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < tubedurs.len; i++) {
+        Tubedur *d = tubedurs.items[i];
+        if (strncmp(d->name, name, MAX_TUBE_NAME_LEN) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+// tube_durability returns the durability class of tube name.
+int
+tube_durability(const char *name)
+{
+    Tubedur *d = find_tubedur(name);
+    return d ? d->dur : Durgroup;
+}
+
+// tube_set_durability sets the durability class of tube name,
+// whether or not the tube exists. Jobs already in the tube keep
+// going to the binlog, or not, as they did when they were put.
+// Returns 1 on success, or 0 if out of memory.
+int
+tube_set_durability(const char *name, int dur)
+{
+    Tubedur *d = find_tubedur(name);
+    Tube *t;
+
+    if (!d && dur != Durgroup) {
+        d = new(Tubedur);
+        if (!d)
+            return 0;
+        strncpy(d->name, name, MAX_TUBE_NAME_LEN - 1);
+        if (!ms_append(&tubedurs, d)) {
+            free(d);
+            return 0;
+        }
+    }
+    if (d && dur == Durgroup) {
+        ms_remove(&tubedurs, d);
+        free(d);
+    } else if (d) {
+        d->dur = dur;
+    }
+
+    t = tube_find(name);
+    if (t)
+        t->durability = dur;
+    return 1;
+}
+
+static Tubettl *
+find_tubettl(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < tubettls.len; i++) {
+        Tubettl *l = tubettls.items[i];
+        if (strncmp(l->name, name, MAX_TUBE_NAME_LEN) == 0)
+            return l;
+    }
+    return NULL;
+}
+
+// tube_expire returns the time to live of new jobs in tube name,
+// in nanoseconds, or 0 if they do not expire.
+int64
+tube_expire(const char *name)
+{
+    Tubettl *l = find_tubettl(name);
+    return l ? l->expire : 0;
+}
+
+// tube_set_expire sets the time to live of new jobs in tube name,
+// whether or not the tube exists. Jobs already in the tube keep the
+// time to live they were put with.
+// Returns 1 on success, or 0 if out of memory.
+int
+tube_set_expire(const char *name, int64 expire)
+{
+    Tubettl *l = find_tubettl(name);
+    Tube *t;
+
+    if (!l && expire) {
+        l = new(Tubettl);
+        if (!l)
+            return 0;
+        strncpy(l->name, name, MAX_TUBE_NAME_LEN - 1);
+        if (!ms_append(&tubettls, l)) {
+            free(l);
+            return 0;
+        }
+    }
+    if (l && !expire) {
+        ms_remove(&tubettls, l);
+        free(l);
+    } else if (l) {
+        l->expire = expire;
+    }
+
+    t = tube_find(name);
+    if (t)
+        t->expire = expire;
+    return 1;
+}
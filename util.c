@@ -83,6 +83,52 @@ zalloc(int n)
 }
 
 
+// Scanu64 reads the decimal digits at the start of s into *n and
+// returns how many there were. It returns 0, leaving *n alone, if
+// s does not start with a digit or the number does not fit in uint64.
+// Unlike strtoull it takes no sign or leading space, which the
+// protocol has no use for.
+int
+scanu64(uint64 *n, const char *s)
+{
+    uint64 v = 0;
+    int i;
+
+    for (i = 0; s[i] >= '0' && s[i] <= '9'; i++) {
+        uint d = s[i] - '0';
+
+        // Only the 20th digit and on can overflow.
+        if (i >= 19 && (v > UINT64_MAX/10 ||
+                        (v == UINT64_MAX/10 && d > UINT64_MAX%10))) {
+            return 0;
+        }
+        v = v*10 + d;
+    }
+    if (i) {
+        *n = v;
+    }
+    return i;
+}
+
+
+// Fmtu64 writes n in decimal to buf, which must have room for
+// 20 bytes, and returns the number of bytes written.
+// It does not write a terminating NUL.
+int
+fmtu64(char *buf, uint64 n)
+{
+    char tmp[20];
+    int i = sizeof tmp;
+
+    do {
+        tmp[--i] = '0' + n%10;
+        n /= 10;
+    } while (n);
+    memcpy(buf, tmp + i, sizeof tmp - i);
+    return sizeof tmp - i;
+}
+
+
 static void
 warn_systemd_ignored_option(char *opt, char *arg)
 {
@@ -99,20 +145,35 @@ usage(int code)
     fprintf(stderr, "Use: %s [OPTIONS]\n"
             "\n"
             "Options:\n"
-            " -b DIR   write-ahead log directory\n"
+            " -b DIR   write-ahead log directory"
+                       " (repeat to stripe the log over several)\n"
+            " -d SECS  remember put dedup keys for SECS seconds"
+                       " (default is %d)\n"
+            " -D N     remember at most N put dedup keys"
+                       " (default is %d, use -D0 to ignore them)\n"
             " -f MS    fsync at most once every MS milliseconds"
                        " (use -f0 for \"always fsync\")\n"
             " -F       never fsync (default)\n"
+            " -k BYTES compact at most BYTES of the write-ahead log per tick"
+                       " (default is %d)\n"
+            " -K MS    compact the write-ahead log for at most MS milliseconds"
+                       " per tick (default is %d)\n"
             " -l ADDR  listen on address (default is 0.0.0.0)\n"
             " -p PORT  listen on port (default is " Portdef ")\n"
             " -u USER  become user and group\n"
             " -z BYTES set the maximum job size in bytes (default is %d, max allowed is %d)\n"
             " -s BYTES set the size of each write-ahead log file (default is %d)\n"
             "            (will be rounded up to a multiple of 4096 bytes)\n"
+            " -S SECS  snapshot the write-ahead log every SECS seconds"
+                       " (default is 0, never)\n"
             " -v       show version information\n"
             " -V       increase verbosity\n"
             " -h       show this help\n",
             progname,
+            (int)(Dedupwindowdef / 1000000000),
+            Dedupmaxdef,
+            Compactbytesdef,
+            Compacttimedef / 1000000,
             JOB_DATA_SIZE_LIMIT_DEFAULT,
             JOB_DATA_SIZE_LIMIT_MAX,
             Filesizedef);
@@ -173,6 +234,10 @@ optparse(Server *s, char **argv)
                 case 's':
                     s->wal.filesize = parse_size_t(EARGF(flagusage("-s")));
                     break;
+                case 'S':
+                    ms = (int64)parse_size_t(EARGF(flagusage("-S"))) * 1000;
+                    s->wal.snapperiod = ms * 1000000;
+                    break;
                 case 'c':
                     warnx("-c flag was removed. binlog is always compacted.");
                     break;
@@ -187,11 +252,30 @@ optparse(Server *s, char **argv)
                 case 'F':
                     s->wal.wantsync = 0;
                     break;
+                case 'k':
+                    s->wal.cbytes = parse_size_t(EARGF(flagusage("-k")));
+                    break;
+                case 'K':
+                    ms = (int64)parse_size_t(EARGF(flagusage("-K")));
+                    s->wal.ctime = ms * 1000000;
+                    break;
                 case 'u':
                     s->user = EARGF(flagusage("-u"));
                     break;
+                case 'd':
+                    ms = (int64)parse_size_t(EARGF(flagusage("-d"))) * 1000;
+                    dedup_window = ms * 1000000;
+                    break;
+                case 'D':
+                    dedup_max = parse_size_t(EARGF(flagusage("-D")));
+                    break;
                 case 'b':
-                    s->wal.dir = EARGF(flagusage("-b"));
+                    if (s->nwal == Walstreams) {
+                        warnx("too many binlog dirs, max %d", Walstreams);
+                        usage(5);
+                    }
+                    s->waldirs[s->nwal++] = EARGF(flagusage("-b"));
+                    s->wal.dir = s->waldirs[0];
                     s->wal.use = 1;
                     break;
                 case 'h':
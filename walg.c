@@ -1,5 +1,6 @@
 #include "dat.h"
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -10,6 +11,7 @@
 #include <sys/uio.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <pthread.h>
 
 static int reserve(Wal *w, int n);
 
@@ -63,8 +65,18 @@ walgc(Wal *w)
         }
 
         w->nfile--;
-        unlink(f->path);
-        free(f->path);
+        if (f->gone) {
+            free(f->path);
+        } else if (f->snap) {
+            free(f->path);
+            walsnapdrop(w);
+        } else {
+            // The snapshot needs every file from w->snapseq on.
+            if (w->snapseq && f->seq >= w->snapseq) {
+                walsnapdrop(w);
+            }
+            walhkunlink(w, f->path);
+        }
         free(f);
     }
 }
@@ -100,78 +112,89 @@ ratio(Wal *w)
 }
 
 
-// Returns the number of bytes reserved or 0 on error.
+// canmove returns nonzero if movebatch can migrate jobs: only out
+// of a file older than the one before the current file, since that
+// one and the current file stay anyway.
 static int
-walresvmigrate(Wal *w, Job *j)
+canmove(Wal *w)
 {
-    int z = 0;
-
-    // reserve only space for the migrated full job record
-    // space for the delete is already reserved
-    z += sizeof(int);
-    z += strlen(j->tube->name);
-    z += sizeof(Jobrec);
-    z += j->r.body_size;
-
-    return reserve(w, z);
+    return w->head != w->cur && w->head->next != w->cur;
 }
 
 
-static void
-moveone(Wal *w)
+// movebatch migrates jobs from the head file to the current file,
+// at most max bytes of them, but always at least one job.
+// Space for all of them is reserved at once; space for their
+// deletes is already reserved.
+// Returns the number of bytes migrated, or 0 if nothing was moved.
+static int
+movebatch(Wal *w, int max)
 {
+    File *f = w->head;
     Job *j;
+    int n = 0, z = 0;
 
-    if (w->head == w->cur || w->head->next == w->cur) {
+    if (!canmove(w)) {
         // no point in moving a job
-        return;
+        return 0;
     }
 
-    j = w->head->jlist.fnext;
-    if (!j || j == &w->head->jlist) {
+    // A batch must fit in one file along with
+    // whatever is already reserved there.
+    max = min(max, w->filesize / 2);
+    for (j = f->jlist.fnext; j && j != &f->jlist; j = j->fnext) {
+        int r = filefullmax(j);
+        if (n && z + r > max) break;
+        z += r;
+        n++;
+    }
+    if (!n) {
         // head holds no jlist; can't happen
         twarnx("head holds no jlist");
-        return;
+        return 0;
     }
 
-    if (!walresvmigrate(w, j)) {
+    if (!reserve(w, z)) {
         // it will not fit, so we'll try again later
-        return;
+        return 0;
     }
 
-    filermjob(w->head, j);
-    w->nmig++;
-    walwrite(w, j);
-}
-
-
-static void
-walcompact(Wal *w)
-{
-    int r;
-
-    for (r=ratio(w); r>=2; r--) {
-        moveone(w);
+    // Removing the last job from f may free f.
+    while (n--) {
+        j = f->jlist.fnext;
+        filermjob(f, j);
+        w->nmig++;
+        walwrite(w, j);
     }
+    w->nmigbytes += z;
+    return z;
 }
 
 
+// walcompact migrates live jobs out of the oldest files
+// until the binlog is compact enough, or the budget for
+// this tick (w->cbytes bytes, w->ctime nanoseconds) runs out.
 static void
-walsync(Wal *w)
+walcompact(Wal *w, int64 now)
 {
-    int64 now;
+    int64 budget = w->cbytes;
+    int64 deadline = now + w->ctime;
+    int n;
 
-    now = nanoseconds();
-    if (w->wantsync && now >= w->lastsync+w->syncrate) {
-        w->lastsync = now;
-        if (fsync(w->cur->fd) == -1) {
-            twarn("fsync");
-        }
+    while (w->use && budget > 0 && ratio(w) >= 2) {
+        n = movebatch(w, min(budget, INT_MAX));
+        if (!n) break;
+        budget -= n;
+        if (nanoseconds() >= deadline) break;
     }
 }
 
 
 // Walwrite writes j to the log w (if w is enabled).
+// The record is handed to the writer thread (see walio.c) at the end
+// of the current loop iteration; use walqwait to wait until it is on disk.
+// If j was put with durability Durgroup, w->syncpos tells that a reply
+// should wait for that.
 // On failure, walwrite disables w and returns 0; on success, it returns 1.
 // Unlke walresv*, walwrite should never fail because of a full disk.
 // If w is disabled, then walwrite takes no action and returns 1.
@@ -192,18 +215,60 @@ walwrite(Wal *w, Job *j)
         filewclose(w->cur);
         w->use = 0;
     }
+    if (j->dur == Durgroup) {
+        w->syncpos = walqpos(w);
+    }
     w->nrec++;
     return r;
 }
 
 
-void
-walmaint(Wal *w)
+// compactmaint runs a compaction tick if one is due.
+// Returns the number of nanoseconds until it wants to be
+// called again, or 0 if there is nothing to do. Compaction
+// is not behind while no job can be moved; once the binlog
+// moves on to a new file, prottick calls this again anyway.
+static int64
+compactmaint(Wal *w, int64 now)
+{
+    if (!w->use) return 0;
+
+    if (ratio(w) < 2 || !canmove(w)) {
+        w->cbehind = 0;
+        return 0;
+    }
+    if (!w->cbehind) {
+        w->cbehind = now;
+    }
+    if (now < w->cnext) {
+        return w->cnext - now;
+    }
+
+    w->cnext = now + Compactperiod;
+    walcompact(w, now);
+    if (!w->use || ratio(w) < 2 || !canmove(w)) {
+        w->cbehind = 0;
+        return 0;
+    }
+    return Compactperiod;
+}
+
+
+// Walmaint runs a compaction tick and starts or finishes
+// a snapshot, as needed.
+// Returns the number of nanoseconds until it wants to be
+// called again, or 0 if there is nothing to do.
+int64
+walmaint(Wal *w, int64 now)
 {
-    if (w->use) {
-        walcompact(w);
-        walsync(w);
+    int64 a, b;
+
+    a = compactmaint(w, now);
+    b = walsnapmaint(w, now);
+    if (!a || (b && b < a)) {
+        return b;
     }
+    return a;
 }
 
 
@@ -269,7 +334,7 @@ static int
 balancerest(Wal *w, File *b, int n)
 {
     int rest, c, r;
-    static const int z = sizeof(int) + sizeof(Jobrec);
+    static const int z = Walupdmax;
 
     if (!b) return 1;
 
@@ -362,23 +427,45 @@ reserve(Wal *w, int n)
 }
 
 
+// Walputmax returns the number of bytes walresvput reserves for j:
+// space for the initial job record plus space for a delete to come later.
+int
+walputmax(Job *j)
+{
+    return filefullmax(j) + Walupdmax;
+}
+
+
 // Returns the number of bytes reserved or 0 on error.
 int
 walresvput(Wal *w, Job *j)
 {
-    int z = 0;
+    return reserve(w, walputmax(j));
+}
+
+
+// Walresvputs reserves n bytes for the records of several new jobs,
+// the sum of walputmax for each of them, at once, so that all of
+// their records go in the current file.
+// Returns the number of bytes reserved or 0 on error.
+int
+walresvputs(Wal *w, int n)
+{
+    return reserve(w, n);
+}
 
-    // reserve space for the initial job record
-    z += sizeof(int);
-    z += strlen(j->tube->name);
-    z += sizeof(Jobrec);
-    z += j->r.body_size;
 
-    // plus space for a delete to come later
-    z += sizeof(int);
-    z += sizeof(Jobrec);
+// Walunresv gives back the n bytes of the last reservation in w,
+// made by walresvputs, if no record has been written since.
+void
+walunresv(Wal *w, int n)
+{
+    if (!w->use) return;
 
-    return reserve(w, z);
+    // reserve left at least n bytes in the current file
+    w->cur->resv -= n;
+    w->cur->free += n;
+    w->resv -= n;
 }
 
 
@@ -386,10 +473,40 @@ walresvput(Wal *w, Job *j)
 int
 walresvupdate(Wal *w)
 {
-    int z = 0;
-    z +=sizeof(int);
-    z +=sizeof(Jobrec);
-    return reserve(w, z);
+    return reserve(w, Walupdmax);
+}
+
+
+// Walresvupdates reserves space for n job updates at once, just as
+// n calls to walresvupdate would, but filling a whole file at a time.
+// Returns 1 on success, otherwise 0.
+int
+walresvupdates(Wal *w, int64 n)
+{
+    static const int z = Walupdmax;
+    int64 k;
+
+    if (!w->use) return 1;
+
+    while (n > 0) {
+        k = w->tail->free / z;
+        if (k > n) k = n;
+        if (!k) {
+            if (!makenextfile(w)) {
+                twarnx("makenextfile");
+                return 0;
+            }
+            continue;
+        }
+
+        // Every file's reservation stays a multiple of z, so
+        // there is nothing to balance.
+        w->tail->free -= k * z;
+        w->tail->resv += k * z;
+        w->resv += k * z;
+        n -= k;
+    }
+    return 1;
 }
 
 
@@ -433,40 +550,354 @@ waldirlock(Wal *w)
 }
 
 
-void
-walread(Wal *w, Job *list, int min)
+// Walsavetubes writes the durability classes and times to live of
+// tube names (see tube.c) to file "tubes" in w->dir, replacing it
+// atomically, and syncs it. Each is a line, "<durability> <name>"
+// or "expire <nsec> <name>". They change rarely, so this blocks the
+// caller.
+// Returns 1 on success, otherwise 0.
+int
+walsavetubes(Wal *w)
 {
-    int i;
-    int err = 0;
+    char *tmp, *path;
+    size_t i;
+    FILE *fp = NULL;
+    int fd, ok = 0;
 
-    for (i = min; i < w->next; i++) {
-        File *f = new(File);
-        if (!f) {
+    if (!w->use) return 1;
+
+    tmp = fmtalloc("%s/tubes.tmp", w->dir);
+    path = fmtalloc("%s/tubes", w->dir);
+    if (!tmp || !path) {
+        twarnx("OOM");
+        goto out;
+    }
+
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        twarn("fopen %s", tmp);
+        goto out;
+    }
+    for (i = 0; i < tubedurs.len; i++) {
+        Tubedur *d = tubedurs.items[i];
+        fprintf(fp, "%s %s\n", durnames[d->dur], d->name);
+    }
+    for (i = 0; i < tubettls.len; i++) {
+        Tubettl *l = tubettls.items[i];
+        fprintf(fp, "expire %" PRId64 " %s\n", l->expire, l->name);
+    }
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+        twarn("write %s", tmp);
+        goto out;
+    }
+    if (rename(tmp, path) == -1) {
+        twarn("rename %s", tmp);
+        goto out;
+    }
+    fd = open(w->dir, O_RDONLY);
+    if (fd != -1) {
+        if (fsync(fd) == -1)
+            twarn("fsync %s", w->dir);
+        close(fd);
+    }
+    ok = 1;
+
+out:
+    if (fp && fclose(fp) == EOF) {
+        twarn("fclose %s", tmp);
+        ok = 0;
+    }
+    free(tmp);
+    free(path);
+    return ok;
+}
+
+
+// loadtubes reads the settings of tube names
+// written by walsavetubes, if any.
+static void
+loadtubes(Wal *w)
+{
+    char *path, dur[8], name[MAX_TUBE_NAME_LEN];
+    FILE *fp;
+    int64 ttl;
+    int d;
+
+    path = fmtalloc("%s/tubes", w->dir);
+    if (!path) {
+        twarnx("OOM");
+        exit(1);
+    }
+    fp = fopen(path, "r");
+    if (!fp) {
+        if (errno != ENOENT)
+            twarn("fopen %s", path);
+        free(path);
+        return;
+    }
+
+    // 200 is MAX_TUBE_NAME_LEN-1.
+    while (fscanf(fp, "%7s", dur) == 1) {
+        if (strcmp(dur, "expire") == 0) {
+            if (fscanf(fp, "%" SCNd64 " %200s", &ttl, name) != 2)
+                break;
+            if (!tube_set_expire(name, ttl)) {
+                twarnx("OOM");
+                exit(1);
+            }
+            continue;
+        }
+        if (fscanf(fp, " %200s", name) != 1)
+            break;
+        d = durparse(dur);
+        if (d == -1) {
+            twarnx("%s: unknown durability %s", path, dur);
+            continue;
+        }
+        if (!tube_set_durability(name, d)) {
             twarnx("OOM");
             exit(1);
         }
+    }
+    fclose(fp);
+    free(path);
+}
+
+
+// loadseed reads the seed of the dedup key hash (see dedup.c) from
+// file "dedup" in w->dir, since the binlog holds hashes made with it.
+// If there is no such file yet, or it is bad, it writes the seed
+// prot_init picked there instead.
+static void
+loadseed(Wal *w)
+{
+    char *tmp, *path;
+    uint64 seed[2];
+    FILE *fp;
+    int fd;
+
+    tmp = fmtalloc("%s/dedup.tmp", w->dir);
+    path = fmtalloc("%s/dedup", w->dir);
+    if (!tmp || !path) {
+        twarnx("OOM");
+        exit(1);
+    }
+
+    fp = fopen(path, "r");
+    if (fp) {
+        int n = fscanf(fp, "%" SCNx64 " %" SCNx64, &seed[0], &seed[1]);
+        fclose(fp);
+        if (n == 2) {
+            dedup_seed[0] = seed[0];
+            dedup_seed[1] = seed[1];
+            goto out;
+        }
+        twarnx("%s: bad seed, forgetting the dedup keys", path);
+    } else if (errno != ENOENT) {
+        twarn("fopen %s", path);
+        exit(1);
+    }
+
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        twarn("fopen %s", tmp);
+        exit(1);
+    }
+    fprintf(fp, "%016" PRIx64 " %016" PRIx64 "\n", dedup_seed[0], dedup_seed[1]);
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1 || fclose(fp) == EOF) {
+        twarn("write %s", tmp);
+        exit(1);
+    }
+    if (rename(tmp, path) == -1) {
+        twarn("rename %s", tmp);
+        exit(1);
+    }
+    fd = open(w->dir, O_RDONLY);
+    if (fd != -1) {
+        if (fsync(fd) == -1)
+            twarn("fsync %s", w->dir);
+        close(fd);
+    }
+
+out:
+    free(tmp);
+    free(path);
+}
 
-        if (!fileinit(f, w, i)) {
+
+// Loader hands out binlog files to the threads in walread.
+typedef struct Loader {
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    File **files;
+    int  *loaded;
+    int  nfile;
+    int  next;   // first file not taken by any thread
+} Loader;
+
+
+// loadnext loads the next file not yet taken, if any.
+// Ld->lock must be held; it is released while loading.
+// Returns 1 if it loaded a file, otherwise 0.
+static int
+loadnext(Loader *ld)
+{
+    int i;
+
+    if (ld->next == ld->nfile) {
+        return 0;
+    }
+    i = ld->next++;
+    pthread_mutex_unlock(&ld->lock);
+    fileload(ld->files[i]);
+    pthread_mutex_lock(&ld->lock);
+    ld->loaded[i] = 1;
+    pthread_cond_broadcast(&ld->done);
+    return 1;
+}
+
+
+static void *
+loadloop(void *x)
+{
+    Loader *ld = x;
+
+    pthread_mutex_lock(&ld->lock);
+    while (loadnext(ld));
+    pthread_mutex_unlock(&ld->lock);
+    return NULL;
+}
+
+
+// openfile opens binlog file seq for reading and adds it to w.
+// If path is not NULL, it is the path of the file.
+// Returns the file, or NULL if it can't be opened.
+static File *
+openfile(Wal *w, int seq, char *path)
+{
+    File *f = new(File);
+    if (!f) {
+        twarnx("OOM");
+        exit(1);
+    }
+
+    if (!fileinit(f, w, seq)) {
+        free(f);
+        twarnx("OOM");
+        exit(1);
+    }
+    if (path) {
+        free(f->path);
+        f->path = fmtalloc("%s", path);
+        if (!f->path) {
             free(f);
             twarnx("OOM");
             exit(1);
         }
+    }
 
-        int fd = open(f->path, O_RDONLY);
-        if (fd < 0) {
-            twarn("open %s", f->path);
-            free(f->path);
-            free(f);
-            continue;
+    int fd = open(f->path, O_RDONLY);
+    if (fd < 0) {
+        twarn("open %s", f->path);
+        free(f->path);
+        free(f);
+        return NULL;
+    }
+
+    f->fd = fd;
+    fileadd(f, w);
+    return f;
+}
+
+
+// walread reads binlog files min through w->next-1 into list.
+// Files are mapped and their records decoded and checked in
+// parallel, on up to Walloaders threads. The records are then
+// applied here, file by file in sequence order, as soon as each
+// file is ready, so a later record for a job always wins.
+// The calling thread helps load files when it would
+// otherwise have to wait.
+static void
+walread(Wal *w, Job *list, int min)
+{
+    int i, r, nthread = 0;
+    int err = 0, n = w->next > min ? w->next - min : 0;
+    File *f;
+    long ncpu;
+    pthread_t threads[Walloaders];
+    Loader ld = {.next = 0};
+
+    ld.files = calloc(n + 2, sizeof(File*));
+    ld.loaded = calloc(n + 2, sizeof(int));
+    if (!ld.files || !ld.loaded) {
+        twarnx("OOM");
+        exit(1);
+    }
+
+    // The snapshot, if any, stands in for the files before
+    // w->snapseq, and for the start of that file.
+    if (w->snapseq) {
+        f = openfile(w, w->snapseq, w->snappath);
+        if (f) {
+            f->snap = 1;
+            ld.files[ld.nfile++] = f;
+        }
+        if (min < w->snapseq) {
+            min = w->snapseq;
+        }
+    }
+
+    for (i = min; i < w->next; i++) {
+        f = openfile(w, i, NULL);
+        if (f) {
+            if (i == w->snapseq) {
+                f->skip = w->snapoff;
+            }
+            ld.files[ld.nfile++] = f;
+        }
+    }
+
+    pthread_mutex_init(&ld.lock, NULL);
+    pthread_cond_init(&ld.done, NULL);
+
+    // The loaders check sums concurrently.
+    crcsetup();
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    while (nthread < ld.nfile-1 && nthread < ncpu-1 && nthread < Walloaders) {
+        r = pthread_create(&threads[nthread], NULL, loadloop, &ld);
+        if (r) {
+            errno = r;
+            twarn("pthread_create");
+            break;
+        }
+        nthread++;
+    }
+
+    for (i = 0; i < ld.nfile; i++) {
+        f = ld.files[i];
+
+        pthread_mutex_lock(&ld.lock);
+        while (!ld.loaded[i]) {
+            if (!loadnext(&ld)) {
+                pthread_cond_wait(&ld.done, &ld.lock);
+            }
         }
+        pthread_mutex_unlock(&ld.lock);
 
-        f->fd = fd;
-        fileadd(f, w);
         err |= fileread(f, list);
-        if (close(fd) == -1)
+        if (close(f->fd) == -1)
             twarn("close");
     }
 
+    for (i = 0; i < nthread; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&ld.done);
+    pthread_mutex_destroy(&ld.lock);
+    free(ld.files);
+    free(ld.loaded);
+
     if (err) {
         warnx("Errors reading one or more WAL files.");
         warnx("Continuing. You may be missing data.");
@@ -477,11 +908,37 @@ walread(Wal *w, Job *list, int min)
 void
 walinit(Wal *w, Job *list)
 {
-    int min;
+    int min, i;
 
+    if (!walioinit(w)) {
+        twarnx("walioinit");
+        exit(1);
+    }
+
+    if (!walhkinit(w)) {
+        twarnx("walhkinit");
+        exit(1);
+    }
+
+    // The first stream keeps the tube settings and the dedup seed.
+    if (w->id == 0) {
+        loadtubes(w);
+        loadseed(w);
+    }
+    walsnapscan(w);
     min = walscandir(w);
     walread(w, list, min);
 
+    // The snapshot makes older files obsolete.
+    for (i = min; i < w->snapseq; i++) {
+        char *path = fmtalloc("%s/binlog.%d", w->dir, i);
+        if (path && unlink(path) == -1 && errno != ENOENT) {
+            twarn("unlink %s", path);
+        }
+        free(path);
+    }
+    w->snaprec = -1;
+
     // first writable file
     if (!makenextfile(w)) {
         twarnx("makenextfile");
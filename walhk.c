@@ -0,0 +1,360 @@
+#include "dat.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+// The housekeeping thread takes slow file system work off the event
+// loop and the wal writer: it closes binlog files that are done,
+// unlinks the ones that are no longer needed, and keeps up to
+// Walspares binlog files allocated ahead of time, so the loop never
+// has to wait for falloc when it moves on to a new file.
+//
+// Closes and unlinks are queued in w->hkops and run in order,
+// before any spare is prepared. Running unlinks in order matters:
+// walgc removes files from the head of the log, and a crash must
+// never leave a later file missing while an earlier one remains.
+// An unlink also waits until the writer has acknowledged everything
+// queued before it, since compaction may just have copied the
+// file's last live records into a newer file.
+//
+// A spare is created as spare.N in the wal dir with the version
+// header already written; the loop just renames it to binlog.N.
+//
+// Spares are prepared strictly one after another, and a failed
+// allocation stops the thread until the loop has seen the failure
+// (see walspare). So the loop observes the outcome of each
+// allocation in the same order it would if it called falloc itself.
+
+static char spareprefix[] = "spare.";
+
+enum
+{
+    Hkclose = 1,
+    Hkunlink,
+};
+
+struct Hkop {
+    Hkop  *next;
+    int   op;
+    int   fd;
+    int64 len;  // for Hkclose
+    char  *path; // for Hkunlink
+    uint64 pos;  // for Hkunlink, walqpos when it was queued
+};
+
+
+static void
+hkpush(Wal *w, Hkop *o)
+{
+    pthread_mutex_lock(&w->hklock);
+    if (w->hkopstail) {
+        w->hkopstail->next = o;
+    } else {
+        w->hkops = o;
+    }
+    w->hkopstail = o;
+    if (o->op == Hkunlink) {
+        w->hkunlinks++;
+    }
+    pthread_cond_signal(&w->hkwork);
+    pthread_mutex_unlock(&w->hklock);
+}
+
+
+// Walhkclose queues fd to be synced (if w wants it), truncated to len
+// bytes (if len > 0), and closed. It is called by the writer thread.
+void
+walhkclose(Wal *w, int fd, int64 len)
+{
+    Hkop *o = new(Hkop);
+
+    if (!o) {
+        // Do it right here rather than leak fd.
+        twarnx("OOM");
+        if (len > 0 && ftruncate(fd, len) != 0)
+            twarn("ftruncate");
+        if (close(fd) == -1)
+            twarn("close");
+        return;
+    }
+    o->op = Hkclose;
+    o->fd = fd;
+    o->len = len;
+    hkpush(w, o);
+}
+
+
+// Walhkunlink queues path to be unlinked, once the writer has
+// acknowledged every record queued so far, and takes ownership of path.
+void
+walhkunlink(Wal *w, char *path)
+{
+    Hkop *o = new(Hkop);
+
+    if (!o) {
+        twarnx("OOM");
+        if (unlink(path) == -1)
+            twarn("unlink %s", path);
+        free(path);
+        return;
+    }
+    o->op = Hkunlink;
+    o->path = path;
+
+    // Publish the records now, so the writer does not depend on
+    // the loop to get to pos, while the loop might be waiting for
+    // a spare from us.
+    walqflush(w);
+    o->pos = walqpos(w);
+    hkpush(w, o);
+}
+
+
+// Walhkunlinks returns the number of unlinks not yet done.
+int
+walhkunlinks(Wal *w)
+{
+    int n;
+
+    pthread_mutex_lock(&w->hklock);
+    n = w->hkunlinks;
+    pthread_mutex_unlock(&w->hklock);
+    return n;
+}
+
+
+// hkwaitack waits until the writer has acknowledged pos.
+static void
+hkwaitack(Wal *w, uint64 pos)
+{
+    pthread_mutex_lock(&w->hklock);
+    __atomic_store_n(&w->hkwantack, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&w->ioack, __ATOMIC_SEQ_CST) < pos) {
+        pthread_cond_wait(&w->hkwork, &w->hklock);
+    }
+    __atomic_store_n(&w->hkwantack, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->hklock);
+}
+
+
+// Walhkacked wakes up the housekeeping thread if it is waiting
+// for acknowledgements. It is called by the writer thread after
+// advancing w->ioack.
+void
+walhkacked(Wal *w)
+{
+    if (__atomic_load_n(&w->hkwantack, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&w->hklock);
+        pthread_cond_signal(&w->hkwork);
+        pthread_mutex_unlock(&w->hklock);
+    }
+}
+
+
+static void
+hkrun(Wal *w, Hkop *o)
+{
+    switch (o->op) {
+    case Hkclose:
+        if (w->wantsync && fsync(o->fd) == -1) {
+            twarn("fsync");
+        }
+        if (o->len > 0) {
+            errno = 0;
+            if (ftruncate(o->fd, o->len) != 0) {
+                twarn("ftruncate");
+            }
+        }
+        if (close(o->fd) == -1) {
+            twarn("close");
+        }
+        break;
+    case Hkunlink:
+        hkwaitack(w, o->pos);
+        if (unlink(o->path) == -1) {
+            twarn("unlink %s", o->path);
+        }
+        free(o->path);
+        break;
+    }
+}
+
+
+// mkspare creates and allocates a spare file.
+// Returns 0 on success, and a positive errno otherwise.
+static int
+mkspare(Wal *w, Spare *s, int seq)
+{
+    int fd, r, n;
+    int ver = Walver;
+
+    s->path = fmtalloc("%s/%s%d", w->dir, spareprefix, seq);
+    if (!s->path) {
+        twarnx("OOM");
+        return ENOMEM;
+    }
+
+    fd = open(s->path, O_WRONLY|O_CREAT|O_TRUNC, 0400);
+    if (fd < 0) {
+        r = errno;
+        twarn("open %s", s->path);
+        goto fail;
+    }
+
+    r = falloc(fd, w->filesize);
+    if (r) {
+        errno = r;
+        twarn("falloc %s", s->path);
+        goto fail;
+    }
+
+    n = write(fd, &ver, sizeof(int));
+    if (n < 0 || (size_t)n < sizeof(int)) {
+        r = n < 0 ? errno : ENOSPC;
+        twarn("write %s", s->path);
+        goto fail;
+    }
+
+    s->fd = fd;
+    return 0;
+
+fail:
+    if (fd >= 0 && close(fd) == -1)
+        twarn("close");
+    if (unlink(s->path) == -1 && errno != ENOENT)
+        twarn("unlink %s", s->path);
+    free(s->path);
+    s->path = NULL;
+    return r;
+}
+
+
+static void *
+hkloop(void *x)
+{
+    Wal *w = x;
+    Hkop *o;
+    Spare s;
+    int r, seq;
+
+    pthread_mutex_lock(&w->hklock);
+    for (;;) {
+        while (!w->hkops && (w->nspare == Walspares || w->hkerr)) {
+            pthread_cond_wait(&w->hkwork, &w->hklock);
+        }
+
+        if ((o = w->hkops)) {
+            w->hkops = o->next;
+            if (!w->hkops) {
+                w->hkopstail = NULL;
+            }
+            pthread_mutex_unlock(&w->hklock);
+
+            hkrun(w, o);
+
+            pthread_mutex_lock(&w->hklock);
+            if (o->op == Hkunlink) {
+                w->hkunlinks--;
+            }
+            free(o);
+            continue;
+        }
+
+        seq = w->hkseq++;
+        pthread_mutex_unlock(&w->hklock);
+
+        r = mkspare(w, &s, seq);
+
+        pthread_mutex_lock(&w->hklock);
+        if (r) {
+            w->hkerr = r;
+        } else {
+            w->spares[w->nspare++] = s;
+        }
+        pthread_cond_signal(&w->hkdone);
+    }
+    return NULL;
+}
+
+
+// Walspare takes the oldest spare file, waiting for it
+// to be allocated if necessary.
+// Returns 1 on success. On failure, sets errno and returns 0;
+// the next call will try to allocate a new file.
+int
+walspare(Wal *w, Spare *s)
+{
+    int r = 1;
+
+    pthread_mutex_lock(&w->hklock);
+    while (!w->nspare && !w->hkerr) {
+        pthread_cond_wait(&w->hkdone, &w->hklock);
+    }
+    if (w->nspare) {
+        *s = w->spares[0];
+        w->nspare--;
+        memmove(w->spares, w->spares+1, w->nspare * sizeof(Spare));
+    } else {
+        errno = w->hkerr;
+        w->hkerr = 0;
+        r = 0;
+    }
+    pthread_cond_signal(&w->hkwork);
+    pthread_mutex_unlock(&w->hklock);
+    return r;
+}
+
+
+// rmspares removes spare files left over by a previous process.
+static void
+rmspares(Wal *w)
+{
+    static const int len = sizeof(spareprefix) - 1;
+    DIR *d;
+    struct dirent *e;
+    char *path;
+
+    d = opendir(w->dir);
+    if (!d) return;
+
+    while ((e = readdir(d))) {
+        if (strncmp(e->d_name, spareprefix, len) == 0) {
+            path = fmtalloc("%s/%s", w->dir, e->d_name);
+            if (path && unlink(path) == -1) {
+                twarn("unlink %s", path);
+            }
+            free(path);
+        }
+    }
+
+    closedir(d);
+}
+
+
+// Walhkinit starts the housekeeping thread.
+// Returns 1 on success, otherwise 0.
+int
+walhkinit(Wal *w)
+{
+    int r;
+
+    rmspares(w);
+
+    pthread_mutex_init(&w->hklock, NULL);
+    pthread_cond_init(&w->hkwork, NULL);
+    pthread_cond_init(&w->hkdone, NULL);
+    w->hkseq = 1;
+
+    r = pthread_create(&w->hkthread, NULL, hkloop, w);
+    if (r) {
+        errno = r;
+        twarn("pthread_create");
+        return 0;
+    }
+    return 1;
+}
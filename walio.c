@@ -0,0 +1,542 @@
+#include "dat.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+// The event loop never calls write(2) or fsync(2) on a binlog file.
+// It serializes everything into w->ring, a single-producer,
+// single-consumer byte ring, and a dedicated writer thread drains
+// the ring. All accounting (File.resv, File.free, Wal.alive, and
+// friends) stays on the loop; the writer only ever sees file
+// descriptors and bytes.
+//
+// The ring holds a sequence of frames. Each frame is a Walop
+// header, followed, for Opwrite, by arg bytes of payload.
+// Frames are padded to a multiple of 8 bytes.
+//
+// Positions in the ring are byte counts since startup and never
+// wrap; they are reduced modulo the ring capacity only to index
+// the buffer. The loop stages frames at ring.stage and makes them
+// visible to the writer by publishing ring.wr. The writer frees
+// space by advancing ring.rd and acknowledges durable records by
+// advancing w->ioack (see walqwait).
+
+#define load(p)     __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+enum
+{
+    Opwrite = 1,
+    Opclose,
+};
+
+typedef struct Walop Walop;
+
+struct Walop {
+    int32 op;
+    int32 fd;
+    int64 arg; // payload length for Opwrite, file length for Opclose
+};
+
+#define pad8(n) (((n) + 7) & ~(uint64)7)
+
+
+static void
+ringput(Ring *r, uint64 pos, const void *p, size_t n)
+{
+    size_t off = pos & (r->cap - 1);
+    size_t k = min(n, r->cap - off);
+
+    memcpy(r->buf + off, p, k);
+    memcpy(r->buf, (const byte *)p + k, n - k);
+}
+
+
+static void
+ringget(Ring *r, uint64 pos, void *p, size_t n)
+{
+    size_t off = pos & (r->cap - 1);
+    size_t k = min(n, r->cap - off);
+
+    memcpy(p, r->buf + off, k);
+    memcpy((byte *)p + k, r->buf, n - k);
+}
+
+
+// Walqflush makes every staged frame visible to the writer.
+// The event loop calls it once per iteration.
+void
+walqflush(Wal *w)
+{
+    Ring *r = &w->ring;
+
+    if (!r->buf || r->stage == r->wr) return;
+    store(&r->wr, r->stage);
+    if (load(&w->iosleep)) {
+        pthread_mutex_lock(&w->iolock);
+        pthread_cond_signal(&w->iowork);
+        pthread_mutex_unlock(&w->iolock);
+    }
+}
+
+
+// ringspace blocks until n bytes can be staged in the ring.
+// This only happens when the disk is slower than the clients;
+// it is the same backpressure the loop had when it wrote directly.
+static void
+ringspace(Wal *w, uint64 n)
+{
+    Ring *r = &w->ring;
+
+    if (r->stage + n - load(&r->rd) <= r->cap) return;
+
+    // The writer can only make room by consuming what we have so far.
+    walqflush(w);
+    pthread_mutex_lock(&w->iolock);
+    while (r->stage + n - load(&r->rd) > r->cap) {
+        pthread_cond_wait(&w->iospace, &w->iolock);
+    }
+    pthread_mutex_unlock(&w->iolock);
+}
+
+
+static void
+stage(Wal *w, Walop *op, const void *p, size_t n)
+{
+    Ring *r = &w->ring;
+    uint64 z = pad8(sizeof(Walop) + n);
+
+    ringspace(w, z);
+    ringput(r, r->stage, op, sizeof(Walop));
+    if (n) {
+        ringput(r, r->stage + sizeof(Walop), p, n);
+    }
+    r->last = r->stage;
+    r->stage += z;
+}
+
+
+// extend appends n bytes to the last staged frame, if it is an
+// unpublished Opwrite for fd with room for them. This way all
+// records produced while handling one event reach the writer,
+// and the disk, as a single write.
+// Returns 1 on success, otherwise 0.
+static int
+extend(Wal *w, int fd, const void *p, size_t n, size_t max)
+{
+    Ring *r = &w->ring;
+    Walop op;
+    uint64 end, z;
+
+    if (r->stage == r->wr || r->last < r->wr) return 0;
+    ringget(r, r->last, &op, sizeof op);
+    if (op.op != Opwrite || op.fd != fd || op.arg + n > max) return 0;
+
+    end = r->last + sizeof op + op.arg;
+    z = pad8(sizeof op + op.arg + n);
+    if (r->last + z > r->stage) {
+        ringspace(w, r->last + z - r->stage);
+
+        // Making space might have published the frame.
+        if (r->last < r->wr) return 0;
+    }
+    ringput(r, end, p, n);
+    op.arg += n;
+    ringput(r, r->last, &op, sizeof op);
+    r->stage = r->last + z;
+    return 1;
+}
+
+
+// Walqwrite queues len bytes from buf to be written to fd.
+// It returns 1 on success, or 0 if the writer has failed;
+// in that case nothing is queued.
+int
+walqwrite(Wal *w, int fd, void *buf, int len)
+{
+    Walop op = {.op = Opwrite, .fd = fd};
+    byte *p = buf;
+    size_t max = w->ring.cap / 2 - sizeof(Walop);
+
+    if (load(&w->ioerr)) return 0;
+    if (len > 0 && extend(w, fd, p, len, max)) return 1;
+
+    // Bodies can be larger than the ring; split them
+    // into frames that the writer will join again.
+    while (len > 0) {
+        size_t n = min((size_t)len, max);
+        op.arg = n;
+        stage(w, &op, p, n);
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+
+// Walqclose queues fd to be truncated to len bytes (if len > 0)
+// and closed, after every write queued before it.
+void
+walqclose(Wal *w, int fd, int64 len)
+{
+    Walop op = {.op = Opclose, .fd = fd, .arg = len};
+
+    stage(w, &op, NULL, 0);
+}
+
+
+// Walqpos returns the position just past the last staged frame.
+uint64
+walqpos(Wal *w)
+{
+    return w->ring.stage;
+}
+
+
+// Walqerr returns nonzero if the writer has failed to write.
+int
+walqerr(Wal *w)
+{
+    return load(&w->ioerr);
+}
+
+
+static int
+waitappend(Wal *w, Conn *c, uint64 pos)
+{
+    Walwait *p;
+
+    if (w->waithead && w->waithead == w->nwait) {
+        w->waithead = w->nwait = 0;
+    }
+    if (w->nwait == w->capwait) {
+        size_t ncap = w->capwait ? w->capwait * 2 : 16;
+        p = realloc(w->waits, ncap * sizeof(Walwait));
+        if (!p) {
+            twarnx("OOM");
+            return 0;
+        }
+        w->waits = p;
+        w->capwait = ncap;
+    }
+    w->waits[w->nwait].c = c;
+    w->waits[w->nwait].pos = pos;
+    w->nwait++;
+    return 1;
+}
+
+
+// Walqwait arranges for c to be returned by walqacked once the writer
+// has acknowledged everything staged so far. The caller must see to it
+// that walqflush is called before the loop waits for events. The acknowledgement means
+// the data was handed to the kernel, or, if w syncs on every write
+// (-f0), that it was fsynced too.
+// It returns 1 if c has to wait, or 0 if everything is already acked.
+int
+walqwait(Wal *w, Conn *c)
+{
+    uint64 pos = w->ring.stage;
+
+    if (load(&w->ioack) >= pos) return 0;
+
+    if (!waitappend(w, c, pos)) {
+        // We could not remember c, so let it go without waiting.
+        // This weakens durability, but only under memory pressure.
+        return 0;
+    }
+    store(&w->iowantack, 1);
+
+    // The writer might have acked pos before it saw iowantack,
+    // in which case nobody would wake us up; do it ourselves.
+    if (load(&w->ioack) >= pos) {
+        if (write(w->iopipe, "", 1) == -1 && errno != EAGAIN) {
+            twarn("write");
+        }
+    }
+    return 1;
+}
+
+
+// Walqdrain consumes pending ack notifications from the writer.
+void
+walqdrain(Wal *w)
+{
+    char buf[64];
+
+    while (read(w->sock.fd, buf, sizeof buf) > 0);
+}
+
+
+// Walqacked returns the next waiting conn whose records have been
+// acknowledged, or NULL if there are none.
+Conn *
+walqacked(Wal *w)
+{
+    uint64 ack;
+    Conn *c;
+
+    ack = load(&w->ioack);
+    while (w->waithead < w->nwait && w->waits[w->waithead].pos <= ack) {
+        c = w->waits[w->waithead++].c;
+        if (c) {
+            return c;
+        }
+    }
+    if (w->waithead == w->nwait) {
+        store(&w->iowantack, 0);
+    }
+    return NULL;
+}
+
+
+// Walqunwait forgets c, which is about to be freed.
+void
+walqunwait(Wal *w, Conn *c)
+{
+    size_t i;
+
+    for (i = w->waithead; i < w->nwait; i++) {
+        if (w->waits[i].c == c) {
+            w->waits[i].c = NULL;
+        }
+    }
+}
+
+
+static int
+writeall(int fd, struct iovec *iov, int n)
+{
+    ssize_t r;
+
+    while (n > 0) {
+        r = writev(fd, iov, n);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (byte *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return 0;
+}
+
+
+// iosync fsyncs fd if w wants it and it is time to.
+// Returns 1 if fd still has to be synced later.
+static int
+iosync(Wal *w, int fd)
+{
+    int64 now;
+
+    if (!w->wantsync || fd < 0) return 0;
+
+    now = nanoseconds();
+    if (now < w->lastsync + w->syncrate) return 1;
+
+    w->lastsync = now;
+    if (fsync(fd) == -1) {
+        twarn("fsync");
+    }
+    return 0;
+}
+
+
+static void
+iofail(Wal *w)
+{
+    if (!load(&w->ioerr)) {
+        twarn("write");
+        store(&w->ioerr, 1);
+    }
+}
+
+
+// iowrite writes the run of Opwrite frames for the same fd that
+// starts at *pos, and advances *pos past them.
+static void
+iowrite(Wal *w, uint64 *pos, uint64 end, int fd)
+{
+    Ring *r = &w->ring;
+    struct iovec iov[64];
+    int n = 0;
+    Walop op;
+
+    while (*pos < end && n + 2 <= (int)(sizeof iov / sizeof *iov)) {
+        ringget(r, *pos, &op, sizeof op);
+        if (op.op != Opwrite || op.fd != fd) break;
+
+        size_t off = (*pos + sizeof op) & (r->cap - 1);
+        size_t k = min((size_t)op.arg, r->cap - off);
+        iov[n].iov_base = r->buf + off;
+        iov[n].iov_len = k;
+        n++;
+        if (k < (size_t)op.arg) {
+            iov[n].iov_base = r->buf;
+            iov[n].iov_len = op.arg - k;
+            n++;
+        }
+        *pos += pad8(sizeof op + op.arg);
+    }
+
+    if (!load(&w->ioerr) && writeall(fd, iov, n) == -1) {
+        iofail(w);
+    }
+}
+
+
+// ioclose hands fd over to the housekeeping thread to be closed.
+// Under -f0 it syncs fd first, since records must be on disk
+// before they are acknowledged.
+static void
+ioclose(Wal *w, int fd, int64 len)
+{
+    if (w->wantsync && w->syncrate == 0 && !load(&w->ioerr) && fsync(fd) == -1) {
+        twarn("fsync");
+    }
+    walhkclose(w, fd, len);
+}
+
+
+// iowait waits for the loop to publish more frames and returns
+// the end of published data. If dirty is set, it gives up when
+// it is time to sync, and returns w->ring.rd.
+static uint64
+iowait(Wal *w, int dirty)
+{
+    Ring *r = &w->ring;
+    struct timespec ts;
+    int64 t;
+    uint64 wr;
+
+    wr = load(&r->wr);
+    if (wr != r->rd) return wr;
+
+    t = w->lastsync + w->syncrate;
+    ts.tv_sec = t / 1000000000;
+    ts.tv_nsec = t % 1000000000;
+
+    pthread_mutex_lock(&w->iolock);
+    store(&w->iosleep, 1);
+    while ((wr = load(&r->wr)) == r->rd) {
+        if (!dirty) {
+            pthread_cond_wait(&w->iowork, &w->iolock);
+        } else if (pthread_cond_timedwait(&w->iowork, &w->iolock, &ts)) {
+            break;
+        }
+    }
+    store(&w->iosleep, 0);
+    pthread_mutex_unlock(&w->iolock);
+    return wr;
+}
+
+
+static void *
+ioloop(void *x)
+{
+    Wal *w = x;
+    Ring *r = &w->ring;
+    uint64 pos, end;
+    int fd = -1, dirty = 0;
+    Walop op;
+
+    for (;;) {
+        end = iowait(w, dirty);
+        pos = r->rd;
+        while (pos < end) {
+            ringget(r, pos, &op, sizeof op);
+            switch (op.op) {
+            case Opwrite:
+                if (fd != op.fd && w->syncrate == 0) {
+                    iosync(w, fd);
+                }
+                fd = op.fd;
+                iowrite(w, &pos, end, fd);
+                break;
+            case Opclose:
+                ioclose(w, op.fd, op.arg);
+                if (fd == op.fd) {
+                    fd = -1;
+                }
+                pos += pad8(sizeof op);
+                break;
+            default:
+                twarnx("bad wal op %d", op.op);
+                store(&w->ioerr, 1);
+                pos = end;
+            }
+        }
+
+        // Free the space before syncing, so the loop can keep going.
+        pthread_mutex_lock(&w->iolock);
+        store(&r->rd, end);
+        pthread_cond_signal(&w->iospace);
+        pthread_mutex_unlock(&w->iolock);
+
+        dirty = iosync(w, fd);
+
+        store(&w->ioack, end);
+        walhkacked(w);
+        if (load(&w->iowantack)) {
+            if (write(w->iopipe, "", 1) == -1 && errno != EAGAIN) {
+                twarn("write");
+            }
+        }
+    }
+    return NULL;
+}
+
+
+// Walioinit allocates the ring and starts the writer thread.
+// Returns 1 on success, otherwise 0.
+int
+walioinit(Wal *w)
+{
+    int r, fds[2];
+    Ring *rg = &w->ring;
+
+    rg->cap = Walringsize;
+    rg->buf = malloc(rg->cap);
+    if (!rg->buf) {
+        twarnx("OOM");
+        return 0;
+    }
+
+    if (pipe(fds) == -1) {
+        twarn("pipe");
+        return 0;
+    }
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1) {
+        twarn("fcntl");
+        return 0;
+    }
+    w->sock.fd = fds[0];
+    w->sock.x = w;
+    w->sock.f = (Handle)h_walack;
+    w->iopipe = fds[1];
+
+    pthread_mutex_init(&w->iolock, NULL);
+    pthread_cond_init(&w->iowork, NULL);
+    pthread_cond_init(&w->iospace, NULL);
+
+    r = pthread_create(&w->iothread, NULL, ioloop, w);
+    if (r) {
+        errno = r;
+        twarn("pthread_create");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,328 @@
+#include "dat.h"
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// A snapshot holds every live job as of some point in the binlog,
+// so recovery can start there instead of at the oldest binlog file,
+// and takes time proportional to the number of live jobs.
+//
+// Every w->snapperiod nanoseconds, if anything has been written
+// since the last snapshot, walsnap forks. The child has a
+// copy-on-write view of the jobs. It closes the server's sockets
+// and files, writes the jobs to snap.tmp.P, where P is the server's
+// pid, with filesnap, syncs it, and renames it to snap.S.O, where S
+// is the binlog file that was current at the fork and O is how many
+// bytes had been written to it. The loop goes on meanwhile and
+// checks on the child in walsnapmaint.
+//
+// At startup, the latest snapshot is read first, as if it were the
+// oldest binlog file, followed by file S from offset O on and the
+// files after it. Files before S are not needed.
+//
+// Once a snapshot is complete, the binlog files before S and the
+// previous snapshot are unlinked. Their File structs stay in w
+// until walgc frees them, since jobs still refer to them.
+//
+// A snapshot depends on every binlog file from S on. Before walgc
+// removes file S, it drops the snapshot (walsnapdrop). Since walgc
+// only ever removes the oldest file, reading all remaining binlog
+// files is then correct again.
+
+enum
+{
+    Snappoll = 100000000 // check on the child every 100ms
+};
+
+static char snapbase[] = "snap.";
+static char snaptmp[] = "snap.tmp.";
+
+
+// Walsnapscan finds the latest snapshot in w->dir and sets
+// w->snapseq, w->snapoff, and w->snappath. It removes older
+// snapshots and any unfinished one.
+// Returns w->snapseq, which is 0 if there is no snapshot.
+int
+walsnapscan(Wal *w)
+{
+    static const int len = sizeof(snapbase) - 1;
+    DIR *d;
+    struct dirent *e;
+    char *path, *old, *p, *q;
+    long seq;
+    int64 off;
+    int ok;
+
+    d = opendir(w->dir);
+    if (!d) return 0;
+
+    while ((e = readdir(d))) {
+        if (strncmp(e->d_name, snapbase, len) != 0) continue;
+
+        seq = strtol(e->d_name+len, &p, 10);
+        ok = p != e->d_name+len && *p == '.' && seq > 0 && seq < INT32_MAX;
+        if (ok) {
+            off = strtoll(p+1, &q, 10);
+            ok = q != p+1 && *q == '\0' && off >= (int64)sizeof(int);
+        }
+
+        path = fmtalloc("%s/%s", w->dir, e->d_name);
+        if (!path) {
+            twarnx("OOM");
+            continue;
+        }
+        if (ok && seq > w->snapseq) {
+            old = w->snappath;
+            w->snappath = path;
+            w->snapseq = seq;
+            w->snapoff = off;
+            path = old;
+        }
+        if (path && unlink(path) == -1) {
+            twarn("unlink %s", path);
+        }
+        free(path);
+    }
+
+    closedir(d);
+    return w->snapseq;
+}
+
+
+// closefds closes every file descriptor but stdin, stdout and stderr.
+// It runs in the child process, so that the child does not hold on
+// to the server's sockets and binlog files while it writes.
+static void
+closefds(void)
+{
+    struct rlimit rl;
+    int fd, max = 1024;
+
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, 3, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        max = rl.rlim_cur;
+    }
+    for (fd = 3; fd < max; fd++) {
+        close(fd);
+    }
+}
+
+
+// snapchild writes a snapshot to tmp and renames it to path.
+// It runs in the child process; ppid is the server's pid.
+// Returns 1 on success, otherwise 0.
+static int
+snapchild(Wal *w, char *tmp, char *path, int ppid)
+{
+    int fd;
+
+    closefds();
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0400);
+    if (fd == -1) {
+        twarn("open %s", tmp);
+        return 0;
+    }
+    if (!filesnap(w, fd)) {
+        goto fail;
+    }
+    if (fsync(fd) == -1) {
+        twarn("fsync %s", tmp);
+        goto fail;
+    }
+    close(fd);
+
+    // If the server is gone, another one may own the dir by now.
+    if (getppid() != ppid) {
+        unlink(tmp);
+        return 0;
+    }
+    if (rename(tmp, path) == -1) {
+        twarn("rename %s", tmp);
+        unlink(tmp);
+        return 0;
+    }
+
+    fd = open(w->dir, O_RDONLY);
+    if (fd != -1) {
+        if (fsync(fd) == -1)
+            twarn("fsync %s", w->dir);
+        close(fd);
+    }
+    return 1;
+
+fail:
+    close(fd);
+    unlink(tmp);
+    return 0;
+}
+
+
+// walsnap forks a child to write a snapshot.
+static void
+walsnap(Wal *w)
+{
+    int seq = w->cur->seq;
+    int64 off = w->filesize - w->cur->free - w->cur->resv;
+    int pid, ppid = getpid();
+    char *tmp, *path;
+
+    // The name is made here, since the child must not allocate.
+    tmp = fmtalloc("%s/%s%d", w->dir, snaptmp, ppid);
+    path = fmtalloc("%s/%s%d.%"PRId64, w->dir, snapbase, seq, off);
+    if (!tmp || !path) {
+        twarnx("OOM");
+        free(tmp);
+        free(path);
+        return;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        twarn("fork");
+        free(tmp);
+        free(path);
+        return;
+    }
+    if (pid == 0) {
+        _exit(!snapchild(w, tmp, path, ppid));
+    }
+
+    free(tmp);
+    w->snappid = pid;
+    w->snapnewseq = seq;
+    w->snapnewoff = off;
+    w->snapnewpath = path;
+    w->snaprec = w->nrec;
+}
+
+
+// Walsnapdrop unlinks the latest snapshot, if there is one.
+void
+walsnapdrop(Wal *w)
+{
+    File *f;
+
+    if (!w->snappath) return;
+
+    // A snapshot read at startup has the same path.
+    for (f = w->head; f; f = f->next) {
+        if (f->snap) {
+            f->gone = 1;
+        }
+    }
+    walhkunlink(w, w->snappath);
+    w->snappath = NULL;
+    w->snapseq = 0;
+    w->snapoff = 0;
+}
+
+
+// snapdone makes the snapshot just written the latest one,
+// and unlinks the files it makes obsolete.
+static void
+snapdone(Wal *w)
+{
+    char *path = w->snapnewpath;
+    File *f;
+
+    w->snapnewpath = NULL;
+    for (f = w->head; f; f = f->next) {
+        if (!f->snap && f->seq == w->snapnewseq) break;
+    }
+    if (!f) {
+        // Walgc removed file S in the meantime, so
+        // this snapshot is no good.
+        walhkunlink(w, path);
+        return;
+    }
+
+    walsnapdrop(w);
+    for (f = w->head; f; f = f->next) {
+        if (!f->snap && f->seq >= w->snapnewseq) break;
+        if (!f->gone) {
+            char *p = fmtalloc("%s", f->path);
+            if (!p) {
+                twarnx("OOM");
+                continue;
+            }
+            walhkunlink(w, p);
+            f->gone = 1;
+        }
+    }
+
+    w->snappath = path;
+    w->snapseq = w->snapnewseq;
+    w->snapoff = w->snapnewoff;
+    w->nsnap++;
+}
+
+
+// snapwait checks whether the child writing a snapshot has exited.
+// Returns 1 if it has, otherwise 0.
+static int
+snapwait(Wal *w)
+{
+    int r, status;
+
+    r = waitpid(w->snappid, &status, WNOHANG);
+    if (r == 0) {
+        return 0;
+    }
+
+    w->snappid = 0;
+    if (r == -1) {
+        twarn("waitpid");
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        twarnx("snapshot failed");
+    } else {
+        snapdone(w);
+        return 1;
+    }
+    free(w->snapnewpath);
+    w->snapnewpath = NULL;
+    return 1;
+}
+
+
+// Walsnapmaint starts a snapshot if one is due, and checks
+// on the one being written, if any.
+// Returns the number of nanoseconds until it wants to be
+// called again, or 0 if there is nothing to do.
+int64
+walsnapmaint(Wal *w, int64 now)
+{
+    if (w->snappid && !snapwait(w)) {
+        return Snappoll;
+    }
+    if (!w->use || !w->snapperiod) {
+        return 0;
+    }
+
+    if (!w->snapnext) {
+        w->snapnext = now + w->snapperiod;
+    }
+    if (now >= w->snapnext) {
+        w->snapnext = now + w->snapperiod;
+        if (w->nrec != w->snaprec) {
+            walsnap(w);
+            if (w->snappid) {
+                return Snappoll;
+            }
+        }
+    }
+    return w->snapnext - now;
+}